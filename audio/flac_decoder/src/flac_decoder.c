@@ -2,26 +2,47 @@
 #include <memory.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <setjmp.h>
 
-#define err(x) puts(x);exit(1);
+#include "flac_decoder.h"
 
-const uint8_t use_wave = true;
+#define err(x) raise_flac_error(x);
+#define log_info(...) {if(decoding.verbose) printf(__VA_ARGS__);}
 
-const char* channel_descriptions[] = {
-    "1 (mono)",
-    "2 (left, right)",
-    "3 (left, right, center)",
-    "4 (front left, front right, back left, back right)",
-    "5 (front left, front right, front center, back left, back right)",
-    "6 (front left, front right, front center, LFE, back left, back right)",
-    "7 (front left, front right, front center, LFE, back center, side left, side right)",
-    "8 (front left, front right, front center, LFE, back left, back right, side left, side right)",
-    "2 (left/side)",
-    "2 (right/side)",
-    "2 (mid/side)"
+// Largest number of samples a frame can hold
+#define MAX_BLOCK_SIZE 65535
+// The file is read into a buffer with this many bytes of ones after it, so frames only need
+// checking against the end at partition boundaries. A partition of the largest block can read
+// this far past the end before it is caught, and ones end unary codes so it can't spin there.
+#define INPUT_PADDING (MAX_BLOCK_SIZE*4 + 256)
+
+static const uint8_t use_wave = true;
+
+// What the thread's decode has open, for an error to close and free on its way back out of
+// decode_flac_file. A half written output file is removed.
+struct flac_decode {
+    jmp_buf jump;
+    const char* error;
+    bool verbose;
+    FILE* file;
+    uint8_t* file_data;
+    char* output_name;
+    FILE* output_file;
+    int64_t* audio_data;
 };
 
-const char* picture_types[] = {
+static _Thread_local struct flac_decode decoding;
+
+static _Noreturn void raise_flac_error(const char* message) {
+    decoding.error = message;
+    longjmp(decoding.jump,1);
+}
+
+static void log_bytes(const uint8_t* data, size_t length) {
+    if(decoding.verbose) fwrite(data,length,1,stdout);
+}
+
+static const char* picture_types[] = {
     "Other",
     "32x32 icon",
     "General icon",
@@ -44,7 +65,7 @@ const char* picture_types[] = {
     "Band / artist logotype",
     "Publisher / studio logotype"
 };
-const int64_t fixed_prediction_data[15] = {
+static const int64_t fixed_prediction_data[15] = {
     0,5,6,8,11,
     1,
     2,-1,
@@ -65,26 +86,30 @@ typedef struct {
     uint8_t read;
 } StreamInfo;
 
-int64_t predict(const int64_t* audio, const int64_t* pred, const int8_t order, const int8_t right_shift) {
-    int64_t output = 0;
+// Summed unsigned, as corrupt residuals can push samples far enough for the products to overflow.
+// Those samples are rejected by check_samples once the subframe is done.
+static int64_t predict(const int64_t* audio, const int64_t* pred, const int8_t order, const int8_t right_shift) {
+    uint64_t output = 0;
     for(int i = 0; i < order; i++) {
-        output += audio[-1-i] * pred[i];
+        output += (uint64_t)audio[-1-i] * (uint64_t)pred[i];
     }
-    return output >> right_shift;
+    return (int64_t)output >> right_shift;
 }
 
 typedef struct {
     uint8_t* data;
     uint64_t current_read;
+    // Bits of the file left after data, anything past them coming from padding
+    uint64_t bit_length;
 } BitstreamState;
 
-uint8_t read_bit(BitstreamState* state) {
+static uint8_t read_bit(BitstreamState* state) {
     uint8_t output = (state->data[state->current_read>>3] >> (~state->current_read&0x7))&1;
     state->current_read++;
     //printf("Read bit: %d\n",output);
     return output;
 }
-uint64_t read_bits(BitstreamState* state, uint8_t bit_count) {
+static uint64_t read_bits(BitstreamState* state, uint8_t bit_count) {
     uint64_t output = 0;
     for(int i = 0; i < bit_count; i++) {
         output <<= 1;
@@ -94,21 +119,39 @@ uint64_t read_bits(BitstreamState* state, uint8_t bit_count) {
     //printf("Read %d bits: %lld\n",bit_count,output);
     return output;
 }
-int64_t read_bits_signed(BitstreamState* state, uint8_t bit_count) {
-    int64_t x = read_bits(state, bit_count);
-    if(x >= 1<<(bit_count-1)) {
-        return x-(1<<bit_count);
-    } else {
-        return x;
-    }
+// Sign extends from any width up to the 33 bits of a 32 bit side channel
+static int64_t read_bits_signed(BitstreamState* state, uint8_t bit_count) {
+    if(bit_count == 0) return 0;
+    uint64_t x = read_bits(state, bit_count);
+    return (int64_t)(x << (64-bit_count)) >> (64-bit_count);
 }
-uint64_t read_unary(BitstreamState* state) {
+static uint64_t read_unary(BitstreamState* state) {
     uint64_t output = 0;
     while(!read_bit(state)) {output++;}
     return output;
 }
+static void check_bitstream(const BitstreamState* state) {
+    if(state->current_read > state->bit_length) {err("Error: unexpected end of file");}
+}
+
+// Shifts a run of samples left, as a plain loop on unsigned values so it vectorises and is
+// well defined for negative samples
+static void shift_samples(int64_t* samples, uint32_t count, uint8_t shift) {
+    for(uint32_t i = 0; i < count; i++) {
+        samples[i] = (uint64_t)samples[i] << shift;
+    }
+}
+
+// Decoded samples have to fit in the subframe's bit depth, which keeps the shifts and channel
+// decorrelation after it from overflowing
+static void check_samples(const int64_t* samples, uint32_t count, uint8_t sample_bits) {
+    int64_t limit = (int64_t)1 << (sample_bits-1);
+    for(uint32_t i = 0; i < count; i++) {
+        if(samples[i] < -limit || samples[i] >= limit) {err("Error: sample out of range");}
+    }
+}
 
-void predict_subframe(BitstreamState* state, int64_t* channel_data, uint32_t block_size, uint8_t order, const int64_t* qlp_coeffs, uint8_t qlp_rightshift) {
+static void predict_subframe(BitstreamState* state, int64_t* channel_data, uint32_t block_size, uint8_t order, const int64_t* qlp_coeffs, uint8_t qlp_rightshift) {
     if(read_bit(state)) {err("Error: invalid bitstream");}
     uint8_t rice_parameter_length = read_bit(state)+4;
     uint8_t partition_order = read_bits(state,4);
@@ -118,6 +161,7 @@ void predict_subframe(BitstreamState* state, int64_t* channel_data, uint32_t blo
     bool rice_escaped;
     for(int i = order; i < block_size; i++) {
         if(bucket_remaining <= 0) {
+            check_bitstream(state);
             rice_parameter = read_bits(state,rice_parameter_length);
             rice_escaped = rice_parameter == (1<<rice_parameter_length)-1;
             if(rice_escaped) {
@@ -142,29 +186,31 @@ void predict_subframe(BitstreamState* state, int64_t* channel_data, uint32_t blo
                 residual >>= 1;
             }
         }
-        channel_data[i] = residual + predict(channel_data+i, qlp_coeffs, order, qlp_rightshift);
+        channel_data[i] = (int64_t)((uint64_t)residual + (uint64_t)predict(channel_data+i, qlp_coeffs, order, qlp_rightshift));
         bucket_remaining--;
     }
 }
 
-int main(int argc, char* argv[]) {
-    if(argc < 2) {
-        exit(1);
-    }
-    FILE* file = fopen(argv[1],"rb");
+static void decode_stream(const char* name) {
+    FILE* file = fopen(name,"rb");
     if(file == NULL) {err("Error: no such file or directory");}
+    decoding.file = file;
     fseek(file,0,SEEK_END);
     long file_length = ftell(file);
     fseek(file,0,SEEK_SET);
-    uint8_t* file_data = malloc(file_length);
+    uint8_t* file_data = malloc(file_length + INPUT_PADDING);
     if(file_data == NULL) {err("Error: unable to allocate memory");}
+    decoding.file_data = file_data;
     if(fread(file_data,1,file_length,file) != file_length) {err("Error: unable to read full file");}
     fclose(file);
+    decoding.file = NULL;
+    memset(file_data + file_length,0xff,INPUT_PADDING);
     if(memcmp(file_data,"fLaC",4)!=0) {err("Error: Not a FLAC file!");}
     StreamInfo stream_info;
     long file_offset = 4;
     stream_info.read = 0;
     while(true) {
+        if(file_offset + 4 > file_length) {err("Error: unexpected end of file");}
         uint8_t block_type = file_data[file_offset]&0x7f;
         bool is_last_block = file_data[file_offset]>=0x80;
         uint32_t block_size = 0;
@@ -173,59 +219,71 @@ int main(int argc, char* argv[]) {
         block_size |= file_data[file_offset+2];
         block_size <<= 8;
         block_size |= file_data[file_offset+3];        
+        if(block_size > file_length - file_offset - 4) {err("Error: unexpected end of file");}
         uint8_t* block_data = file_data + file_offset + 4;
         if(file_offset == 4) {
             if(block_type != 0) {err("Error: missing or incorrectly placed Streaminfo block");}
+            if(block_size < 34) {err("Error: invalid Streaminfo block");}
             stream_info.read = 1;
             stream_info.minimum_block_size = block_data[0]<<8 | block_data[1];
             stream_info.maximum_block_size = block_data[2]<<8 | block_data[3];
             stream_info.minimum_frame_size = block_data[4]<<16 | block_data[5]<<8 | block_data[6];
             stream_info.maximum_frame_size = block_data[7]<<16 | block_data[8]<<8 | block_data[9];
             stream_info.sample_rate = block_data[10]<<12 | block_data[11]<<4 | (block_data[12]>>4);
-            stream_info.channel_count = 1 + (block_data[12]>>1) & 0x7;
+            stream_info.channel_count = 1 + ((block_data[12]>>1) & 0x7);
             stream_info.bit_depth = 1 + (((block_data[12]&1)<<4) | block_data[13]>>4);
             stream_info.sample_count = ((uint64_t)block_data[13]&0xf)<<32 | block_data[14]<<24 | block_data[15]<<16 | block_data[16]<<8 | block_data[16];
-            printf("File info:\n");
-            printf("Sample rate: %d\n",stream_info.sample_rate);
-            printf("Length: %llu samples (%f seconds)\n",stream_info.sample_count,(stream_info.sample_count/(double)stream_info.sample_rate));
-            printf("Channels: %d\n",stream_info.channel_count);
-            printf("Bit depth: %d\n",stream_info.bit_depth);
-            printf("Block sizes: [%hd, %hd]\n",stream_info.minimum_block_size, stream_info.maximum_block_size);
-            printf("Frame sizes: [%d, %d]\n",stream_info.minimum_frame_size, stream_info.maximum_frame_size);
+            if(stream_info.sample_rate == 0) {err("Error: invalid sample rate!");}
+            log_info("File info:\n");
+            log_info("Sample rate: %d\n",stream_info.sample_rate);
+            log_info("Length: %llu samples (%f seconds)\n",stream_info.sample_count,(stream_info.sample_count/(double)stream_info.sample_rate));
+            log_info("Channels: %d\n",stream_info.channel_count);
+            log_info("Bit depth: %d\n",stream_info.bit_depth);
+            log_info("Block sizes: [%hd, %hd]\n",stream_info.minimum_block_size, stream_info.maximum_block_size);
+            log_info("Frame sizes: [%d, %d]\n",stream_info.minimum_frame_size, stream_info.maximum_frame_size);
         } else {
             if(block_type == 0) {
                 err("Error: misordered stream info block");
             } else if(block_type == 4) {
+                // Every length is checked against what is left of the block before it is used
+                if(block_size < 8) {err("Error: invalid comment block");}
                 uint32_t vendor_length = block_data[0] | block_data[1]<<8 | block_data[2]<<16 | block_data[3]<<24;
                 uint32_t comment_data_pointer = 4;
-                printf("Vendor: ");
-                fwrite(block_data+comment_data_pointer,vendor_length,1,stdout);
-                printf("\n");
+                if(vendor_length > block_size - 8) {err("Error: invalid comment block");}
+                log_info("Vendor: ");
+                log_bytes(block_data+comment_data_pointer,vendor_length);
+                log_info("\n");
                 comment_data_pointer += vendor_length;
                 uint32_t comment_count = block_data[comment_data_pointer] | block_data[comment_data_pointer+1]<<8 | block_data[comment_data_pointer+2]<<16 | block_data[comment_data_pointer+3]<<24;
                 comment_data_pointer += 4;
                 for(int i = 0; i < comment_count; i++) {
+                    if(block_size - comment_data_pointer < 4) {err("Error: invalid comment block");}
                     uint32_t comment_lengh = block_data[comment_data_pointer] | block_data[comment_data_pointer+1]<<8 | block_data[comment_data_pointer+2]<<16 | block_data[comment_data_pointer+3]<<24;
                     comment_data_pointer += 4;
-                    fwrite(block_data+comment_data_pointer,comment_lengh,1,stdout);
+                    if(comment_lengh > block_size - comment_data_pointer) {err("Error: invalid comment block");}
+                    log_bytes(block_data+comment_data_pointer,comment_lengh);
                     comment_data_pointer += comment_lengh;
-                    printf("\n");
+                    log_info("\n");
                 }
             } else if(block_type == 6) {
-                printf("Attached picture: ");
+                log_info("Attached picture: ");
+                // Eight 32 bit fields around the MIME type and description
+                if(block_size < 32) {err("Error: invalid picture block");}
                 uint32_t image_type = block_data[0]<<24 | block_data[1]<<16 | block_data[2]<<8 | block_data[3];
                 if(image_type <= 20) {
-                    printf("%s",picture_types[image_type]);
+                    log_info("%s",picture_types[image_type]);
                 } else {
-                    printf("Unknown with id %d",image_type);
+                    log_info("Unknown with id %d",image_type);
                 }
                 uint32_t image_type_length = block_data[4]<<24 | block_data[5]<<16 | block_data[6]<<8 | block_data[7];
-                printf(" (");
-                fwrite(block_data+8,image_type_length,1,stdout);
-                printf(")");
+                if(image_type_length > block_size - 32) {err("Error: invalid picture block");}
+                log_info(" (");
+                log_bytes(block_data+8,image_type_length);
+                log_info(")");
                 uint32_t image_block_index = 8 + image_type_length;
                 uint32_t description_length = block_data[image_block_index]<<24 | block_data[image_block_index+1]<<16 | block_data[image_block_index+2]<<8 | block_data[image_block_index+3];
-                image_block_index += 4;
+                if(description_length > block_size - 32 - image_type_length) {err("Error: invalid picture block");}
+                image_block_index += 4 + description_length;
                 uint32_t image_width = block_data[image_block_index]<<24 | block_data[image_block_index+1]<<16 | block_data[image_block_index+2]<<8 | block_data[image_block_index+3];
                 image_block_index += 4;
                 uint32_t image_height = block_data[image_block_index]<<24 | block_data[image_block_index+1]<<16 | block_data[image_block_index+2]<<8 | block_data[image_block_index+3];
@@ -236,9 +294,9 @@ int main(int argc, char* argv[]) {
                 image_block_index += 4;
                 uint32_t image_filesize = block_data[image_block_index]<<24 | block_data[image_block_index+1]<<16 | block_data[image_block_index+2]<<8 | block_data[image_block_index+3];
                 if(image_width != 0 && image_height != 0) {
-                    printf(" [%dx%d]",image_width, image_height);
+                    log_info(" [%dx%d]",image_width, image_height);
                 }
-                printf(", %d bytes\n",image_filesize);
+                log_info(", %d bytes\n",image_filesize);
             } else {}
         }
 
@@ -247,14 +305,21 @@ int main(int argc, char* argv[]) {
     }
     if(stream_info.read == 0) {err("Error: no streaminfo found!");}
 
-    char* filename = malloc(strlen(argv[1] + 10));
+    char* filename = malloc(strlen(name) + 10);
+    if(filename == NULL) {err("Error: unable to allocate memory");}
+    decoding.output_name = filename;
     if(use_wave) {
-        sprintf(filename,"%s.wav",argv[1]);
+        sprintf(filename,"%s.wav",name);
     } else {
-        sprintf(filename,"%s.dat",argv[1]);
+        sprintf(filename,"%s.dat",name);
     }
     FILE* output_file = fopen(filename, "wb");
-    free(filename);
+    if(output_file == NULL) {
+        free(filename);
+        decoding.output_name = NULL;
+        err("Error: unable to open output file");
+    }
+    decoding.output_file = output_file;
     if(use_wave) {
         fseek(output_file,44,SEEK_SET);
     }
@@ -323,8 +388,9 @@ int main(int argc, char* argv[]) {
             case 3: block_size=1152;break;
             case 4: block_size=2304;break;
             case 5: block_size=4608;break;
-            case 6: block_size=file_data[file_offset++];break;
-            case 7: block_size=file_data[file_offset]<<8|file_data[file_offset+1];file_offset+=2;break;
+            // Explicit sizes are stored less one
+            case 6: block_size=file_data[file_offset++]+1;break;
+            case 7: block_size=(file_data[file_offset]<<8|file_data[file_offset+1])+1;file_offset+=2;break;
             default: block_size=(1<<block_size_signal);
         }
         
@@ -360,6 +426,9 @@ int main(int argc, char* argv[]) {
             case 7: bit_depth=32;break;
         }
         
+        // The header is read from padding if the file ends inside it, which fails here before the CRC
+        if(file_offset >= file_length) {err("Error: unexpected end of file");}
+
         uint8_t channel_count = channel_layout_signal + 1;
         if(channel_layout_signal >= 8) {
             if(channel_layout_signal > 10) {
@@ -395,43 +464,58 @@ int main(int argc, char* argv[]) {
         } else {
             seconds = block_id * block_size / stream_info.sample_rate;
         }
-        printf("Processing %llu seconds (%llu)\n",seconds, block_id);
-        fflush(stdout);
+        log_info("Processing %llu seconds (%llu)\n",seconds, block_id);
+        if(decoding.verbose) fflush(stdout);
         
 
         BitstreamState state = {
             .data = (file_data + file_offset),
-            .current_read = 0
+            .current_read = 0,
+            .bit_length = (uint64_t)(file_length - file_offset) * 8
         };
         int64_t qlp_coeffs[32];
         int64_t* audio_data = malloc(8*block_size*channel_count);
+        if(audio_data == NULL) {err("Error: unable to allocate memory");}
+        decoding.audio_data = audio_data;
         for(int i = 0; i < channel_count; i++) {
             if(read_bit(&state)) {
                 err("Error: lost subframe sync!");
             }
             uint8_t prediction_mode = read_bits(&state,6);
+            // Low bits that are zero in every sample are left out, the rest decoded at a lower depth
+            uint64_t wasted_bits = 0;
             if(read_bit(&state)) {
-                err("Error: wasted bits are not yet supported");
+                wasted_bits = read_unary(&state) + 1;
             }
             int64_t* channel_data = audio_data + (block_size * i);
             uint8_t sample_bits = bit_depth;
-            printf("Prediction mode: %d\n",prediction_mode);
+            log_info("Prediction mode: %d\n",prediction_mode);
             if(channel_layout_signal == 8 && i == 1) sample_bits += 1;
             if(channel_layout_signal == 9 && i == 0) sample_bits += 1;
             if(channel_layout_signal == 10 && i == 1) sample_bits += 1;
+            if(wasted_bits >= sample_bits) {err("Error: invalid wasted bits");}
+            sample_bits -= wasted_bits;
             if(prediction_mode == 0) {
-                int64_t data = read_bits(&state,sample_bits);
+                int64_t data = read_bits_signed(&state,sample_bits);
                 for(int i = 0; i < block_size; i++) {
                     channel_data[i] = data;
                 }
+            } else if(prediction_mode == 1) {
+                // Verbatim samples aren't split into partitions, so they're checked up front
+                if(state.current_read + (uint64_t)block_size*sample_bits > state.bit_length) {err("Error: unexpected end of file");}
+                for(int i = 0; i < block_size; i++) {
+                    channel_data[i] = read_bits_signed(&state,sample_bits);
+                }
             } else if(prediction_mode >= 8 && prediction_mode <= 12) {
                 uint8_t order = prediction_mode - 8;
+                if(order > block_size) {err("Error: predictor order exceeds block size");}
                 for(int i = 0; i < order; i++) {
                     channel_data[i] = read_bits_signed(&state,sample_bits);
                 }
                 predict_subframe(&state, channel_data, block_size, order, fixed_prediction_data+fixed_prediction_data[order], 0);
             } else if(prediction_mode >= 32) {
                 uint8_t order = prediction_mode - 31;
+                if(order > block_size) {err("Error: predictor order exceeds block size");}
                 for(int i = 0; i < order; i++) {
                     channel_data[i] = read_bits_signed(&state,sample_bits);
                     // printf("warmup[%d]: %lld\n",i,channel_data[i]);
@@ -444,11 +528,15 @@ int main(int argc, char* argv[]) {
                 }
                 predict_subframe(&state, channel_data, block_size, order, qlp_coeffs, qlp_rightshift);
             } else {
-                printf("Unsupported prediction mode: %d\n",prediction_mode);
+                err("Error: reserved prediction mode");
             }
-            uint8_t sample_depth = 0;
+            check_bitstream(&state);
+            check_samples(channel_data,block_size,sample_bits);
+            if(wasted_bits) shift_samples(channel_data,block_size,wasted_bits);
         }
+        // Then byte alignment and the CRC-16
         file_offset += ((state.current_read+7)>>3) + 2;
+        if(file_offset > file_length) {err("Error: unexpected end of file");}
         if(channel_layout_signal == 8) {
             for(int i = 0; i < block_size; i++) {
                 audio_data[block_size+i] = audio_data[i] - audio_data[block_size+i];
@@ -462,23 +550,30 @@ int main(int argc, char* argv[]) {
         if(channel_layout_signal == 10) {
             for(int i = 0; i < block_size; i++) {
                 int64_t side = audio_data[block_size+i];
-                int64_t mid = audio_data[i] << 1;
+                int64_t mid = audio_data[i] * 2;
                 mid |= (side & 1);
                 audio_data[i]=(mid+side)>>1;
                 audio_data[block_size+i]=(mid-side)>>1;
             }
         }
+        // WAVE samples fill whole bytes, any bits below the bit depth being zero
+        uint8_t padding_bits = (((bit_depth+7)>>3)<<3)-bit_depth;
+        if(padding_bits) {
+            for(int j = 0; j < channel_count; j++) {
+                shift_samples(audio_data + j*block_size,block_size,padding_bits);
+            }
+        }
         for(int i = 0; i < block_size; i++) {
             for(int j = 0; j < channel_count; j++) {
-                audio_data[j*block_size+i] <<= (((bit_depth+7)>>3)<<3)-bit_depth;
                 fwrite(&audio_data[j*block_size+i],(bit_depth+7)>>3,1,output_file);
             }
             wave_data_length += ((bit_depth+7)>>3) * channel_count;
         }
         fflush(output_file);
         free(audio_data);
+        decoding.audio_data = NULL;
     }
-    printf("\n");
+    log_info("\n");
     if(use_wave) {
         fseek(output_file,0,SEEK_SET);
         uint32_t data[11] = {
@@ -497,4 +592,22 @@ int main(int argc, char* argv[]) {
         fwrite(data,11,4,output_file);
     }
     fclose(output_file);
+    free(decoding.output_name);
+    free(file_data);
+}
+
+// Errors unwind to here, closing and freeing whatever the decode had open
+const char* decode_flac_file(const char* name, bool verbose) {
+    decoding = (struct flac_decode){.verbose = verbose};
+    if(setjmp(decoding.jump) != 0) {
+        if(decoding.file != NULL) fclose(decoding.file);
+        if(decoding.output_file != NULL) fclose(decoding.output_file);
+        if(decoding.output_name != NULL) remove(decoding.output_name);
+        free(decoding.output_name);
+        free(decoding.file_data);
+        free(decoding.audio_data);
+        return decoding.error;
+    }
+    decode_stream(name);
+    return NULL;
 }
\ No newline at end of file
@@ -0,0 +1,10 @@
+#ifndef FLAC_DECODER_H
+#define FLAC_DECODER_H
+
+#include <stdbool.h>
+
+// Decodes the FLAC file name to name.wav, printing what it finds in the stream when verbose.
+// Returns NULL once done, or what was wrong with the file.
+const char* decode_flac_file(const char* name, bool verbose);
+
+#endif
@@ -0,0 +1,15 @@
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "flac_decoder.h"
+
+int main(int argc, char* argv[]) {
+    if(argc < 2) {
+        exit(1);
+    }
+    const char* error = decode_flac_file(argv[1],true);
+    if(error != NULL) {
+        puts(error);
+        exit(1);
+    }
+}
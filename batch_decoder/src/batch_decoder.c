@@ -0,0 +1,292 @@
+#include "prores_decoder.h"
+#include "flac_decoder.h"
+#include "batch_decoder.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Frames of a ProRes file decoded as one task, enough to keep its reading and writing overlapped
+#define FRAMES_PER_TASK 8
+
+enum file_format {
+    FORMAT_UNKNOWN,
+    FORMAT_FLAC,
+    FORMAT_WEBP,
+    FORMAT_PRORES
+};
+
+typedef struct {
+    char* name;
+    enum file_format format;
+    uint64_t size;
+    // ProRes files stay open with their frames indexed while their tasks run
+    int file;
+    frame_index index;
+    // Set by any of the file's tasks that fails, a file only counting once
+    _Atomic bool failed;
+} batch_file;
+
+// A whole file, or a run of a ProRes file's frames
+typedef struct {
+    uint32_t file;
+    uint32_t first_frame;
+    uint32_t frame_count;
+    // Bytes of input, standing in for how long the task takes
+    uint64_t size;
+} batch_task;
+
+struct batch {
+    batch_file* files;
+    uint32_t file_count;
+    uint32_t file_capacity;
+    batch_task* tasks;
+    uint32_t task_count;
+    enum image_format format;
+};
+
+static void add_file(struct batch* batch, const char* name) {
+    if(batch->file_count == batch->file_capacity) {
+        batch->file_capacity = batch->file_capacity ? 2*batch->file_capacity : 64;
+        batch->files = realloc(batch->files,sizeof(batch_file)*batch->file_capacity);
+        assert(batch->files != NULL,"Error: unable to allocate memory");
+    }
+    batch_file* file = &batch->files[batch->file_count++];
+    memset(file,0,sizeof(*file));
+    file->name = strdup(name);
+    assert(file->name != NULL,"Error: unable to allocate memory");
+    file->file = -1;
+}
+
+// Inputs are every file directly in a directory, or the paths listed one to a line in a manifest
+static void read_inputs(struct batch* batch, const char* path) {
+    struct stat info;
+    assert(stat(path,&info) == 0,"Error: no such file or directory");
+    char* name = malloc(PATH_MAX);
+    assert(name != NULL,"Error: unable to allocate memory");
+    if(S_ISDIR(info.st_mode)) {
+        DIR* directory = opendir(path);
+        assert(directory != NULL,"Error: unable to read directory");
+        struct dirent* entry;
+        while((entry = readdir(directory)) != NULL) {
+            if(entry->d_name[0] == '.') continue;
+            snprintf(name,PATH_MAX,"%s/%s",path,entry->d_name);
+            if(stat(name,&info) == 0 && S_ISREG(info.st_mode)) add_file(batch,name);
+        }
+        closedir(directory);
+    } else {
+        FILE* manifest = fopen(path,"r");
+        assert(manifest != NULL,"Error: unable to open manifest");
+        while(fgets(name,PATH_MAX,manifest) != NULL) {
+            name[strcspn(name,"\r\n")] = 0;
+            if(name[0] != 0) add_file(batch,name);
+        }
+        fclose(manifest);
+    }
+    free(name);
+}
+
+// Formats are told apart by their first bytes. ProRes comes either as a lone icpf frame or in a
+// QuickTime or MP4 file, which the frame index then has to find a ProRes track in.
+static enum file_format detect_format(const uint8_t* header, uint64_t size) {
+    static const char* atoms[6] = {"ftyp","moov","mdat","wide","free","skip"};
+    if(size >= 4 && memcmp(header,"fLaC",4) == 0) return FORMAT_FLAC;
+    if(size >= 12 && memcmp(header,"RIFF",4) == 0 && memcmp(header+8,"WEBP",4) == 0) return FORMAT_WEBP;
+    if(size < 8) return FORMAT_UNKNOWN;
+    if(memcmp(header+4,"icpf",4) == 0) return FORMAT_PRORES;
+    for(int i = 0; i < 6; i++) {
+        if(memcmp(header+4,atoms[i],4) == 0) return FORMAT_PRORES;
+    }
+    return FORMAT_UNKNOWN;
+}
+
+static void add_task(struct batch* batch, uint32_t file, uint32_t first_frame, uint32_t frame_count, uint64_t size) {
+    batch->tasks[batch->task_count++] = (batch_task){
+        .file = file,
+        .first_frame = first_frame,
+        .frame_count = frame_count,
+        .size = size
+    };
+}
+
+static int compare_tasks(const void* a, const void* b) {
+    uint64_t first = ((const batch_task*)a)->size, second = ((const batch_task*)b)->size;
+    return first < second ? 1 : first > second ? -1 : 0;
+}
+
+static void print_prores_failure(const char* name, prores_error error) {
+    printf("Error decoding %s at line %d: %s\n",name,error.line,error.message);
+}
+
+static void read_prores_index(void* context) {
+    batch_file* file = context;
+    if(!read_frame_index(file->file,&file->index)) file->format = FORMAT_UNKNOWN;
+}
+
+// A file that looks like ProRes but turns out to hold none is skipped. One whose container is
+// broken fails, and gets no tasks.
+static void index_prores_file(batch_file* file) {
+    prores_error error;
+    if(catch_prores_errors(read_prores_index,file,&error)) return;
+    print_prores_failure(file->name,error);
+    memset(&file->index,0,sizeof(file->index));
+    file->failed = true;
+}
+
+// FLAC and WebP files are a task each. ProRes files are split into runs of frames, so a long
+// master is spread over every thread rather than holding one up after the rest are done.
+static void plan_tasks(struct batch* batch) {
+    uint32_t task_capacity = batch->file_count;
+    batch->tasks = malloc(sizeof(batch_task)*task_capacity);
+    assert(batch->tasks != NULL,"Error: unable to allocate memory");
+    for(uint32_t i = 0; i < batch->file_count; i++) {
+        batch_file* file = &batch->files[i];
+        file->file = open(file->name,O_RDONLY);
+        struct stat info;
+        if(file->file < 0) continue;
+        if(fstat(file->file,&info) != 0) {
+            close(file->file);
+            file->file = -1;
+            continue;
+        }
+        uint8_t header[12] = {0};
+        file->size = info.st_size;
+        if(file->size >= 12) read_at(file->file,header,12,0);
+        file->format = detect_format(header,file->size);
+        if(file->format == FORMAT_PRORES) index_prores_file(file);
+        if(file->format != FORMAT_PRORES) {
+            close(file->file);
+            file->file = -1;
+        }
+        if(file->format == FORMAT_UNKNOWN) continue;
+
+        if(file->failed) continue;
+
+        uint32_t task_count = file->format == FORMAT_PRORES ? (file->index.count + FRAMES_PER_TASK - 1) / FRAMES_PER_TASK : 1;
+        if(batch->task_count + task_count > task_capacity) {
+            task_capacity = 2*(batch->task_count + task_count);
+            batch->tasks = realloc(batch->tasks,sizeof(batch_task)*task_capacity);
+            assert(batch->tasks != NULL,"Error: unable to allocate memory");
+        }
+        if(file->format != FORMAT_PRORES) {
+            add_task(batch,i,0,0,file->size);
+            continue;
+        }
+        for(uint32_t first = 0; first < file->index.count; first += FRAMES_PER_TASK) {
+            uint32_t count = file->index.count - first < FRAMES_PER_TASK ? file->index.count - first : FRAMES_PER_TASK;
+            uint64_t size = 0;
+            for(uint32_t j = 0; j < count; j++) size += file->index.sizes[first + j];
+            add_task(batch,i,first,count,size);
+        }
+    }
+    // Largest first, so the long tasks start early and the short ones fill in around them
+    qsort(batch->tasks,batch->task_count,sizeof(batch_task),compare_tasks);
+}
+
+struct prores_task {
+    int file;
+    frame_index frames;
+    output_options options;
+    slice_scheduler scheduler;
+};
+
+static void decode_prores_task(void* context) {
+    struct prores_task* task = context;
+    decode_frames(task->file,&task->frames,&task->options,&task->scheduler);
+}
+
+// Tasks decode on whichever of the scheduler's threads runs them, so each ProRes task gets a
+// scheduler of its own that decodes slices on that thread. A file that fails to decode is
+// reported and counted, the rest of the batch carrying on.
+static void run_task(void* context, uint32_t index) {
+    struct batch* batch = context;
+    const batch_task* task = &batch->tasks[index];
+    batch_file* file = &batch->files[task->file];
+    switch(file->format) {
+        case FORMAT_FLAC: {
+            const char* error = decode_flac_file(file->name,false);
+            if(error != NULL) {
+                printf("Error decoding %s: %s\n",file->name,error);
+                file->failed = true;
+            }
+            break;
+        }
+        case FORMAT_WEBP:
+            if(!decode_webp_file(file->name,batch->format)) file->failed = true;
+            break;
+        case FORMAT_PRORES: {
+            struct prores_task prores = {
+                .file = file->file,
+                .frames = file->index,
+                .options = {
+                    .name = file->name,
+                    .format = batch->format
+                }
+            };
+            prores.frames.offsets += task->first_frame;
+            prores.frames.sizes += task->first_frame;
+            prores.frames.count = task->frame_count;
+            prores.frames.first = task->first_frame;
+            init_slice_scheduler(&prores.scheduler,1);
+            prores_error error;
+            if(!catch_prores_errors(decode_prores_task,&prores,&error)) {
+                print_prores_failure(file->name,error);
+                file->failed = true;
+            }
+            free_slice_scheduler(&prores.scheduler);
+            break;
+        }
+        case FORMAT_UNKNOWN:
+            break;
+    }
+}
+
+static double seconds_since(const struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC,&now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(int argc, char* argv[]) {
+    assert(argc >= 2,"No input directory or manifest!");
+    // Optional thread count, 0 picking the default, and format images are written in
+    int thread_count = argc >= 3 ? atoi(argv[2]) : 0;
+    if(thread_count == 0) thread_count = default_thread_count();
+    assert(thread_count > 0,"Error: invalid thread count");
+    struct batch batch = {
+        .format = argc >= 4 ? parse_image_format(argv[3]) : IMAGE_FORMAT_PPM
+    };
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC,&start);
+    read_inputs(&batch,argv[1]);
+    plan_tasks(&batch);
+
+    slice_scheduler scheduler;
+    init_slice_scheduler(&scheduler,thread_count);
+    run_slice_jobs(&scheduler,run_task,&batch,batch.task_count);
+    free_slice_scheduler(&scheduler);
+    double seconds = seconds_since(&start);
+
+    uint32_t counts[4] = {0}, frames = 0, failed = 0;
+    uint64_t bytes = 0;
+    for(uint32_t i = 0; i < batch.file_count; i++) {
+        batch_file* file = &batch.files[i];
+        counts[file->format]++;
+        if(file->failed) failed++;
+        if(file->format != FORMAT_UNKNOWN) bytes += file->size;
+        if(file->format == FORMAT_PRORES) {
+            frames += file->index.count;
+            close(file->file);
+            free_frame_index(&file->index);
+        }
+        free(file->name);
+    }
+    uint32_t decoded = counts[FORMAT_FLAC] + counts[FORMAT_WEBP] + counts[FORMAT_PRORES] - failed;
+    printf("Decoded %u files: %u FLAC, %u WebP, %u ProRes with %u frames. %u skipped, %u failed.\n",decoded,counts[FORMAT_FLAC],counts[FORMAT_WEBP],counts[FORMAT_PRORES],frames,counts[FORMAT_UNKNOWN],failed);
+    printf("Read %.1f MB in %.2f s on %d threads: %.1f MB/s, %.1f files/s\n",bytes / 1e6,seconds,thread_count,bytes / 1e6 / seconds,decoded / seconds);
+    free(batch.files);
+    free(batch.tasks);
+}
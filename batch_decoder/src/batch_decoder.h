@@ -0,0 +1,12 @@
+#ifndef BATCH_DECODER_H
+#define BATCH_DECODER_H
+
+#include <stdbool.h>
+
+#include "image_output.h"
+
+// webp_file.c. The WebP decoder's library interface reports errors rather than ending the
+// process, so a bad WebP file only fails itself. Returns whether the file decoded.
+bool decode_webp_file(const char* name, enum image_format format);
+
+#endif
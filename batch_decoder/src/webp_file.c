@@ -0,0 +1,79 @@
+#include "webp_decoder.h"
+#include "batch_decoder.h"
+
+// Each frame of an animation is written to its own file, numbered like the command line tool's
+struct animation_output {
+    const char* name;
+    enum image_format format;
+    uint32_t width;
+    uint32_t height;
+    bool has_alpha;
+    char* frame_name;
+    uint32_t frame_count;
+};
+static void write_animation_frame(void* user, const pixel_t* canvas, uint32_t frame) {
+    struct animation_output* output = user;
+    sprintf(output->frame_name,"%s.%u",output->name,frame);
+    struct image_output writer;
+    open_image_output(&writer,output->frame_name,output->format,output->width,output->height,8,output->has_alpha);
+    write_argb_rows(&writer,canvas,output->width,output->height);
+    close_image_output(&writer);
+    output->frame_count++;
+}
+
+// Stills are decoded whole into memory and written out like the command line tool does.
+// Animations are composited a frame at a time on the calling thread.
+bool decode_webp_file(const char* name, enum image_format format) {
+    FILE* file = fopen(name,"rb");
+    if(file == NULL) {
+        printf("Error: unable to open %s\n",name);
+        return false;
+    }
+    fseek(file,0,SEEK_END);
+    long size = ftell(file);
+    fseek(file,0,SEEK_SET);
+    uint8_t* data = malloc(size > 0 ? size : 1);
+    bool read = data != NULL && fread(data,1,size,file) == (size_t)size;
+    fclose(file);
+    if(!read) {
+        printf("Error: unable to read %s\n",name);
+        free(data);
+        return false;
+    }
+
+    struct webp_context context;
+    init_webp_context(&context);
+    uint32_t width, height;
+    bool has_alpha;
+    pixel_t* pixels = NULL;
+    enum webp_error error = webp_get_info(&context,data,size,&width,&height,&has_alpha);
+    if(error == WEBP_OK && webp_is_animation(data,size)) {
+        struct animation_output output = {
+            .name = name,
+            .format = format,
+            .width = width,
+            .height = height,
+            .has_alpha = has_alpha,
+            .frame_name = malloc(strlen(name) + 16)
+        };
+        error = output.frame_name != NULL ? webp_decode_animation(&context,data,size,1,write_animation_frame,&output) : WEBP_ERROR_OUT_OF_MEMORY;
+        if(error == WEBP_OK) printf("Animation %s: %d x %d, %u frames\n",name,width,height,output.frame_count);
+        free(output.frame_name);
+    } else if(error == WEBP_OK) {
+        pixels = malloc(sizeof(pixel_t)*width*height);
+        error = pixels != NULL ? webp_decode_argb(&context,data,size,pixels,width,height) : WEBP_ERROR_OUT_OF_MEMORY;
+    }
+    if(error == WEBP_OK && pixels != NULL) {
+        struct image_output output;
+        open_image_output(&output,name,format,width,height,8,has_alpha);
+        write_argb_rows(&output,pixels,width,height);
+        close_image_output(&output);
+        printf("Image %s: %d x %d%s\n",name,width,height,output.has_alpha?" with alpha":"");
+    } else if(error != WEBP_OK) {
+        printf("Error decoding %s at line %d: %s\n",name,context.error_line,context.error_message != NULL ? context.error_message : "out of memory");
+    }
+    free(pixels);
+    free(data);
+    free_webp_context(&context);
+    return error == WEBP_OK;
+}
@@ -0,0 +1,339 @@
+#include "image_output.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <pthread.h>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#define err(x) {printf("Error at line %d: %s\n",__LINE__,x);exit(1);}
+#define assert(x,y) {if(!(x)){printf("Assertion failure at line %d: %s\n",__LINE__,y);exit(1);}}
+
+// Rows are gathered until about this much output is waiting
+#define OUTPUT_BUFFER_BYTES (4*1024*1024)
+// The SIMD kernels store a whole vector at the end of each run, past the bytes they produce
+#define OUTPUT_BUFFER_SLACK 32
+
+static const char* format_names[4] = {"ppm","pam","rgba","planar"};
+
+// Every kernel converts count pixels of one row
+struct output_kernels {
+    void (*argb_to_rgb)(const uint32_t* src, uint8_t* dst, uint32_t count);
+    void (*argb_to_rgba)(const uint32_t* src, uint8_t* dst, uint32_t count);
+    void (*argb_alpha)(const uint32_t* src, uint32_t count, uint32_t* alpha_and, uint32_t* alpha_or);
+    void (*rgba16_to_rgb)(const uint16_t* src, uint8_t* dst, uint32_t count);
+    void (*rgba16_to_rgba)(const uint16_t* src, uint8_t* dst, uint32_t count);
+    void (*rgba16_alpha)(const uint16_t* src, uint32_t count, uint32_t* alpha_and, uint32_t* alpha_or);
+};
+
+static void argb_to_rgb_c(const uint32_t* src, uint8_t* dst, uint32_t count) {
+    for(uint32_t i = 0; i < count; i++) {
+        dst[3*i] = src[i] >> 16;
+        dst[3*i+1] = src[i] >> 8;
+        dst[3*i+2] = src[i];
+    }
+}
+static void argb_to_rgba_c(const uint32_t* src, uint8_t* dst, uint32_t count) {
+    for(uint32_t i = 0; i < count; i++) {
+        dst[4*i] = src[i] >> 16;
+        dst[4*i+1] = src[i] >> 8;
+        dst[4*i+2] = src[i];
+        dst[4*i+3] = src[i] >> 24;
+    }
+}
+static void argb_alpha_c(const uint32_t* src, uint32_t count, uint32_t* alpha_and, uint32_t* alpha_or) {
+    for(uint32_t i = 0; i < count; i++) {
+        *alpha_and &= src[i] >> 24;
+        *alpha_or |= src[i] >> 24;
+    }
+}
+static void rgba16_to_rgb_c(const uint16_t* src, uint8_t* dst, uint32_t count) {
+    for(uint32_t i = 0; i < count; i++) {
+        for(int c = 0; c < 3; c++) {
+            dst[6*i+2*c] = src[4*i+c] >> 8;
+            dst[6*i+2*c+1] = src[4*i+c];
+        }
+    }
+}
+static void rgba16_to_rgba_c(const uint16_t* src, uint8_t* dst, uint32_t count) {
+    for(uint32_t i = 0; i < 4*count; i++) {
+        dst[2*i] = src[i] >> 8;
+        dst[2*i+1] = src[i];
+    }
+}
+static void rgba16_alpha_c(const uint16_t* src, uint32_t count, uint32_t* alpha_and, uint32_t* alpha_or) {
+    for(uint32_t i = 0; i < count; i++) {
+        *alpha_and &= src[4*i+3];
+        *alpha_or |= src[4*i+3];
+    }
+}
+
+#if defined(__SSE2__)
+#define AVX2 __attribute__((target("avx2")))
+
+// Swapping red and blue turns little endian ARGB words into R, G, B, A bytes
+static void argb_to_rgba_sse2(const uint32_t* src, uint8_t* dst, uint32_t count) {
+    const __m128i ag = _mm_set1_epi32(0xff00ff00);
+    const __m128i low = _mm_set1_epi32(0xff);
+    uint32_t i = 0;
+    for(; i + 4 <= count; i += 4) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(src+i));
+        __m128i r = _mm_and_si128(_mm_srli_epi32(x,16),low);
+        __m128i b = _mm_slli_epi32(_mm_and_si128(x,low),16);
+        _mm_storeu_si128((__m128i*)(dst+4*i),_mm_or_si128(_mm_and_si128(x,ag),_mm_or_si128(r,b)));
+    }
+    argb_to_rgba_c(src+i,dst+4*i,count-i);
+}
+static void argb_alpha_sse2(const uint32_t* src, uint32_t count, uint32_t* alpha_and, uint32_t* alpha_or) {
+    __m128i all = _mm_set1_epi32(-1), any = _mm_setzero_si128();
+    uint32_t i = 0;
+    for(; i + 4 <= count; i += 4) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(src+i));
+        all = _mm_and_si128(all,x);
+        any = _mm_or_si128(any,x);
+    }
+    uint32_t lanes_and[4], lanes_or[4];
+    _mm_storeu_si128((__m128i*)lanes_and,all);
+    _mm_storeu_si128((__m128i*)lanes_or,any);
+    for(int j = 0; j < 4; j++) {
+        *alpha_and &= lanes_and[j] >> 24;
+        *alpha_or |= lanes_or[j] >> 24;
+    }
+    argb_alpha_c(src+i,count-i,alpha_and,alpha_or);
+}
+static void rgba16_to_rgba_sse2(const uint16_t* src, uint8_t* dst, uint32_t count) {
+    uint32_t i = 0;
+    for(; i + 2 <= count; i += 2) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(src+4*i));
+        _mm_storeu_si128((__m128i*)(dst+8*i),_mm_or_si128(_mm_slli_epi16(x,8),_mm_srli_epi16(x,8)));
+    }
+    rgba16_to_rgba_c(src+4*i,dst+8*i,count-i);
+}
+static void rgba16_alpha_sse2(const uint16_t* src, uint32_t count, uint32_t* alpha_and, uint32_t* alpha_or) {
+    __m128i all = _mm_set1_epi32(-1), any = _mm_setzero_si128();
+    uint32_t i = 0;
+    for(; i + 2 <= count; i += 2) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(src+4*i));
+        all = _mm_and_si128(all,x);
+        any = _mm_or_si128(any,x);
+    }
+    uint16_t lanes_and[8], lanes_or[8];
+    _mm_storeu_si128((__m128i*)lanes_and,all);
+    _mm_storeu_si128((__m128i*)lanes_or,any);
+    *alpha_and &= lanes_and[3] & lanes_and[7];
+    *alpha_or |= lanes_or[3] | lanes_or[7];
+    rgba16_alpha_c(src+4*i,count-i,alpha_and,alpha_or);
+}
+
+// Dropping alpha leaves 12 bytes in each 16 byte lane, which the permute closes up into 24
+// contiguous bytes. The last 8 bytes stored are junk for the next store to overwrite.
+static AVX2 void argb_to_rgb_avx2(const uint32_t* src, uint8_t* dst, uint32_t count) {
+    const __m256i shuffle = _mm256_setr_epi8(
+        2,1,0,6,5,4,10,9,8,14,13,12,-1,-1,-1,-1,
+        2,1,0,6,5,4,10,9,8,14,13,12,-1,-1,-1,-1
+    );
+    const __m256i pack = _mm256_setr_epi32(0,1,2,4,5,6,3,7);
+    uint32_t i = 0;
+    for(; i + 8 <= count; i += 8) {
+        __m256i x = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(src+i)),shuffle);
+        _mm256_storeu_si256((__m256i*)(dst+3*i),_mm256_permutevar8x32_epi32(x,pack));
+    }
+    argb_to_rgb_c(src+i,dst+3*i,count-i);
+}
+static AVX2 void rgba16_to_rgb_avx2(const uint16_t* src, uint8_t* dst, uint32_t count) {
+    const __m256i shuffle = _mm256_setr_epi8(
+        1,0,3,2,5,4,9,8,11,10,13,12,-1,-1,-1,-1,
+        1,0,3,2,5,4,9,8,11,10,13,12,-1,-1,-1,-1
+    );
+    const __m256i pack = _mm256_setr_epi32(0,1,2,4,5,6,3,7);
+    uint32_t i = 0;
+    for(; i + 4 <= count; i += 4) {
+        __m256i x = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(src+4*i)),shuffle);
+        _mm256_storeu_si256((__m256i*)(dst+6*i),_mm256_permutevar8x32_epi32(x,pack));
+    }
+    rgba16_to_rgb_c(src+4*i,dst+6*i,count-i);
+}
+#endif
+
+static struct output_kernels kernels;
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+static void init_output_kernels(void) {
+    kernels = (struct output_kernels){
+        argb_to_rgb_c, argb_to_rgba_c, argb_alpha_c,
+        rgba16_to_rgb_c, rgba16_to_rgba_c, rgba16_alpha_c
+    };
+#if defined(__SSE2__)
+    kernels.argb_to_rgba = argb_to_rgba_sse2;
+    kernels.argb_alpha = argb_alpha_sse2;
+    kernels.rgba16_to_rgba = rgba16_to_rgba_sse2;
+    kernels.rgba16_alpha = rgba16_alpha_sse2;
+    if(__builtin_cpu_supports("avx2")) {
+        kernels.argb_to_rgb = argb_to_rgb_avx2;
+        kernels.rgba16_to_rgb = rgba16_to_rgb_avx2;
+    }
+#endif
+}
+
+enum image_format parse_image_format(const char* name) {
+    for(int i = 0; i < 4; i++) {
+        if(strcmp(name,format_names[i]) == 0) return i;
+    }
+    err("Error: unknown output format, expected ppm, pam, rgba or planar");
+}
+
+void open_image_output(struct image_output* output, const char* name, enum image_format format, uint32_t width, uint32_t height, uint8_t bit_depth, bool alpha) {
+    pthread_once(&kernels_once,init_output_kernels);
+    char* output_name_buffer = malloc(strlen(name) + 20);
+    assert(output_name_buffer != NULL,"Error allocating memory");
+    sprintf(output_name_buffer,"%s.%s",name,format_names[format]);
+    output->file = open(output_name_buffer,O_WRONLY|O_CREAT|O_TRUNC,0644);
+    assert(output->file >= 0,"Error: unable to open output file");
+    free(output_name_buffer);
+
+    output->format = format;
+    output->width = width;
+    output->height = height;
+    output->channels = format == IMAGE_FORMAT_PPM || (format == IMAGE_FORMAT_PAM && !alpha) ? 3 : 4;
+    output->sample_bytes = bit_depth > 8 ? 2 : 1;
+    uint32_t max_value = (1 << bit_depth) - 1;
+    output->header_size = 0;
+    if(format == IMAGE_FORMAT_PPM) {
+        output->header_size = sprintf(output->header,"P6\n%d %d\n%d\n",width,height,max_value);
+    } else if(format == IMAGE_FORMAT_PAM) {
+        output->header_size = sprintf(output->header,"P7\nWIDTH %d\nHEIGHT %d\nDEPTH %d\nMAXVAL %d\nTUPLTYPE %s\nENDHDR\n",width,height,output->channels,max_value,alpha ? "RGB_ALPHA" : "RGB");
+    }
+    output->header_written = false;
+
+    size_t row_bytes = (size_t)width*output->channels*output->sample_bytes;
+    output->buffer_rows = OUTPUT_BUFFER_BYTES / row_bytes;
+    if(output->buffer_rows == 0) output->buffer_rows = 1;
+    if(output->buffer_rows > height) output->buffer_rows = height;
+    output->buffer = malloc(row_bytes*output->buffer_rows + OUTPUT_BUFFER_SLACK);
+    assert(output->buffer != NULL,"Error allocating memory");
+    output->buffered_rows = 0;
+    output->rows_written = 0;
+    output->alpha_and = ~0u;
+    output->alpha_or = 0;
+    output->has_alpha = false;
+}
+
+// Keeps going after short writes, which pipes are allowed to do
+static void write_vectors(int file, struct iovec* vectors, int count) {
+    while(count > 0) {
+        ssize_t written = writev(file,vectors,count);
+        assert(written >= 0,"Error: unable to write output file");
+        while(count > 0 && (size_t)written >= vectors->iov_len) {
+            written -= vectors->iov_len;
+            vectors++;
+            count--;
+        }
+        if(count > 0) {
+            vectors->iov_base = (uint8_t*)vectors->iov_base + written;
+            vectors->iov_len -= written;
+        }
+    }
+}
+static void write_at(int file, const uint8_t* data, size_t size, off_t offset) {
+    while(size > 0) {
+        ssize_t written = pwrite(file,data,size,offset);
+        assert(written > 0,"Error: unable to write output file");
+        data += written;
+        size -= written;
+        offset += written;
+    }
+}
+
+// Planar output keeps one run of rows per plane in the buffer, each written to its place in the file
+static void flush_output(struct image_output* output) {
+    if(output->buffered_rows == 0) return;
+    size_t sample_row_bytes = (size_t)output->width*output->sample_bytes;
+    if(output->format == IMAGE_FORMAT_PLANAR) {
+        size_t plane_bytes = sample_row_bytes*output->height;
+        for(int plane = 0; plane < 4; plane++) {
+            write_at(output->file,output->buffer+sample_row_bytes*output->buffer_rows*plane,sample_row_bytes*output->buffered_rows,plane_bytes*plane+sample_row_bytes*output->rows_written);
+        }
+    } else {
+        struct iovec vectors[2];
+        int count = 0;
+        if(!output->header_written) {
+            vectors[count++] = (struct iovec){output->header,output->header_size};
+            output->header_written = true;
+        }
+        vectors[count++] = (struct iovec){output->buffer,sample_row_bytes*output->channels*output->buffered_rows};
+        write_vectors(output->file,vectors,count);
+    }
+    output->rows_written += output->buffered_rows;
+    output->buffered_rows = 0;
+}
+
+void write_argb_rows(struct image_output* output, const uint32_t* rows, uint32_t stride, uint32_t row_count) {
+    assert(output->sample_bytes == 1,"Error: 8 bit pixels can't be written at this bit depth");
+    uint32_t width = output->width;
+    for(uint32_t y = 0; y < row_count; y++) {
+        const uint32_t* row = rows + (size_t)y*stride;
+        kernels.argb_alpha(row,width,&output->alpha_and,&output->alpha_or);
+        if(output->format == IMAGE_FORMAT_PLANAR) {
+            uint8_t* planes = output->buffer + (size_t)width*output->buffered_rows;
+            size_t plane_bytes = (size_t)width*output->buffer_rows;
+            for(uint32_t x = 0; x < width; x++) {
+                planes[x] = row[x] >> 16;
+                planes[plane_bytes+x] = row[x] >> 8;
+                planes[2*plane_bytes+x] = row[x];
+                planes[3*plane_bytes+x] = row[x] >> 24;
+            }
+        } else {
+            uint8_t* dst = output->buffer + (size_t)width*output->channels*output->buffered_rows;
+            if(output->channels == 3) {
+                kernels.argb_to_rgb(row,dst,width);
+            } else {
+                kernels.argb_to_rgba(row,dst,width);
+            }
+        }
+        if(++output->buffered_rows == output->buffer_rows) flush_output(output);
+    }
+}
+
+void write_rgba16_rows(struct image_output* output, const uint16_t* rows, uint32_t stride, uint32_t row_count) {
+    assert(output->sample_bytes == 2,"Error: 16 bit pixels can't be written at this bit depth");
+    uint32_t width = output->width;
+    for(uint32_t y = 0; y < row_count; y++) {
+        const uint16_t* row = rows + (size_t)4*y*stride;
+        kernels.rgba16_alpha(row,width,&output->alpha_and,&output->alpha_or);
+        if(output->format == IMAGE_FORMAT_PLANAR) {
+            uint8_t* planes = output->buffer + (size_t)2*width*output->buffered_rows;
+            size_t plane_bytes = (size_t)2*width*output->buffer_rows;
+            for(uint32_t x = 0; x < width; x++) {
+                for(int c = 0; c < 4; c++) {
+                    planes[plane_bytes*c+2*x] = row[4*x+c] >> 8;
+                    planes[plane_bytes*c+2*x+1] = row[4*x+c];
+                }
+            }
+        } else {
+            uint8_t* dst = output->buffer + (size_t)2*width*output->channels*output->buffered_rows;
+            if(output->channels == 3) {
+                kernels.rgba16_to_rgb(row,dst,width);
+            } else {
+                kernels.rgba16_to_rgba(row,dst,width);
+            }
+        }
+        if(++output->buffered_rows == output->buffer_rows) flush_output(output);
+    }
+}
+
+void close_image_output(struct image_output* output) {
+    flush_output(output);
+    if(!output->header_written && output->header_size > 0) {
+        struct iovec header = {output->header,output->header_size};
+        write_vectors(output->file,&header,1);
+    }
+    close(output->file);
+    free(output->buffer);
+    output->has_alpha = output->alpha_and != output->alpha_or;
+}
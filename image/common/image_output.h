@@ -0,0 +1,51 @@
+#ifndef IMAGE_OUTPUT_H
+#define IMAGE_OUTPUT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+enum image_format {
+    // RGB, the alpha channel being dropped
+    IMAGE_FORMAT_PPM,
+    // RGB with alpha, or just RGB when the source has none
+    IMAGE_FORMAT_PAM,
+    // Headerless interleaved RGBA
+    IMAGE_FORMAT_RAW,
+    // Headerless R, G, B and A planes one after the other
+    IMAGE_FORMAT_PLANAR
+};
+
+// Rows are converted into a large buffer and written out with one system call per flush.
+// Samples are 8 bit up to a bit depth of 8 and 16 bit big endian above that.
+struct image_output {
+    int file;
+    enum image_format format;
+    uint32_t width;
+    uint32_t height;
+    uint8_t channels;
+    uint8_t sample_bytes;
+    char header[128];
+    int header_size;
+    bool header_written;
+    uint8_t* buffer;
+    uint32_t buffer_rows;
+    uint32_t buffered_rows;
+    uint32_t rows_written;
+    // Every alpha value seen ANDed and ORed together, which differ once alpha varies
+    uint32_t alpha_and;
+    uint32_t alpha_or;
+    bool has_alpha;
+};
+
+enum image_format parse_image_format(const char* name);
+// Writes to name with the format's extension added. Without alpha, PAM output has 3 channels.
+void open_image_output(struct image_output* output, const char* name, enum image_format format, uint32_t width, uint32_t height, uint8_t bit_depth, bool alpha);
+// Packed 8 bit ARGB, as the WebP decoder produces
+void write_argb_rows(struct image_output* output, const uint32_t* rows, uint32_t stride, uint32_t row_count);
+// 16 bit R, G, B, A samples per pixel in host order, stride counting pixels
+void write_rgba16_rows(struct image_output* output, const uint16_t* rows, uint32_t stride, uint32_t row_count);
+// Flushes what is left and sets has_alpha
+void close_image_output(struct image_output* output);
+
+#endif
@@ -0,0 +1,8 @@
+#include "threads.h"
+
+#include <unistd.h>
+
+int default_thread_count(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? cpus : 1;
+}
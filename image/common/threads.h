@@ -0,0 +1,7 @@
+#ifndef THREADS_H
+#define THREADS_H
+
+// One thread for each CPU online, or one if that can't be found out
+int default_thread_count(void);
+
+#endif
@@ -0,0 +1,142 @@
+#include "prores_decoder.h"
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#define AVX2 __attribute__((target("avx2")))
+#endif
+
+// Kr and Kb for the matrix coefficients a frame gives. Where those are unspecified the colour
+// primaries decide, and BT.709 stands in for anything left.
+static void colour_space_weights(uint8_t colour_space, uint8_t colour_primaries, double* kr, double* kb) {
+    if(colour_space == 2) {
+        switch(colour_primaries) {
+            case 5: case 6: colour_space = 6; break;
+            case 7: colour_space = 7; break;
+            case 9: colour_space = 9; break;
+        }
+    }
+    switch(colour_space) {
+        case 5:
+        case 6:
+            *kr = 0.299; *kb = 0.114;
+            break;
+        case 7:
+            *kr = 0.212; *kb = 0.087;
+            break;
+        case 9:
+        case 10:
+            *kr = 0.2627; *kb = 0.0593;
+            break;
+        default:
+            *kr = 0.2126; *kb = 0.0722;
+    }
+}
+
+colour_matrix init_colour_matrix(uint8_t colour_space, uint8_t colour_primaries, uint8_t bit_depth) {
+    double kr, kb;
+    colour_space_weights(colour_space,colour_primaries,&kr,&kb);
+    double kg = 1 - kr - kb;
+    int32_t max = (1 << bit_depth) - 1;
+    double luma_scale = (double)max / (219 << (bit_depth-8)) * 65536;
+    double chroma_scale = (double)max / (224 << (bit_depth-8)) * 65536;
+    return (colour_matrix){
+        .luma = luma_scale + 0.5,
+        .cr_r = 2*(1-kr)*chroma_scale + 0.5,
+        .cb_g = 2*kb*(1-kb)/kg*chroma_scale + 0.5,
+        .cr_g = 2*kr*(1-kr)/kg*chroma_scale + 0.5,
+        .cb_b = 2*(1-kb)*chroma_scale + 0.5,
+        .luma_offset = 16 << (bit_depth-8),
+        .chroma_offset = 1 << (bit_depth-1),
+        .max = max
+    };
+}
+
+static uint16_t clamp_sample(int32_t value, int32_t max) {
+    return value < 0 ? 0 : value > max ? max : value;
+}
+
+// Converts count pixels of a row, the chroma of pixel x being at x >> chroma_shift. Without
+// alpha, pixels are opaque.
+static void convert_row_c(const uint16_t* luma, const uint16_t* cb, const uint16_t* cr, const uint16_t* alpha, uint8_t chroma_shift, const colour_matrix* matrix, pixel_t* output, uint32_t count) {
+    for(uint32_t x = 0; x < count; x++) {
+        int32_t l = (luma[x] - matrix->luma_offset) * matrix->luma + 32768;
+        int32_t u = cb[x >> chroma_shift] - matrix->chroma_offset;
+        int32_t v = cr[x >> chroma_shift] - matrix->chroma_offset;
+        output[x].r = clamp_sample((l + matrix->cr_r*v) >> 16,matrix->max);
+        output[x].g = clamp_sample((l - matrix->cb_g*u - matrix->cr_g*v) >> 16,matrix->max);
+        output[x].b = clamp_sample((l + matrix->cb_b*u) >> 16,matrix->max);
+        output[x].a = alpha != NULL ? alpha[x] : matrix->max;
+    }
+}
+
+#if defined(__SSE2__)
+// Eight pixels at a time in 32 bit lanes, the same sums as the C version. 4:2:2 chroma is
+// widened from four samples and each repeated across its pair of lanes.
+static AVX2 void convert_row_avx2(const uint16_t* luma, const uint16_t* cb, const uint16_t* cr, const uint16_t* alpha, uint8_t chroma_shift, const colour_matrix* matrix, pixel_t* output, uint32_t count) {
+    const __m256i luma_factor = _mm256_set1_epi32(matrix->luma);
+    const __m256i cr_r = _mm256_set1_epi32(matrix->cr_r), cb_g = _mm256_set1_epi32(matrix->cb_g);
+    const __m256i cr_g = _mm256_set1_epi32(matrix->cr_g), cb_b = _mm256_set1_epi32(matrix->cb_b);
+    const __m256i luma_offset = _mm256_set1_epi32(matrix->luma_offset);
+    const __m256i chroma_offset = _mm256_set1_epi32(matrix->chroma_offset);
+    const __m256i round = _mm256_set1_epi32(32768);
+    const __m256i zero = _mm256_setzero_si256(), max = _mm256_set1_epi32(matrix->max);
+    const __m256i repeat = _mm256_setr_epi32(0,0,1,1,2,2,3,3);
+    uint32_t x = 0;
+    for(; x + 8 <= count; x += 8) {
+        __m256i y = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(luma+x)));
+        __m256i u, v;
+        if(chroma_shift) {
+            u = _mm256_permutevar8x32_epi32(_mm256_cvtepu16_epi32(_mm_loadl_epi64((const __m128i*)(cb+x/2))),repeat);
+            v = _mm256_permutevar8x32_epi32(_mm256_cvtepu16_epi32(_mm_loadl_epi64((const __m128i*)(cr+x/2))),repeat);
+        } else {
+            u = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(cb+x)));
+            v = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(cr+x)));
+        }
+        __m256i l = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_sub_epi32(y,luma_offset),luma_factor),round);
+        u = _mm256_sub_epi32(u,chroma_offset);
+        v = _mm256_sub_epi32(v,chroma_offset);
+        __m256i r = _mm256_srai_epi32(_mm256_add_epi32(l,_mm256_mullo_epi32(cr_r,v)),16);
+        __m256i g = _mm256_srai_epi32(_mm256_sub_epi32(_mm256_sub_epi32(l,_mm256_mullo_epi32(cb_g,u)),_mm256_mullo_epi32(cr_g,v)),16);
+        __m256i b = _mm256_srai_epi32(_mm256_add_epi32(l,_mm256_mullo_epi32(cb_b,u)),16);
+        r = _mm256_min_epi32(_mm256_max_epi32(r,zero),max);
+        g = _mm256_min_epi32(_mm256_max_epi32(g,zero),max);
+        b = _mm256_min_epi32(_mm256_max_epi32(b,zero),max);
+        // Within each lane, R and B then G and A are packed side by side and interleaved into
+        // pixels, leaving pixels 0, 1, 4, 5 in one vector and 2, 3, 6, 7 in the other
+        __m256i rb = _mm256_packus_epi32(r,b);
+        __m256i a = alpha != NULL ? _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(alpha+x))) : max;
+        __m256i ga = _mm256_packus_epi32(g,a);
+        __m256i rg = _mm256_unpacklo_epi16(rb,ga);
+        __m256i ba = _mm256_unpackhi_epi16(rb,ga);
+        __m256i first = _mm256_unpacklo_epi32(rg,ba);
+        __m256i second = _mm256_unpackhi_epi32(rg,ba);
+        _mm256_storeu_si256((__m256i*)(output+x),_mm256_permute2x128_si256(first,second,0x20));
+        _mm256_storeu_si256((__m256i*)(output+x+4),_mm256_permute2x128_si256(first,second,0x31));
+    }
+    convert_row_c(luma+x,cb+(x >> chroma_shift),cr+(x >> chroma_shift),alpha != NULL ? alpha+x : NULL,chroma_shift,matrix,output+x,count-x);
+}
+#endif
+
+typedef void (*convert_row_kernel)(const uint16_t* luma, const uint16_t* cb, const uint16_t* cr, const uint16_t* alpha, uint8_t chroma_shift, const colour_matrix* matrix, pixel_t* output, uint32_t count);
+static convert_row_kernel convert_row;
+static pthread_once_t convert_once = PTHREAD_ONCE_INIT;
+
+static void init_convert_kernel(void) {
+    convert_row = convert_row_c;
+#if defined(__SSE2__)
+    if(__builtin_cpu_supports("avx2")) convert_row = convert_row_avx2;
+#endif
+}
+
+// Converts width by height pixels to RGB in 16.16 fixed point. 4:2:2 chroma is repeated
+// across the two pixels it covers.
+void convert_to_rgb(const planar_image_t* planes, const colour_matrix* matrix, pixel_t* output, uint32_t stride, uint32_t width, uint32_t height) {
+    pthread_once(&convert_once,init_convert_kernel);
+    for(uint32_t y = 0; y < height; y++) {
+        const uint16_t* luma = planes->planes[0] + (size_t)y*planes->strides[0];
+        const uint16_t* cb = planes->planes[1] + (size_t)y*planes->strides[1];
+        const uint16_t* cr = planes->planes[2] + (size_t)y*planes->strides[2];
+        const uint16_t* alpha = planes->planes[3] != NULL ? planes->planes[3] + (size_t)y*planes->strides[3] : NULL;
+        convert_row(luma,cb,cr,alpha,planes->chroma_shift,matrix,output + (size_t)y*stride,width);
+    }
+}
@@ -0,0 +1,203 @@
+#include "prores_decoder.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+static uint32_t read_be32(const uint8_t* data) {
+    return (uint32_t)data[0]<<24 | data[1]<<16 | data[2]<<8 | data[3];
+}
+static uint64_t read_be64(const uint8_t* data) {
+    return (uint64_t)read_be32(data)<<32 | read_be32(data+4);
+}
+
+// Reads exactly size bytes from offset, which pread is allowed to return in pieces
+void read_at(int file, uint8_t* data, size_t size, uint64_t offset) {
+    while(size > 0) {
+        ssize_t count = pread(file,data,size,offset);
+        assert(count > 0,"Error: unexpected end of file");
+        data += count;
+        size -= count;
+        offset += count;
+    }
+}
+
+// Works out the size of the atom at data, which may be 64 bits wide or reach to the end.
+// Returns the size of its header, or 0 if it doesn't fit in size.
+static uint32_t atom_header(const uint8_t* data, uint64_t size, uint64_t* atom_size) {
+    if(size < 8) return 0;
+    *atom_size = read_be32(data);
+    uint32_t header_size = 8;
+    if(*atom_size == 1) {
+        if(size < 16) return 0;
+        *atom_size = read_be64(data+8);
+        header_size = 16;
+    } else if(*atom_size == 0) {
+        *atom_size = size;
+    }
+    return *atom_size >= header_size && *atom_size <= size ? header_size : 0;
+}
+
+// Finds the first child of type among the atoms in data, setting size to the size of its contents
+static const uint8_t* find_atom(const uint8_t* data, uint64_t size, const char* type, uint64_t* contents_size) {
+    while(size >= 8) {
+        uint64_t atom_size;
+        uint32_t header_size = atom_header(data,size,&atom_size);
+        assert(header_size > 0,"Error: atom runs past the end of its parent");
+        if(memcmp(data+4,type,4) == 0) {
+            *contents_size = atom_size - header_size;
+            return data + header_size;
+        }
+        data += atom_size;
+        size -= atom_size;
+    }
+    return NULL;
+}
+
+// Follows a path of nested atoms, each name four characters
+static const uint8_t* find_atom_path(const uint8_t* data, uint64_t size, const char* path, uint64_t* contents_size) {
+    for(; *path && data != NULL; path += 4) {
+        data = find_atom(data,size,path,&size);
+    }
+    *contents_size = size;
+    return data;
+}
+
+static bool is_prores_codec(const uint8_t* codec) {
+    static const char* codecs[6] = {"apco","apcs","apcn","apch","ap4h","ap4x"};
+    for(int i = 0; i < 6; i++) {
+        if(memcmp(codec,codecs[i],4) == 0) return true;
+    }
+    return false;
+}
+
+// Builds the index from a ProRes track's sample tables. Samples are laid out in chunks, and the
+// sample to chunk table gives how many each chunk holds in runs keyed by their first chunk.
+static bool read_track(const uint8_t* trak, uint64_t size, frame_index* index) {
+    uint64_t hdlr_size, stsd_size, stbl_size;
+    const uint8_t* hdlr = find_atom_path(trak,size,"mdiahdlr",&hdlr_size);
+    if(hdlr == NULL || hdlr_size < 12 || memcmp(hdlr+8,"vide",4) != 0) return false;
+    const uint8_t* stbl = find_atom_path(trak,size,"mdiaminfstbl",&stbl_size);
+    if(stbl == NULL) return false;
+    const uint8_t* stsd = find_atom(stbl,stbl_size,"stsd",&stsd_size);
+    if(stsd == NULL || stsd_size < 16 || !is_prores_codec(stsd+12)) return false;
+
+    uint64_t stsz_size, stsc_size, chunk_table_size;
+    const uint8_t* stsz = find_atom(stbl,stbl_size,"stsz",&stsz_size);
+    const uint8_t* stsc = find_atom(stbl,stbl_size,"stsc",&stsc_size);
+    bool wide_offsets = false;
+    const uint8_t* chunk_table = find_atom(stbl,stbl_size,"stco",&chunk_table_size);
+    if(chunk_table == NULL) {
+        chunk_table = find_atom(stbl,stbl_size,"co64",&chunk_table_size);
+        wide_offsets = true;
+    }
+    assert(stsz != NULL && stsc != NULL && chunk_table != NULL,"Error: ProRes track has no sample tables");
+    assert(stsz_size >= 12 && stsc_size >= 8 && chunk_table_size >= 8,"Error: invalid sample table");
+    uint32_t sample_size = read_be32(stsz+4);
+    uint32_t sample_count = read_be32(stsz+8);
+    uint32_t run_count = read_be32(stsc+4);
+    uint32_t chunk_count = read_be32(chunk_table+4);
+    assert(sample_size != 0 || (stsz_size - 12) / 4 >= sample_count,"Error: invalid sample size table");
+    assert((stsc_size - 8) / 12 >= run_count && run_count > 0,"Error: invalid sample to chunk table");
+    assert((chunk_table_size - 8) / (wide_offsets ? 8 : 4) >= chunk_count,"Error: invalid chunk offset table");
+
+    index->offsets = malloc(sizeof(uint64_t)*sample_count);
+    index->sizes = malloc(sizeof(uint32_t)*sample_count);
+    assert(index->offsets != NULL && index->sizes != NULL,"Error: unable to allocate memory");
+    uint32_t sample = 0, run = 0;
+    for(uint32_t chunk = 0; chunk < chunk_count && sample < sample_count; chunk++) {
+        while(run + 1 < run_count && chunk + 1 >= read_be32(stsc+8+12*(run+1))) run++;
+        uint32_t samples_per_chunk = read_be32(stsc+8+12*run+4);
+        uint64_t offset = wide_offsets ? read_be64(chunk_table+8+8*chunk) : read_be32(chunk_table+8+4*chunk);
+        for(uint32_t i = 0; i < samples_per_chunk && sample < sample_count; i++, sample++) {
+            index->offsets[sample] = offset;
+            index->sizes[sample] = sample_size ? sample_size : read_be32(stsz+12+4*sample);
+            offset += index->sizes[sample];
+        }
+    }
+    assert(sample == sample_count,"Error: sample tables don't cover every frame");
+    index->count = sample_count;
+    return true;
+}
+
+// Looks through a moov atom for the first ProRes track
+struct track_search {
+    int file;
+    uint64_t offset;
+    uint64_t size;
+    uint8_t* moov;
+    frame_index* index;
+    bool found;
+};
+
+static void find_track(void* arg) {
+    struct track_search* search = arg;
+    read_at(search->file,search->moov,search->size,search->offset);
+    const uint8_t* end = search->moov + search->size;
+    uint64_t trak_size;
+    for(const uint8_t* trak = search->moov; (trak = find_atom(trak,end - trak,"trak",&trak_size)) != NULL; trak += trak_size) {
+        if(read_track(trak,trak_size,search->index)) {
+            search->found = true;
+            return;
+        }
+    }
+}
+
+// A file is either one raw frame, as an icpf atom, or a QuickTime or MP4 file whose first ProRes
+// video track gives the frames. Only the moov atom is read in, the frames being read as needed.
+// Returns false for files holding no ProRes video.
+bool read_frame_index(int file, frame_index* index) {
+    struct stat info;
+    assert(fstat(file,&info) == 0,"Error: unable to read input file");
+    uint64_t file_size = info.st_size;
+    uint8_t header[16];
+    if(file_size < 8) return false;
+    read_at(file,header,8,0);
+    index->offsets = NULL;
+    index->sizes = NULL;
+    index->first = 0;
+    if(memcmp(header+4,"icpf",4) == 0) {
+        index->offsets = malloc(sizeof(uint64_t));
+        index->sizes = malloc(sizeof(uint32_t));
+        assert(index->offsets != NULL && index->sizes != NULL,"Error: unable to allocate memory");
+        assert(file_size <= UINT32_MAX,"Error: frame too large");
+        index->offsets[0] = 0;
+        index->sizes[0] = file_size;
+        index->count = 1;
+        index->from_container = false;
+        return true;
+    }
+
+    for(uint64_t offset = 0; offset + 8 <= file_size;) {
+        uint64_t left = file_size - offset, atom_size;
+        read_at(file,header,left < 16 ? 8 : 16,offset);
+        uint32_t header_size = atom_header(header,left,&atom_size);
+        if(header_size == 0) return false;
+        if(memcmp(header+4,"moov",4) != 0) {
+            offset += atom_size;
+            continue;
+        }
+        struct track_search search = {
+            .file = file,
+            .offset = offset + header_size,
+            .size = atom_size - header_size,
+            .index = index
+        };
+        search.moov = malloc(search.size);
+        assert(search.moov != NULL,"Error: unable to allocate memory");
+        prores_error error;
+        bool searched = catch_prores_errors(find_track,&search,&error);
+        free(search.moov);
+        if(!searched) {
+            free_frame_index(index);
+            raise_prores_error(error);
+        }
+        index->from_container = search.found;
+        return search.found;
+    }
+    return false;
+}
+
+void free_frame_index(frame_index* index) {
+    free(index->offsets);
+    free(index->sizes);
+}
@@ -0,0 +1,278 @@
+#include "prores_decoder.h"
+
+// Orders the coefficients of each block are coded in, as positions in the block
+static const uint8_t progressive_scan[64] = {
+     0,  1,  8,  9,  2,  3, 10, 11,
+    16, 17, 24, 25, 18, 19, 26, 27,
+     4,  5, 12, 20, 13,  6,  7, 14,
+    21, 28, 29, 22, 15, 23, 30, 31,
+    32, 33, 40, 48, 41, 34, 35, 42,
+    49, 56, 57, 50, 43, 36, 37, 44,
+    51, 58, 59, 52, 45, 38, 39, 46,
+    53, 60, 61, 54, 47, 55, 62, 63
+};
+// Field pictures favour the vertical frequencies, their lines being twice as far apart
+static const uint8_t interlaced_scan[64] = {
+     0,  8,  1,  9, 16, 24, 17, 25,
+     2, 10,  3, 11, 18, 26, 19, 27,
+    32, 40, 33, 34, 41, 48, 56, 49,
+    42, 35, 43, 50, 57, 58, 51, 59,
+     4, 12,  5,  6, 13, 20, 28, 21,
+    14,  7, 15, 22, 29, 36, 44, 37,
+    30, 23, 31, 38, 45, 52, 60, 53,
+    46, 39, 47, 54, 61, 62, 55, 63
+};
+
+// Codebooks pack the Rice order in the top three bits, the exp-Golomb order in the next three
+// and the largest prefix still coded as Rice in the bottom two
+#define FIRST_DC_CODEBOOK 0xb8
+static const uint8_t dc_codebooks[7] = {0x04, 0x28, 0x28, 0x4d, 0x4d, 0x70, 0x70};
+static const uint8_t run_codebooks[16] = {0x06, 0x06, 0x05, 0x05, 0x04, 0x29, 0x29, 0x29, 0x29, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28, 0x4c};
+static const uint8_t level_codebooks[10] = {0x04, 0x0a, 0x05, 0x06, 0x04, 0x28, 0x28, 0x28, 0x28, 0x4c};
+
+// Codewords up to this long are looked up, each entry holding the value above the bottom four
+// bits and the length in them, 0 for longer codewords
+#define TABLE_BITS 8
+#define DISTINCT_CODEBOOKS 10
+static uint16_t codebook_tables[DISTINCT_CODEBOOKS][1 << TABLE_BITS];
+static const uint16_t* first_dc_table;
+static const uint16_t* dc_tables[7];
+static const uint16_t* run_tables[16];
+static const uint16_t* level_tables[10];
+// For each scan, progressive then interlaced, and each number of blocks in a slice, from 2 to 32,
+// where the coefficient at each position of the interleaved scan goes among the slice's blocks
+static uint16_t interleaved_scans[2][6][64*32];
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+typedef struct {
+    const uint8_t* data;
+    const uint8_t* end;
+    // Upcoming bits from the top down, zeros once the data runs out
+    uint64_t cache;
+    int cache_bits;
+    // Bits not yet read, which goes negative when reading past the end
+    int64_t bits_left;
+} bitstream_t;
+
+static void init_bitstream(bitstream_t* bitstream, const uint8_t* data, uint32_t size) {
+    *bitstream = (bitstream_t){.data = data, .end = data + size, .bits_left = (int64_t)size*8};
+}
+
+// The next 32 bits
+static uint32_t peek_bits(bitstream_t* bitstream) {
+    if(bitstream->cache_bits < 32) {
+        if(bitstream->end - bitstream->data >= 4) {
+            const uint8_t* data = bitstream->data;
+            uint64_t word = (uint32_t)data[0]<<24|data[1]<<16|data[2]<<8|data[3];
+            bitstream->cache |= word << (32 - bitstream->cache_bits);
+            bitstream->cache_bits += 32;
+            bitstream->data += 4;
+        } else {
+            while(bitstream->cache_bits <= 56) {
+                uint64_t byte = bitstream->data < bitstream->end ? *bitstream->data++ : 0;
+                bitstream->cache |= byte << (56 - bitstream->cache_bits);
+                bitstream->cache_bits += 8;
+            }
+        }
+    }
+    return bitstream->cache >> 32;
+}
+
+static void skip_bits(bitstream_t* bitstream, int count) {
+    bitstream->cache <<= count;
+    bitstream->cache_bits -= count;
+    bitstream->bits_left -= count;
+}
+
+static uint32_t read_bits(bitstream_t* bitstream, int count) {
+    uint32_t value = peek_bits(bitstream) >> (32 - count);
+    skip_bits(bitstream,count);
+    return value;
+}
+
+// A unary prefix of q zeros and a one picks between a Rice code and, for longer prefixes, an
+// exp-Golomb code continuing past the values Rice covers. The prefix's zeros are counted in one
+// go and the whole codeword taken from the same 32 bits.
+static uint32_t decode_codeword(uint32_t window, uint8_t codebook, int* length) {
+    uint32_t rice_order = codebook >> 5;
+    uint32_t exp_order = (codebook >> 2) & 7;
+    uint32_t switch_bits = codebook & 3;
+    assert(window != 0,"Error: invalid codeword");
+    int q = __builtin_clz(window);
+    if(q > switch_bits) {
+        // The one ending the prefix is the top bit of the exp-Golomb value
+        *length = exp_order - switch_bits + 2*q;
+        assert(*length <= 32,"Error: invalid codeword");
+        uint32_t value = (uint64_t)window >> (32 - *length);
+        return value - (1u << exp_order) + ((switch_bits + 1) << rice_order);
+    }
+    *length = q + 1 + rice_order;
+    return (q << rice_order) + ((window >> (32 - *length)) & ((1u << rice_order) - 1));
+}
+
+static uint32_t read_codeword(bitstream_t* bitstream, const uint16_t* table, uint8_t codebook) {
+    uint32_t window = peek_bits(bitstream);
+    uint16_t entry = table[window >> (32 - TABLE_BITS)];
+    if(entry & 15) {
+        skip_bits(bitstream,entry & 15);
+        return entry >> 4;
+    }
+    int length;
+    uint32_t value = decode_codeword(window,codebook,&length);
+    skip_bits(bitstream,length);
+    return value;
+}
+
+static const uint16_t* codebook_table(uint8_t codebook, uint8_t* codebooks, int* count) {
+    for(int i = 0; i < *count; i++) {
+        if(codebooks[i] == codebook) return codebook_tables[i];
+    }
+    assert(*count < DISTINCT_CODEBOOKS,"Error: too many codebooks");
+    uint16_t* table = codebook_tables[*count];
+    codebooks[(*count)++] = codebook;
+    for(uint32_t bits = 0; bits < (1 << TABLE_BITS); bits++) {
+        uint32_t window = bits << (32 - TABLE_BITS);
+        table[bits] = 0;
+        if(window == 0) continue;
+        int length;
+        uint32_t value = decode_codeword(window,codebook,&length);
+        if(length <= TABLE_BITS) table[bits] = value << 4 | length;
+    }
+    return table;
+}
+
+static void init_tables(void) {
+    uint8_t codebooks[DISTINCT_CODEBOOKS];
+    int count = 0;
+    first_dc_table = codebook_table(FIRST_DC_CODEBOOK,codebooks,&count);
+    for(int i = 0; i < 7; i++) dc_tables[i] = codebook_table(dc_codebooks[i],codebooks,&count);
+    for(int i = 0; i < 16; i++) run_tables[i] = codebook_table(run_codebooks[i],codebooks,&count);
+    for(int i = 0; i < 10; i++) level_tables[i] = codebook_table(level_codebooks[i],codebooks,&count);
+
+    const uint8_t* scans[2] = {progressive_scan,interlaced_scan};
+    for(int s = 0; s < 2; s++) {
+        for(uint32_t log2_block_count = 0; log2_block_count < 6; log2_block_count++) {
+            uint32_t block_mask = (1 << log2_block_count) - 1;
+            for(uint32_t position = 0; position < (64u << log2_block_count); position++) {
+                interleaved_scans[s][log2_block_count][position] = ((position & block_mask) << 6) + scans[s][position >> log2_block_count];
+            }
+        }
+    }
+}
+
+// Levels are kept in 16 bits. Any larger would be clamped after dequantizing anyway.
+static int16_t saturate_level(int32_t level) {
+    return level < INT16_MIN ? INT16_MIN : level > INT16_MAX ? INT16_MAX : level;
+}
+
+// DC coefficients are coded first for every block of the slice, each as the difference from
+// the last, the difference's sign coded relative to the previous one's
+static void decode_dc_coefficients(bitstream_t* bitstream, int16_t* blocks, uint32_t block_count) {
+    uint32_t code = read_codeword(bitstream,first_dc_table,FIRST_DC_CODEBOOK);
+    int32_t dc = (code >> 1) ^ -(code & 1);
+    blocks[0] = saturate_level(dc);
+    int32_t sign = 0;
+    code = 5;
+    for(uint32_t i = 1; i < block_count; i++) {
+        uint32_t state = code < 6 ? code : 6;
+        code = read_codeword(bitstream,dc_tables[state],dc_codebooks[state]);
+        if(code) sign ^= -(code & 1);
+        else sign = 0;
+        dc += (((code + 1) >> 1) ^ sign) - sign;
+        blocks[64*i] = saturate_level(dc);
+    }
+}
+
+// AC coefficients are run-level coded with the blocks interleaved, so the blocks' coefficients
+// at each scan position follow one another. Zeros pad the data to its end.
+static void decode_ac_coefficients(bitstream_t* bitstream, int16_t* blocks, uint32_t log2_block_count, bool interlaced) {
+    const uint16_t* scan = interleaved_scans[interlaced][log2_block_count];
+    uint32_t end = 64u << log2_block_count;
+    uint32_t run = 4;
+    uint32_t level = 2;
+    for(uint32_t position = (1 << log2_block_count) - 1;;) {
+        if(bitstream->bits_left <= 0) break;
+        if(bitstream->bits_left < 32 && (peek_bits(bitstream) >> (32 - bitstream->bits_left)) == 0) break;
+        uint32_t state = run < 15 ? run : 15;
+        run = read_codeword(bitstream,run_tables[state],run_codebooks[state]);
+        position += run + 1;
+        assert(position < end,"Error: too many coefficients in a slice");
+        state = level < 9 ? level : 9;
+        level = read_codeword(bitstream,level_tables[state],level_codebooks[state]) + 1;
+        int16_t value = level > INT16_MAX ? INT16_MAX : level;
+        bool negative = peek_bits(bitstream) >> 31;
+        skip_bits(bitstream,1);
+        blocks[scan[position]] = negative ? -value : value;
+    }
+}
+
+// Decodes the levels of one component of a slice into 2^log2_block_count blocks, which start zeroed
+// DC coefficients all come ahead of the AC ones, so decoding at 1/8 scale stops after them
+void decode_coefficients(const uint8_t* data, uint32_t size, int16_t* blocks, uint32_t log2_block_count, bool interlaced, bool dc_only) {
+    pthread_once(&tables_once,init_tables);
+    bitstream_t bitstream;
+    init_bitstream(&bitstream,data,size);
+    decode_dc_coefficients(&bitstream,blocks,1 << log2_block_count);
+    if(dc_only) return;
+    decode_ac_coefficients(&bitstream,blocks,log2_block_count,interlaced);
+}
+
+// Writes samples in raster order over rows width samples long
+typedef struct {
+    uint16_t* row;
+    uint32_t stride;
+    uint32_t width;
+    uint32_t x;
+} sample_writer;
+
+// Runs of alpha are mostly whole rows of opaque or clear, which the fill loop turns into wide stores
+static void put_samples(sample_writer* writer, uint16_t value, uint32_t count) {
+    while(count > 0) {
+        uint32_t length = writer->width - writer->x < count ? writer->width - writer->x : count;
+        uint16_t* output = writer->row + writer->x;
+        for(uint32_t i = 0; i < length; i++) {
+            output[i] = value;
+        }
+        count -= length;
+        writer->x += length;
+        if(writer->x == writer->width) {
+            writer->x = 0;
+            writer->row += writer->stride;
+        }
+    }
+}
+
+// Alpha is coded in raster order over the slice, each value a difference from the last, short
+// ones in a few bits and anything else given whole. A zero bit after a value starts a run of
+// it, 4 bits long or 11 when those are 0. Values are scaled from alpha_bits to bit_depth.
+void decode_alpha(const uint8_t* data, uint32_t size, uint16_t* output, uint32_t stride, uint32_t width, uint32_t height, uint8_t alpha_bits, uint8_t bit_depth) {
+    bitstream_t bitstream;
+    init_bitstream(&bitstream,data,size);
+    sample_writer writer = {.row = output, .stride = stride, .width = width};
+    uint32_t mask = (1u << alpha_bits) - 1;
+    int difference_bits = alpha_bits == 16 ? 7 : 4;
+    uint32_t alpha = mask;
+    uint32_t left = width*height;
+    while(left > 0) {
+        uint16_t sample;
+        do {
+            int32_t difference;
+            if(read_bits(&bitstream,1)) {
+                difference = read_bits(&bitstream,alpha_bits);
+            } else {
+                uint32_t code = read_bits(&bitstream,difference_bits);
+                difference = (code + 2) >> 1;
+                if(code & 1) difference = -difference;
+            }
+            alpha = (alpha + difference) & mask;
+            sample = alpha_bits == 16 ? alpha >> (16 - bit_depth) : alpha << (bit_depth - 8) | alpha >> (16 - bit_depth);
+            put_samples(&writer,sample,1);
+            if(--left == 0) return;
+        } while(bitstream.bits_left > 0 && read_bits(&bitstream,1));
+        uint32_t run = read_bits(&bitstream,4);
+        if(run == 0) run = read_bits(&bitstream,11);
+        if(run > left) run = left;
+        put_samples(&writer,sample,run);
+        left -= run;
+    }
+}
@@ -0,0 +1,39 @@
+#include "prores_decoder.h"
+
+// Where a thread's errors go instead of ending the program, while it's running something
+// through catch_prores_errors
+typedef struct {
+    jmp_buf jump;
+    prores_error error;
+} error_handler;
+
+static _Thread_local error_handler* current_handler = NULL;
+
+void raise_prores_error(prores_error error) {
+    if(current_handler != NULL) {
+        current_handler->error = error;
+        longjmp(current_handler->jump,1);
+    }
+    print_prores_error(error);
+    exit(1);
+}
+
+void print_prores_error(prores_error error) {
+    printf("%s at line %d: %s\n",error.kind,error.line,error.message);
+}
+
+// Runs body(context), returning false with what went wrong in error if it raised one. Whatever
+// body had allocated when it raised the error is its caller's to free.
+bool catch_prores_errors(void (*body)(void* context), void* context, prores_error* error) {
+    error_handler handler;
+    error_handler* previous = current_handler;
+    current_handler = &handler;
+    if(setjmp(handler.jump) == 0) {
+        body(context);
+        current_handler = previous;
+        return true;
+    }
+    current_handler = previous;
+    *error = handler.error;
+    return false;
+}
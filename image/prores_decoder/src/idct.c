@@ -0,0 +1,270 @@
+#include "prores_decoder.h"
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#define AVX2 __attribute__((target("avx2")))
+#endif
+
+// cos(i*pi/16)*sqrt(2) in 2.14 fixed point
+#define W1 22725
+#define W2 21407
+#define W3 19266
+#define W4 16384
+#define W5 12873
+#define W6 8867
+#define W7 4520
+#define ROW_SHIFT 14
+// Coefficients are scaled for 12 bit samples, so 10 bit output takes two more bits off
+#define COLUMN_SHIFT(bit_depth) (31-ROW_SHIFT+12-(bit_depth))
+// Output is clamped to the legal range, leaving out the codes 8 bit 0 and 255 scale up to
+#define SAMPLE_MIN(bit_depth) (1 << ((bit_depth)-8))
+#define SAMPLE_MAX(bit_depth) ((1 << (bit_depth)) - 1 - SAMPLE_MIN(bit_depth))
+
+// Quantizer steps are capped just past the coefficient limit, where any level but 0 clamps anyway,
+// so the products of 16 bit levels and steps always fit in 32 bits
+void scale_qmat(int16_t* output, const uint8_t* qmat, int32_t qscale) {
+    for(int i = 0; i < 64; i++) {
+        int32_t step = qmat[i] * qscale;
+        output[i] = step > COEFFICIENT_LIMIT+1 ? COEFFICIENT_LIMIT+1 : step;
+    }
+}
+
+static int32_t clamp_coefficient(int32_t value) {
+    return value < -COEFFICIENT_LIMIT ? -COEFFICIENT_LIMIT : value > COEFFICIENT_LIMIT ? COEFFICIENT_LIMIT : value;
+}
+
+// One dimensional inverse DCT of 8 values step apart, outputs rounded and shifted right
+static void idct_1d(const int32_t* input, int32_t* output, int step, int shift) {
+    int32_t x0 = input[0], x1 = input[step], x2 = input[2*step], x3 = input[3*step];
+    int32_t x4 = input[4*step], x5 = input[5*step], x6 = input[6*step], x7 = input[7*step];
+    int32_t a0 = W4*x0 + W2*x2 + W4*x4 + W6*x6;
+    int32_t a1 = W4*x0 + W6*x2 - W4*x4 - W2*x6;
+    int32_t a2 = W4*x0 - W6*x2 - W4*x4 + W2*x6;
+    int32_t a3 = W4*x0 - W2*x2 + W4*x4 - W6*x6;
+    int32_t b0 = W1*x1 + W3*x3 + W5*x5 + W7*x7;
+    int32_t b1 = W3*x1 - W7*x3 - W1*x5 - W5*x7;
+    int32_t b2 = W5*x1 - W1*x3 + W7*x5 + W3*x7;
+    int32_t b3 = W7*x1 - W5*x3 + W3*x5 - W1*x7;
+    int32_t round = 1 << (shift-1);
+    output[0] = (a0 + b0 + round) >> shift;
+    output[step] = (a1 + b1 + round) >> shift;
+    output[2*step] = (a2 + b2 + round) >> shift;
+    output[3*step] = (a3 + b3 + round) >> shift;
+    output[4*step] = (a3 - b3 + round) >> shift;
+    output[5*step] = (a2 - b2 + round) >> shift;
+    output[6*step] = (a1 - b1 + round) >> shift;
+    output[7*step] = (a0 - b0 + round) >> shift;
+}
+
+// Dequantizes a block and writes its inverse DCT, the reference the SIMD kernels match exactly
+static void idct_put_c(uint16_t* output, uint32_t stride, const int16_t* levels, const int16_t* qmat, uint8_t bit_depth) {
+    int32_t block[64];
+    for(int i = 0; i < 64; i++) {
+        block[i] = clamp_coefficient(levels[i]*qmat[i]);
+    }
+    for(int y = 0; y < 8; y++) {
+        idct_1d(block+8*y,block+8*y,1,ROW_SHIFT);
+        for(int x = 0; x < 8; x++) {
+            block[8*y+x] = clamp_coefficient(block[8*y+x]);
+        }
+    }
+    for(int x = 0; x < 8; x++) {
+        idct_1d(block+x,block+x,8,COLUMN_SHIFT(bit_depth));
+    }
+    int32_t min = SAMPLE_MIN(bit_depth);
+    int32_t max = SAMPLE_MAX(bit_depth);
+    for(int y = 0; y < 8; y++) {
+        for(int x = 0; x < 8; x++) {
+            int32_t value = block[8*y+x] + (1 << (bit_depth-1));
+            output[(size_t)y*stride+x] = value < min ? min : value > max ? max : value;
+        }
+    }
+}
+
+void idct_put_pair_c(uint16_t* first, uint16_t* second, uint32_t stride, const int16_t* levels, const int16_t* qmat, uint8_t bit_depth) {
+    idct_put_c(first,stride,levels,qmat,bit_depth);
+    idct_put_c(second,stride,levels+64,qmat,bit_depth);
+}
+
+// Weights of every frequency for each output sample of a 1, 2 and 4 point inverse DCT, scaled
+// like W1 to W7. Each is the mean of the full size weights over the samples the output covers,
+// so every sample is the exact average of the full size samples it covers.
+static const int32_t reduced_weights[3][4][8] = {
+    {{W4}},
+    {
+        {16384, 14846, 0, -5213, 0, 3483, 0, -2953},
+        {16384, -14846, 0, 5213, 0, -3483, 0, 2953}
+    },
+    {
+        {16384, 20995, 15137, 7373, 0, -4926, -6270, -4176},
+        {16384, 8697, -15137, -17799, 0, 11893, 6270, -1730},
+        {16384, -8697, -15137, 17799, 0, -11893, 6270, 1730},
+        {16384, -20995, 15137, -7373, 0, 4926, -6270, 4176}
+    }
+};
+
+// Inlined for each size so its loops unroll
+static inline void idct_put_reduced_size(uint16_t* output, uint32_t stride, const int16_t* levels, const int16_t* qmat, uint8_t bit_depth, uint32_t size) {
+    const int32_t (*weights)[8] = reduced_weights[size >> 1];
+    int32_t coefficients[64], block[32];
+    for(int i = 0; i < 64; i++) {
+        coefficients[i] = clamp_coefficient(levels[i]*qmat[i]);
+    }
+    for(uint32_t v = 0; v < 8; v++) {
+        for(uint32_t n = 0; n < size; n++) {
+            int32_t sum = 0;
+            for(uint32_t u = 0; u < 8; u++) {
+                sum += coefficients[8*v+u] * weights[n][u];
+            }
+            block[size*v+n] = clamp_coefficient((sum + (1 << (ROW_SHIFT-1))) >> ROW_SHIFT);
+        }
+    }
+    int shift = COLUMN_SHIFT(bit_depth);
+    int32_t min = SAMPLE_MIN(bit_depth);
+    int32_t max = SAMPLE_MAX(bit_depth);
+    for(uint32_t m = 0; m < size; m++) {
+        for(uint32_t n = 0; n < size; n++) {
+            int32_t sum = 0;
+            for(uint32_t v = 0; v < 8; v++) {
+                sum += block[size*v+n] * weights[m][v];
+            }
+            int32_t value = ((sum + (1 << (shift-1))) >> shift) + (1 << (bit_depth-1));
+            output[(size_t)m*stride+n] = value < min ? min : value > max ? max : value;
+        }
+    }
+}
+
+// Writes a block at 1/2, 1/4 or 1/8 scale as size by size samples, each the average of the
+// samples it covers at full size. Only the DC contributes to those averages at 1/8 scale.
+void idct_put_reduced(uint16_t* output, uint32_t stride, const int16_t* levels, const int16_t* qmat, uint8_t bit_depth, uint32_t size) {
+    switch(size) {
+        case 4: idct_put_reduced_size(output,stride,levels,qmat,bit_depth,4); break;
+        case 2: idct_put_reduced_size(output,stride,levels,qmat,bit_depth,2); break;
+        default: idct_put_reduced_size(output,stride,levels,qmat,bit_depth,1); break;
+    }
+}
+
+#if defined(__SSE2__)
+// The SIMD passes work on a row of 8 lanes at once, each lane a separate one dimensional
+// transform. Pairs of inputs are interleaved so one multiply-add gives two products of a sum,
+// which come to the same 32 bit sums as the reference.
+#define PAIR(a,b) ((int32_t)(uint16_t)(a) | (int32_t)((uint32_t)(uint16_t)(b) << 16))
+
+// Expands a kernel body for SSE2 on one block or for AVX2 on two, one in each 128 bit lane,
+// as every instruction used stays within its lane
+#define IDCT_PASS(V,P,x,shift,out) { \
+    V x04l = P##_unpacklo_epi16(x[0],x[4]), x04h = P##_unpackhi_epi16(x[0],x[4]); \
+    V x26l = P##_unpacklo_epi16(x[2],x[6]), x26h = P##_unpackhi_epi16(x[2],x[6]); \
+    V x15l = P##_unpacklo_epi16(x[1],x[5]), x15h = P##_unpackhi_epi16(x[1],x[5]); \
+    V x37l = P##_unpacklo_epi16(x[3],x[7]), x37h = P##_unpackhi_epi16(x[3],x[7]); \
+    static const int32_t even[4][2] = {{PAIR(W4,W4),PAIR(W2,W6)},{PAIR(W4,-W4),PAIR(W6,-W2)},{PAIR(W4,-W4),PAIR(-W6,W2)},{PAIR(W4,W4),PAIR(-W2,-W6)}}; \
+    static const int32_t odd[4][2] = {{PAIR(W1,W5),PAIR(W3,W7)},{PAIR(W3,-W1),PAIR(-W7,-W5)},{PAIR(W5,W7),PAIR(-W1,W3)},{PAIR(W7,W3),PAIR(-W5,-W1)}}; \
+    V round = P##_set1_epi32(1 << ((shift)-1)); \
+    __m128i count = _mm_cvtsi32_si128(shift); \
+    for(int n = 0; n < 4; n++) { \
+        V e0 = P##_set1_epi32(even[n][0]), e1 = P##_set1_epi32(even[n][1]); \
+        V o0 = P##_set1_epi32(odd[n][0]), o1 = P##_set1_epi32(odd[n][1]); \
+        V al = P##_add_epi32(P##_add_epi32(P##_madd_epi16(x04l,e0),P##_madd_epi16(x26l,e1)),round); \
+        V ah = P##_add_epi32(P##_add_epi32(P##_madd_epi16(x04h,e0),P##_madd_epi16(x26h,e1)),round); \
+        V bl = P##_add_epi32(P##_madd_epi16(x15l,o0),P##_madd_epi16(x37l,o1)); \
+        V bh = P##_add_epi32(P##_madd_epi16(x15h,o0),P##_madd_epi16(x37h,o1)); \
+        out[n] = P##_packs_epi32(P##_sra_epi32(P##_add_epi32(al,bl),count),P##_sra_epi32(P##_add_epi32(ah,bh),count)); \
+        out[7-n] = P##_packs_epi32(P##_sra_epi32(P##_sub_epi32(al,bl),count),P##_sra_epi32(P##_sub_epi32(ah,bh),count)); \
+    } \
+}
+
+#define TRANSPOSE(V,P,x,out) { \
+    V t0 = P##_unpacklo_epi16(x[0],x[1]), t1 = P##_unpackhi_epi16(x[0],x[1]); \
+    V t2 = P##_unpacklo_epi16(x[2],x[3]), t3 = P##_unpackhi_epi16(x[2],x[3]); \
+    V t4 = P##_unpacklo_epi16(x[4],x[5]), t5 = P##_unpackhi_epi16(x[4],x[5]); \
+    V t6 = P##_unpacklo_epi16(x[6],x[7]), t7 = P##_unpackhi_epi16(x[6],x[7]); \
+    V u0 = P##_unpacklo_epi32(t0,t2), u1 = P##_unpackhi_epi32(t0,t2); \
+    V u2 = P##_unpacklo_epi32(t1,t3), u3 = P##_unpackhi_epi32(t1,t3); \
+    V u4 = P##_unpacklo_epi32(t4,t6), u5 = P##_unpackhi_epi32(t4,t6); \
+    V u6 = P##_unpacklo_epi32(t5,t7), u7 = P##_unpackhi_epi32(t5,t7); \
+    out[0] = P##_unpacklo_epi64(u0,u4); out[1] = P##_unpackhi_epi64(u0,u4); \
+    out[2] = P##_unpacklo_epi64(u1,u5); out[3] = P##_unpackhi_epi64(u1,u5); \
+    out[4] = P##_unpacklo_epi64(u2,u6); out[5] = P##_unpackhi_epi64(u2,u6); \
+    out[6] = P##_unpacklo_epi64(u3,u7); out[7] = P##_unpackhi_epi64(u3,u7); \
+}
+
+// Levels times steps as 32 bit products, saturated back to 16 bits and clamped
+#define DEQUANTIZE(V,P,levels,steps,out) { \
+    V limit = P##_set1_epi16(COEFFICIENT_LIMIT), negative_limit = P##_set1_epi16(-COEFFICIENT_LIMIT); \
+    for(int i = 0; i < 8; i++) { \
+        V low = P##_mullo_epi16(levels[i],steps[i]), high = P##_mulhi_epi16(levels[i],steps[i]); \
+        V product = P##_packs_epi32(P##_unpacklo_epi16(low,high),P##_unpackhi_epi16(low,high)); \
+        out[i] = P##_max_epi16(P##_min_epi16(product,limit),negative_limit); \
+    } \
+}
+
+#define CLAMP_ROWS(V,P,x) { \
+    V limit = P##_set1_epi16(COEFFICIENT_LIMIT), negative_limit = P##_set1_epi16(-COEFFICIENT_LIMIT); \
+    for(int i = 0; i < 8; i++) x[i] = P##_max_epi16(P##_min_epi16(x[i],limit),negative_limit); \
+}
+
+// Rows are transposed so the first pass runs across them, then transposed back for the second,
+// whose outputs come out as rows of the block
+#define IDCT_BODY(V,P,levels,steps,bit_depth,rows) { \
+    V coefficients[8], transposed[8], pass[8]; \
+    DEQUANTIZE(V,P,levels,steps,coefficients); \
+    TRANSPOSE(V,P,coefficients,transposed); \
+    IDCT_PASS(V,P,transposed,ROW_SHIFT,pass); \
+    CLAMP_ROWS(V,P,pass); \
+    TRANSPOSE(V,P,pass,transposed); \
+    IDCT_PASS(V,P,transposed,COLUMN_SHIFT(bit_depth),rows); \
+    V offset = P##_set1_epi16(1 << ((bit_depth)-1)); \
+    V min = P##_set1_epi16(SAMPLE_MIN(bit_depth)), max = P##_set1_epi16(SAMPLE_MAX(bit_depth)); \
+    for(int i = 0; i < 8; i++) rows[i] = P##_max_epi16(P##_min_epi16(P##_add_epi16(rows[i],offset),max),min); \
+}
+
+static void idct_put_sse2(uint16_t* output, uint32_t stride, const int16_t* levels, const int16_t* qmat, uint8_t bit_depth) {
+    __m128i level_rows[8], steps[8], rows[8];
+    for(int i = 0; i < 8; i++) {
+        level_rows[i] = _mm_loadu_si128((const __m128i*)(levels+8*i));
+        steps[i] = _mm_loadu_si128((const __m128i*)(qmat+8*i));
+    }
+    IDCT_BODY(__m128i,_mm,level_rows,steps,bit_depth,rows);
+    for(int i = 0; i < 8; i++) {
+        _mm_storeu_si128((__m128i*)(output+(size_t)i*stride),rows[i]);
+    }
+}
+
+void idct_put_pair_sse2(uint16_t* first, uint16_t* second, uint32_t stride, const int16_t* levels, const int16_t* qmat, uint8_t bit_depth) {
+    idct_put_sse2(first,stride,levels,qmat,bit_depth);
+    idct_put_sse2(second,stride,levels+64,qmat,bit_depth);
+}
+
+AVX2 void idct_put_pair_avx2(uint16_t* first, uint16_t* second, uint32_t stride, const int16_t* levels, const int16_t* qmat, uint8_t bit_depth) {
+    __m256i level_rows[8], steps[8], rows[8];
+    for(int i = 0; i < 8; i++) {
+        __m128i low = _mm_loadu_si128((const __m128i*)(levels+8*i));
+        __m128i high = _mm_loadu_si128((const __m128i*)(levels+64+8*i));
+        level_rows[i] = _mm256_inserti128_si256(_mm256_castsi128_si256(low),high,1);
+        steps[i] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)(qmat+8*i)));
+    }
+    IDCT_BODY(__m256i,_mm256,level_rows,steps,bit_depth,rows);
+    for(int i = 0; i < 8; i++) {
+        _mm_storeu_si128((__m128i*)(first+(size_t)i*stride),_mm256_castsi256_si128(rows[i]));
+        _mm_storeu_si128((__m128i*)(second+(size_t)i*stride),_mm256_extracti128_si256(rows[i],1));
+    }
+}
+#endif
+
+static idct_pair_kernel idct_kernel;
+static pthread_once_t idct_once = PTHREAD_ONCE_INIT;
+
+static void init_idct_kernel(void) {
+    idct_kernel = idct_put_pair_c;
+#if defined(__SSE2__)
+    idct_kernel = idct_put_pair_sse2;
+    if(__builtin_cpu_supports("avx2")) idct_kernel = idct_put_pair_avx2;
+#endif
+}
+
+// The fastest kernel the CPU runs. The SIMD kernels match the reference exactly, which the IDCT
+// test checks.
+idct_pair_kernel select_idct_kernel(void) {
+    pthread_once(&idct_once,init_idct_kernel);
+    return idct_kernel;
+}
@@ -0,0 +1,42 @@
+#include "prores_decoder.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+int main(int argc, char* argv[]) {
+    assert(argc >= 2, "No input file!");
+    int file = open(argv[1],O_RDONLY);
+    assert(file >= 0, "Error: no such file or directory");
+    // Optional output format, yuv keeping the decoded Y'CbCr planes, thread count, 0 picking the
+    // default, and scale to decode at, 2, 4 or 8 shrinking the image by that much
+    bool ycbcr_output = argc >= 3 && strcmp(argv[2],"yuv") == 0;
+    enum image_format format = argc >= 3 && !ycbcr_output ? parse_image_format(argv[2]) : IMAGE_FORMAT_PPM;
+    int thread_count = argc >= 4 ? atoi(argv[3]) : 0;
+    if(thread_count == 0) thread_count = default_thread_count();
+    assert(thread_count > 0,"Error: invalid thread count");
+    int scale = argc >= 5 ? atoi(argv[4]) : 1;
+    assert(scale == 1 || scale == 2 || scale == 4 || scale == 8,"Error: scale must be 1, 2, 4 or 8");
+    output_options options = {
+        .name = argv[1],
+        .ycbcr_output = ycbcr_output,
+        .format = format,
+        .log2_scale = scale == 8 ? 3 : scale >> 1,
+        .verbose = true
+    };
+    // Optional crop as widthxheight+x+y in full size pixels, decoding only that part of each frame
+    if(argc >= 6) {
+        rect_t* crop = &options.crop;
+        assert(sscanf(argv[5],"%ux%u+%u+%u",&crop->width,&crop->height,&crop->x,&crop->y) == 4,"Error: crop must be widthxheight+x+y");
+        options.cropped = true;
+    }
+
+    frame_index index;
+    assert(read_frame_index(file,&index),"Error: not a ProRes frame or a QuickTime file with a ProRes track");
+    if(index.from_container) printf("Frames: %d\n",index.count);
+    slice_scheduler scheduler;
+    init_slice_scheduler(&scheduler,thread_count);
+    decode_frames(file,&index,&options,&scheduler);
+    free_slice_scheduler(&scheduler);
+    free_frame_index(&index);
+    close(file);
+}
@@ -0,0 +1,178 @@
+#include "prores_decoder.h"
+
+// Frames in flight at once, being read, decoded and written
+#define FRAME_SLOTS 4
+
+// A frame's data and the buffers it's decoded into, kept for whichever frame uses the slot next
+typedef struct {
+    uint8_t* data;
+    size_t capacity;
+    frame_header hdr;
+    planar_image_t planes;
+    image_t image;
+} frame_slot;
+
+struct frame_pipeline {
+    int file;
+    const frame_index* index;
+    const output_options* options;
+    slice_scheduler* scheduler;
+    char* name;
+    frame_slot slots[FRAME_SLOTS];
+    // Frames each stage has finished. Frame i goes through slot i % FRAME_SLOTS, so reading stays
+    // less than FRAME_SLOTS frames ahead of writing.
+    uint32_t read;
+    uint32_t decoded;
+    uint32_t written;
+    // The first error any stage raised, which stops the others too
+    bool failed;
+    prores_error error;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+};
+
+// Returns false if another stage has failed instead
+static bool wait_for(struct frame_pipeline* pipeline, const uint32_t* count, uint32_t frames) {
+    pthread_mutex_lock(&pipeline->lock);
+    while(*count < frames && !pipeline->failed) {
+        pthread_cond_wait(&pipeline->changed,&pipeline->lock);
+    }
+    bool failed = pipeline->failed;
+    pthread_mutex_unlock(&pipeline->lock);
+    return !failed;
+}
+
+static void finish_frame(struct frame_pipeline* pipeline, uint32_t* count) {
+    pthread_mutex_lock(&pipeline->lock);
+    (*count)++;
+    pthread_cond_broadcast(&pipeline->changed);
+    pthread_mutex_unlock(&pipeline->lock);
+}
+
+// Runs a stage until it's done or raises an error, which is passed on to the others
+static void run_stage(struct frame_pipeline* pipeline, void (*stage)(void* pipeline)) {
+    prores_error error;
+    if(catch_prores_errors(stage,pipeline,&error)) return;
+    pthread_mutex_lock(&pipeline->lock);
+    if(!pipeline->failed) {
+        pipeline->failed = true;
+        pipeline->error = error;
+    }
+    pthread_cond_broadcast(&pipeline->changed);
+    pthread_mutex_unlock(&pipeline->lock);
+}
+
+static void read_frames(void* arg) {
+    struct frame_pipeline* pipeline = arg;
+    const frame_index* index = pipeline->index;
+    for(uint32_t i = 0; i < index->count; i++) {
+        if(i >= FRAME_SLOTS && !wait_for(pipeline,&pipeline->written,i + 1 - FRAME_SLOTS)) return;
+        frame_slot* slot = &pipeline->slots[i % FRAME_SLOTS];
+        if(index->sizes[i] > slot->capacity) {
+            free(slot->data);
+            slot->capacity = index->sizes[i];
+            slot->data = malloc(slot->capacity);
+            assert(slot->data != NULL,"Error: unable to allocate memory");
+        }
+        read_at(pipeline->file,slot->data,index->sizes[i],index->offsets[i]);
+        finish_frame(pipeline,&pipeline->read);
+    }
+}
+
+static void write_frames(void* arg) {
+    struct frame_pipeline* pipeline = arg;
+    const output_options* options = pipeline->options;
+    char* name = pipeline->name;
+    for(uint32_t i = 0; i < pipeline->index->count; i++) {
+        if(!wait_for(pipeline,&pipeline->decoded,i + 1)) return;
+        frame_slot* slot = &pipeline->slots[i % FRAME_SLOTS];
+        // Frames from a container are numbered, a lone frame keeps the input's name
+        if(pipeline->index->from_container) {
+            sprintf(name,"%s.%06u",options->name,pipeline->index->first + i);
+        } else {
+            strcpy(name,options->name);
+        }
+        if(options->ycbcr_output) {
+            write_planar_image(&slot->planes,name);
+        } else {
+            write_image(slot->image,name,options->format,slot->hdr.alpha_bits != 0);
+        }
+        finish_frame(pipeline,&pipeline->written);
+    }
+}
+
+// Sets the slot's output buffers up for a frame, reusing them while frames keep the same layout
+static void prepare_slot(frame_slot* slot, const output_options* options) {
+    planar_image_t planes = frame_planes(&slot->hdr,options);
+    bool same_layout = planes.strides[0] == slot->planes.strides[0] && planes.height == slot->planes.height &&
+        planes.width == slot->planes.width && planes.chroma_shift == slot->planes.chroma_shift &&
+        planes.strides[3] == slot->planes.strides[3];
+    if(options->ycbcr_output) {
+        if(slot->planes.planes[0] != NULL && same_layout) return;
+        free(slot->planes.planes[0]);
+        malloc_planes(&planes);
+    } else if(slot->image.data == NULL || !same_layout) {
+        free(slot->image.data);
+        slot->image = malloc_new_image(planes.width,planes.height,planes.bit_depth);
+        assert(slot->image.data != NULL,"Error: unable to allocate memory");
+    }
+    slot->planes = planes;
+}
+
+static void decode_frames_in_slots(void* arg) {
+    struct frame_pipeline* pipeline = arg;
+    const frame_index* index = pipeline->index;
+    const output_options* options = pipeline->options;
+    for(uint32_t i = 0; i < index->count; i++) {
+        if(!wait_for(pipeline,&pipeline->read,i + 1)) return;
+        frame_slot* slot = &pipeline->slots[i % FRAME_SLOTS];
+        uint32_t picture_offset;
+        slot->hdr = read_frame(slot->data,index->sizes[i],&picture_offset);
+        if(i == 0 && options->verbose) print_frame_header(&slot->hdr);
+        prepare_slot(slot,options);
+        decode_pictures(slot->data + picture_offset,index->sizes[i] - picture_offset,&slot->hdr,pipeline->scheduler,&slot->planes,options->ycbcr_output ? NULL : &slot->image);
+        finish_frame(pipeline,&pipeline->decoded);
+    }
+}
+
+static void* read_stage(void* pipeline) {
+    run_stage(pipeline,read_frames);
+    return NULL;
+}
+
+static void* write_stage(void* pipeline) {
+    run_stage(pipeline,write_frames);
+    return NULL;
+}
+
+// Frames are read in on one thread and written out on another while this one decodes, each
+// frame's slices spread over the scheduler's threads. An error in any stage stops them all, and
+// is raised again here once they have.
+void decode_frames(int file, const frame_index* index, const output_options* options, slice_scheduler* scheduler) {
+    struct frame_pipeline pipeline = {
+        .file = file,
+        .index = index,
+        .options = options,
+        .scheduler = scheduler,
+        .name = malloc(strlen(options->name) + 16)
+    };
+    assert(pipeline.name != NULL,"Error: unable to allocate memory");
+    pthread_mutex_init(&pipeline.lock,NULL);
+    pthread_cond_init(&pipeline.changed,NULL);
+    pthread_t reader, writer;
+    assert(pthread_create(&reader,NULL,read_stage,&pipeline)==0,"Error: unable to start thread");
+    assert(pthread_create(&writer,NULL,write_stage,&pipeline)==0,"Error: unable to start thread");
+    run_stage(&pipeline,decode_frames_in_slots);
+
+    pthread_join(reader,NULL);
+    pthread_join(writer,NULL);
+    for(int i = 0; i < FRAME_SLOTS; i++) {
+        free(pipeline.slots[i].data);
+        free(pipeline.slots[i].planes.planes[0]);
+        free(pipeline.slots[i].image.data);
+    }
+    free(pipeline.name);
+    pthread_mutex_destroy(&pipeline.lock);
+    pthread_cond_destroy(&pipeline.changed);
+    if(pipeline.failed) raise_prores_error(pipeline.error);
+}
@@ -1,25 +1,5 @@
-#include <stdlib.h>
-#include <memory.h>
-#include <stdio.h>
-#include <stdbool.h>
-
-#define err(x) {printf("Error at line %d: %s\n",__LINE__,x);exit(1);}
-#define assert(x,y) {if(!(x)){printf("Assertion failure at line %d: %s\n",__LINE__,y);exit(1);}}
-#define todo(x) {printf("Not implemented at line %d: %s\n",__LINE__,x);exit(1);}
-
-typedef struct {
-    uint16_t r;
-    uint16_t g;
-    uint16_t b;
-    uint16_t a;
-} pixel_t;
-
-typedef struct {
-    pixel_t* data;
-    uint16_t width;
-    uint16_t height;
-    uint8_t bit_depth;
-} image_t;
+#include "prores_decoder.h"
+
 image_t malloc_new_image(uint16_t width, uint16_t height, uint8_t bit_depth) {
     image_t output = {
         .data = malloc(width*height*sizeof(pixel_t)),
@@ -31,49 +11,82 @@ image_t malloc_new_image(uint16_t width, uint16_t height, uint8_t bit_depth) {
     return output;
 }
 
-typedef struct {
-    uint8_t creator[4];
-    uint16_t width;
-    uint16_t height;
-    uint8_t is_444;
-    uint8_t colour_primaries;
-    uint8_t transfer_function;
-    uint8_t colour_space;
-    uint8_t qmat_luma[64];
-    uint8_t qmat_chroma[64];
-} frame_header;
-void write_image(image_t image_data, const char* output_file_name) {
-    uint8_t has_alpha = 0;
-    for(int i = 0; i < image_data.width*image_data.height; i++) {
-        if(image_data.data[i].a != image_data.data[0].a) {
-            has_alpha = 1;
-            break;
-        }
-        if(image_data.data[i].a >= 1<<image_data.bit_depth) {
-            printf("Clipping @ %d.a value %d!\n",i,image_data.data[i].a);
-        }
-        if(image_data.data[i].r >= 1<<image_data.bit_depth) {
-            printf("Clipping @ %d.r value %d!\n",i,image_data.data[i].r);
-        }
-        if(image_data.data[i].g >= 1<<image_data.bit_depth) {
-            printf("Clipping @ %d.g value %d!\n",i,image_data.data[i].g);
-        }
-        if(image_data.data[i].b >= 1<<image_data.bit_depth) {
-            printf("Clipping @ %d.b value %d!\n",i,image_data.data[i].b);
-        }
+// The planes a frame decodes into at the options' scale, with nothing allocated yet. A crop
+// takes in every scaled pixel it touches, starting on an even column for 4:2:2 so chroma stays
+// in pairs.
+planar_image_t frame_planes(const frame_header* hdr, const output_options* options) {
+    uint8_t log2_scale = options->log2_scale;
+    uint8_t chroma_shift = hdr->is_444 ? 0 : 1;
+    uint32_t stride = ((hdr->width + 15) & ~15u) >> log2_scale;
+    planar_image_t planes = {
+        .width = (hdr->width + (1 << log2_scale) - 1) >> log2_scale,
+        .height = (hdr->height + (1 << log2_scale) - 1) >> log2_scale,
+        .chroma_shift = chroma_shift,
+        // 4:4:4 frames are decoded at 12 bits and 4:2:2 ones at 10
+        .bit_depth = hdr->is_444 ? 12 : 10,
+        .log2_scale = log2_scale
+    };
+    if(options->cropped) {
+        const rect_t* crop = &options->crop;
+        assert(crop->width > 0 && crop->height > 0,"Error: empty crop");
+        assert(crop->x < hdr->width && crop->width <= hdr->width - crop->x && crop->y < hdr->height && crop->height <= hdr->height - crop->y,"Error: crop lies outside the frame");
+        uint32_t end_x = (crop->x + crop->width + (1 << log2_scale) - 1) >> log2_scale;
+        uint32_t end_y = (crop->y + crop->height + (1 << log2_scale) - 1) >> log2_scale;
+        planes.cropped = true;
+        planes.x = (crop->x >> log2_scale) & ~(uint32_t)chroma_shift;
+        planes.y = crop->y >> log2_scale;
+        planes.width = end_x - planes.x;
+        planes.height = end_y - planes.y;
+        stride = planes.width;
     }
-    printf("Image %s: %d x %d%s\n",output_file_name,image_data.width,image_data.height,has_alpha?" with alpha":"");
-    char* output_name_buffer = malloc(strlen(output_file_name) + 20);
-    
-    sprintf(output_name_buffer,"%s.ppm",output_file_name);
-    FILE* output_file = fopen(output_name_buffer,"wb");
-    fprintf(output_file,"P6\n%d %d\n%d\n",image_data.width,image_data.height,(1<<image_data.bit_depth)-1);
-    for(int i = 0; i < image_data.width*image_data.height; i++) {
-        uint8_t data;
-        fwrite(&image_data.data[i],2,3,output_file);
+    uint32_t chroma_stride = (stride + chroma_shift) >> chroma_shift;
+    planes.strides[0] = stride;
+    planes.strides[1] = chroma_stride;
+    planes.strides[2] = chroma_stride;
+    planes.strides[3] = hdr->alpha_bits ? stride : 0;
+    return planes;
+}
+
+// Planes cover whole macroblocks so slices can be decoded straight into them, width and height
+// giving the part that is the picture. Rows are rounded up to a macroblock of each field, which
+// interlaced frames need.
+void malloc_planes(planar_image_t* image) {
+    uint32_t rows = (image->height + (32 >> image->log2_scale) - 1) & ~((32u >> image->log2_scale) - 1);
+    size_t luma_size = (size_t)image->strides[0]*rows, chroma_size = (size_t)image->strides[1]*rows;
+    size_t alpha_size = (size_t)image->strides[3]*rows;
+    image->planes[0] = malloc(sizeof(uint16_t)*(luma_size + 2*chroma_size + alpha_size));
+    assert(image->planes[0] != NULL,"Error: unable to allocate memory");
+    image->planes[1] = image->planes[0] + luma_size;
+    image->planes[2] = image->planes[1] + chroma_size;
+    image->planes[3] = alpha_size ? image->planes[2] + chroma_size : NULL;
+}
+
+// Writes the Y', Cb, Cr and any alpha planes one after another as 16 bit samples in host order
+void write_planar_image(const planar_image_t* image, const char* output_file_name) {
+    char* name = malloc(strlen(output_file_name) + 5);
+    assert(name != NULL,"Error: unable to allocate memory");
+    sprintf(name,"%s.yuv",output_file_name);
+    FILE* file = fopen(name,"wb");
+    assert(file != NULL,"Error: unable to open output file");
+    free(name);
+    int plane_count = image->planes[3] != NULL ? 4 : 3;
+    for(int c = 0; c < plane_count; c++) {
+        uint32_t width = c == 1 || c == 2 ? (image->width + image->chroma_shift) >> image->chroma_shift : image->width;
+        for(uint32_t y = 0; y < image->height; y++) {
+            size_t written = fwrite(image->planes[c] + (size_t)y*image->strides[c],sizeof(uint16_t),width,file);
+            assert(written == width,"Error: unable to write output file");
+        }
     }
-    fclose(output_file);
-    free(output_name_buffer);
+    fclose(file);
+    printf("Image %s: %d x %d Y'CbCr %s at %d bits%s\n",output_file_name,image->width,image->height,image->chroma_shift ? "4:2:2" : "4:4:4",image->bit_depth,plane_count == 4 ? " with alpha" : "");
+}
+
+void write_image(image_t image_data, const char* output_file_name, enum image_format format, bool alpha) {
+    struct image_output output;
+    open_image_output(&output,output_file_name,format,image_data.width,image_data.height,image_data.bit_depth,alpha);
+    write_rgba16_rows(&output,(const uint16_t*)image_data.data,image_data.width,image_data.height);
+    close_image_output(&output);
+    printf("Image %s: %d x %d%s\n",output_file_name,image_data.width,image_data.height,output.has_alpha?" with alpha":"");
 }
 
 const char* colour_primaries[23] = {
@@ -143,10 +156,14 @@ const char* colour_space[18] = {
     "YCgCo (odd add)",
 };
 
-frame_header read_frame_header(uint8_t *data, uint16_t* length) {
+// Reads a frame header from the size bytes of the frame after the atom's own header. The 20 bytes
+// of fixed fields are there, and the quantization matrices are only read once the header is known
+// to hold them.
+frame_header read_frame_header(const uint8_t* data, uint32_t size, uint16_t* length) {
     frame_header hdr;
 
     uint16_t header_size = data[0]<<8|data[1];
+    assert(header_size >= 20 && header_size <= size,"Error: frame header runs past the end of the frame");
     *length = header_size;
     
     uint16_t version = data[2]<<8|data[3];
@@ -155,80 +172,378 @@ frame_header read_frame_header(uint8_t *data, uint16_t* length) {
 
     hdr.width = data[8]<<8|data[9];
     hdr.height = data[10]<<8|data[11];
-    hdr.is_444 = data[12]&0xc0;
+    hdr.is_444 = (data[12]>>6) == 3;
+    hdr.interlace_mode = (data[12]>>2)&3;
     hdr.colour_primaries = data[14];
     hdr.transfer_function = data[15];
     hdr.colour_space = data[16];
-    assert((data[17]&0xf)==0,"Alpha is not supported");
+    uint8_t alpha_info = data[17]&0xf;
+    assert(alpha_info<=2,"Error: unknown alpha format");
+    hdr.alpha_bits = alpha_info*8;
 
     uint8_t flags = data[19];
+    assert(20 + 64*((flags >> 1 & 1) + (flags & 1)) <= header_size,"Error: quantization matrices run past the end of the frame header");
     data += 20;
 
-    if(flags & 1) {
+    // The luma matrix comes first but its flag is the higher bit. Without a matrix of its own,
+    // chroma shares luma's.
+    if(flags & 2) {
         memcpy(hdr.qmat_luma,data,64);
         data += 64;
     } else {
         memset(hdr.qmat_luma,4,64);
     }
 
-    if(flags & 2) {
+    if(flags & 1) {
         memcpy(hdr.qmat_chroma,data,64);
         data += 64;
     } else {
-        memset(hdr.qmat_chroma,4,64);
+        memcpy(hdr.qmat_chroma,hdr.qmat_luma,64);
     }
     return hdr;
 }
 
-int main(int argc, char* argv[]) {
-    assert(argc >= 2, "No input file!");
-    FILE* input_file = fopen(argv[1],"rb");
-    assert(input_file != NULL, "Error: no such file or directory");
-    fseek(input_file,0,SEEK_END);
-    long file_length = ftell(input_file);
-    fseek(input_file,0,SEEK_SET);
-    uint8_t* _file_data = malloc(file_length);
-    uint8_t* file_data = _file_data;
-    assert(_file_data != NULL, "Error: unable to allocate memory");
-    size_t read_data_count = fread(file_data,1,file_length,input_file);
-    assert(read_data_count == file_length, "Error: unable to read complete file");
-    fclose(input_file);
-    uint32_t atom_size = file_data[0]<<24|file_data[1]<<16|file_data[2]<<8|file_data[3];
-    printf("%ld\n",file_length);
-    assert(atom_size<=file_length,"Atom not large enough");
-    assert(memcmp(file_data+4,"icpf",4)==0,"Invalid header");
-    file_data+=8;
-    
+// Writes two consecutive blocks of levels at first and second, at the planes' scale
+static void put_block_pair(uint16_t* first, uint16_t* second, const int16_t* levels, const int16_t* qmat, idct_pair_kernel idct, const planar_image_t* image, int component) {
+    uint32_t stride = image->strides[component];
+    if(image->log2_scale == 0) {
+        idct(first,second,stride,levels,qmat,image->bit_depth);
+        return;
+    }
+    idct_put_reduced(first,stride,levels,qmat,image->bit_depth,8 >> image->log2_scale);
+    idct_put_reduced(second,stride,levels+64,qmat,image->bit_depth,8 >> image->log2_scale);
+}
+
+// Decodes one component of a slice. Luma macroblocks hold four blocks, left to right then top
+// to bottom. Chroma blocks go top to bottom in columns of two, one column for 4:2:2 and two for 4:4:4.
+void decode_slice_component(const uint8_t* data, uint32_t size, const slice_t* slice, const int16_t* qmat, idct_pair_kernel idct, bool interlaced, planar_image_t* image, int component) {
+    uint32_t log2_blocks_per_mb = component == 0 || image->chroma_shift == 0 ? 2 : 1;
+    uint32_t block_count = slice->mb_count << log2_blocks_per_mb;
+    uint32_t log2_block_count = log2_blocks_per_mb;
+    while((1u << log2_block_count) < block_count) log2_block_count++;
+    int16_t blocks[32*64];
+    memset(blocks,0,sizeof(int16_t)*64*block_count);
+    uint32_t block_size = 8 >> image->log2_scale;
+    decode_coefficients(data,size,blocks,log2_block_count,interlaced,block_size == 1);
+
+    uint32_t stride = image->strides[component];
+    uint32_t mb_width = (log2_blocks_per_mb == 2 ? 2 : 1) * block_size;
+    uint16_t* output = image->planes[component];
+    const int16_t* block = blocks;
+    for(uint32_t i = 0; i < slice->mb_count; i++) {
+        if(component == 0) {
+            put_block_pair(output,output+block_size,block,qmat,idct,image,component);
+            put_block_pair(output+block_size*stride,output+block_size*stride+block_size,block+128,qmat,idct,image,component);
+        } else {
+            for(uint32_t x = 0; x < mb_width; x += block_size) {
+                put_block_pair(output+x,output+block_size*stride+x,block+128*(x/block_size),qmat,idct,image,component);
+            }
+        }
+        block += 64 << log2_blocks_per_mb;
+        output += mb_width;
+    }
+}
+
+// Alpha at a reduced scale is decoded in full and each square of samples averaged
+static void decode_slice_alpha(const uint8_t* data, uint32_t size, const slice_t* slice, uint8_t alpha_bits, planar_image_t* image) {
+    uint32_t slice_width = slice->mb_count*16;
+    uint32_t scale = 1 << image->log2_scale;
+    if(scale == 1) {
+        decode_alpha(data,size,image->planes[3],image->strides[3],slice_width,16,alpha_bits,image->bit_depth);
+        return;
+    }
+    uint16_t samples[16*16*8];
+    decode_alpha(data,size,samples,slice_width,slice_width,16,alpha_bits,image->bit_depth);
+    uint32_t round = scale*scale/2;
+    for(uint32_t y = 0; y < 16/scale; y++) {
+        uint16_t* output = image->planes[3] + (size_t)y*image->strides[3];
+        for(uint32_t x = 0; x < slice_width/scale; x++) {
+            uint32_t sum = 0;
+            for(uint32_t i = 0; i < scale; i++) {
+                for(uint32_t j = 0; j < scale; j++) {
+                    sum += samples[(y*scale + i)*slice_width + x*scale + j];
+                }
+            }
+            output[x] = (sum + round) >> (2*image->log2_scale);
+        }
+    }
+}
+
+// Decodes a slice into planes starting at its top left corner, steps holding the luma and chroma
+// quantizer steps for its quantizer. Alpha, when there's a plane for it, takes whatever data is
+// left, a slice without any being opaque.
+void decode_slice(const slice_t* slice, const frame_header* hdr, const int16_t steps[2][64], idct_pair_kernel idct, planar_image_t* image) {
+    const uint8_t* data = slice->data;
+    uint8_t header_size = data[0] >> 3;
+    assert(header_size >= 6 && header_size <= slice->size,"Error: invalid slice header");
+    uint32_t sizes[3];
+    sizes[0] = data[2]<<8|data[3];
+    sizes[1] = data[4]<<8|data[5];
+    assert(header_size + sizes[0] + sizes[1] <= slice->size,"Error: slice data too small");
+    sizes[2] = slice->size - header_size - sizes[0] - sizes[1];
+    if(header_size >= 8) {
+        sizes[2] = data[6]<<8|data[7];
+        assert(header_size + sizes[0] + sizes[1] + sizes[2] <= slice->size,"Error: slice data too small");
+    }
+
+    data += header_size;
+    for(int c = 0; c < 3; c++) {
+        decode_slice_component(data,sizes[c],slice,steps[c == 0 ? 0 : 1],idct,hdr->interlace_mode != 0,image,c);
+        data += sizes[c];
+    }
+    if(image->planes[3] == NULL) return;
+    uint32_t alpha_size = slice->size - header_size - sizes[0] - sizes[1] - sizes[2];
+    if(alpha_size > 0) {
+        decode_slice_alpha(data,alpha_size,slice,hdr->alpha_bits,image);
+        return;
+    }
+    uint32_t width = slice->mb_count*16 >> image->log2_scale;
+    for(uint32_t y = 0; y < 16u >> image->log2_scale; y++) {
+        uint16_t* output = image->planes[3] + (size_t)y*image->strides[3];
+        for(uint32_t x = 0; x < width; x++) {
+            output[x] = (1 << image->bit_depth) - 1;
+        }
+    }
+}
+
+// A picture is split into rows of slices a macroblock high. Slices are 2^n macroblocks wide,
+// narrowing in powers of two to fill out the end of each row. Each field of an interlaced frame
+// is a picture half the frame's height. The picture's slices, which point into its data, are
+// appended to the slice_count already in slices, and the grown array returned. An invalid index
+// frees the array before the error is raised.
+#define check_index(x,y) {if(!(x)){free(slices);assert(false,y);}}
+slice_t* read_slice_index(const uint8_t* data, size_t size, const frame_header* hdr, uint8_t picture, slice_t* slices, uint32_t* slice_count, uint32_t* picture_size) {
+    check_index(size >= 8,"Error: picture header too small");
+    uint8_t header_size = data[0] >> 3;
+    *picture_size = (uint32_t)data[1]<<24|data[2]<<16|data[3]<<8|data[4];
+    uint8_t log2_slice_width = data[7] >> 4;
+    uint8_t log2_slice_height = data[7] & 0xf;
+    check_index(header_size >= 8 && *picture_size >= header_size && *picture_size <= size,"Error: invalid picture header");
+    check_index(log2_slice_width <= 3 && log2_slice_height == 0,"Error: unsupported slice size");
+
+    uint32_t mb_width = (hdr->width + 15) / 16;
+    uint32_t mb_height = hdr->interlace_mode ? (hdr->height + 31) / 32 : (hdr->height + 15) / 16;
+    uint32_t slices_per_row = (mb_width >> log2_slice_width) + __builtin_popcount(mb_width & ((1 << log2_slice_width) - 1));
+    // The slice count in the header is ignored by other decoders, so it's derived instead
+    uint32_t count = slices_per_row * mb_height;
+    const uint8_t* index = data + header_size;
+    const uint8_t* slice_data = index + 2*count;
+    const uint8_t* end = data + *picture_size;
+    check_index(slice_data <= end,"Error: slice index runs past the end of the picture");
+    slice_t* grown = realloc(slices,sizeof(slice_t)*(*slice_count + count));
+    check_index(grown != NULL,"Error: unable to allocate memory");
+    slices = grown;
+
+    uint32_t mb_x = 0, mb_y = 0;
+    uint32_t slice_mb_count = 1 << log2_slice_width;
+    for(uint32_t i = 0; i < count; i++) {
+        while(mb_width - mb_x < slice_mb_count) slice_mb_count >>= 1;
+        slice_t* slice = &slices[*slice_count + i];
+        *slice = (slice_t){
+            .data = slice_data,
+            .size = index[2*i]<<8|index[2*i+1],
+            .mb_x = mb_x,
+            .mb_y = mb_y,
+            .mb_count = slice_mb_count,
+            .picture = picture
+        };
+        check_index(slice->size <= end - slice_data,"Error: slice runs past the end of the picture");
+        check_index(slice->size >= 6,"Error: slice too small");
+        slice->quantizer = slice_data[1] < 1 ? 1 : slice_data[1] > 224 ? 224 : slice_data[1];
+        slice_data += slice->size;
+        mb_x += slice_mb_count;
+        if(mb_x == mb_width) {
+            mb_x = 0;
+            mb_y++;
+            slice_mb_count = 1 << log2_slice_width;
+        }
+    }
+    *slice_count += count;
+    return slices;
+}
+
+// The frame's lines a picture covers, every other one for a field, and the rows of the picture
+// that fall in the planes
+struct picture_target {
+    uint32_t line;
+    uint32_t line_step;
+    uint32_t first_row;
+    uint32_t end_row;
+};
+
+struct picture_decode {
+    const frame_header* hdr;
+    const slice_t* slices;
+    // Luma and chroma quantizer steps for each quantizer a slice uses
+    int16_t (*steps)[2][64];
+    idct_pair_kernel idct;
+    colour_matrix matrix;
+    // Frame planes to decode into, or for RGB output the layout slices' planes take
+    planar_image_t planes;
+    image_t* image;
+    struct picture_target targets[2];
+};
+
+static uint32_t max_u32(uint32_t a, uint32_t b) { return a > b ? a : b; }
+static uint32_t min_u32(uint32_t a, uint32_t b) { return a < b ? a : b; }
+
+// For Y'CbCr output of whole frames slices are decoded straight into their place in the planes.
+// Otherwise each is decoded into planes on the stack, and the part of it in the output converted
+// to RGB or copied across.
+static void decode_slice_job(void* context, uint32_t index) {
+    struct picture_decode* decode = context;
+    const slice_t* slice = &decode->slices[index];
+    const struct picture_target* target = &decode->targets[slice->picture];
+    planar_image_t planes = decode->planes;
+    uint32_t mb_size = 16 >> planes.log2_scale;
+    uint32_t slice_width = slice->mb_count*mb_size;
+    uint32_t x = slice->mb_x*mb_size, y = slice->mb_y*mb_size;
+    int plane_count = planes.strides[3] ? 4 : 3;
+    if(decode->image == NULL && !planes.cropped) {
+        for(int c = 0; c < plane_count; c++) {
+            uint8_t shift = c == 1 || c == 2 ? planes.chroma_shift : 0;
+            planes.planes[c] += (size_t)(target->line + y*target->line_step)*planes.strides[c] + (x >> shift);
+            planes.strides[c] *= target->line_step;
+        }
+        decode_slice(slice,decode->hdr,decode->steps[slice->quantizer],decode->idct,&planes);
+        return;
+    }
+    // Both the slice and the planes start on an even column. The last row of a field's
+    // macroblocks can lie wholly below the frame.
+    uint32_t first_column = max_u32(x,planes.x), end_column = min_u32(x + slice_width,planes.x + planes.width);
+    uint32_t first_row = max_u32(y,target->first_row), end_row = min_u32(y + mb_size,target->end_row);
+    if(first_row >= end_row) return;
+    uint16_t samples[4][16*16*8];
+    planar_image_t slice_planes = planes;
+    for(int c = 0; c < plane_count; c++) {
+        slice_planes.planes[c] = samples[c];
+        slice_planes.strides[c] = slice_width >> (c == 1 || c == 2 ? planes.chroma_shift : 0);
+    }
+    decode_slice(slice,decode->hdr,decode->steps[slice->quantizer],decode->idct,&slice_planes);
+    for(int c = 0; c < plane_count; c++) {
+        uint8_t shift = c == 1 || c == 2 ? planes.chroma_shift : 0;
+        slice_planes.planes[c] += (size_t)(first_row - y)*slice_planes.strides[c] + ((first_column - x) >> shift);
+    }
+    uint32_t output_row = target->line + first_row*target->line_step - planes.y;
+    uint32_t output_column = first_column - planes.x;
+    if(decode->image != NULL) {
+        image_t* image = decode->image;
+        convert_to_rgb(&slice_planes,&decode->matrix,image->data + (size_t)output_row*image->width + output_column,image->width*target->line_step,end_column - first_column,end_row - first_row);
+        return;
+    }
+    for(int c = 0; c < plane_count; c++) {
+        uint8_t shift = c == 1 || c == 2 ? planes.chroma_shift : 0;
+        uint32_t width = (end_column - first_column + shift) >> shift;
+        for(uint32_t row = 0; row < end_row - first_row; row++) {
+            memcpy(planes.planes[c] + (size_t)(output_row + row*target->line_step)*planes.strides[c] + (output_column >> shift),slice_planes.planes[c] + (size_t)row*slice_planes.strides[c],sizeof(uint16_t)*width);
+        }
+    }
+}
+
+// Works out the lines of the frame a picture covers, the first field coded being the top one
+// unless the frame says otherwise
+static struct picture_target picture_target(const frame_header* hdr, const planar_image_t* planes, uint8_t picture) {
+    struct picture_target target = {.line = 0, .line_step = 1};
+    if(hdr->interlace_mode) {
+        target.line = picture ^ (hdr->interlace_mode == 2);
+        target.line_step = 2;
+    }
+    // Rows whose line is at or past the top of the planes, then past their bottom
+    target.first_row = (planes->y + target.line_step - 1 - target.line) / target.line_step;
+    target.end_row = (planes->y + planes->height + target.line_step - 1 - target.line) / target.line_step;
+    return target;
+}
+
+// Whether any of a slice falls in the planes
+static bool slice_in_planes(const slice_t* slice, const struct picture_target* target, const planar_image_t* planes) {
+    uint32_t mb_size = 16 >> planes->log2_scale;
+    uint32_t x = slice->mb_x*mb_size, y = slice->mb_y*mb_size;
+    return x < planes->x + planes->width && x + slice->mb_count*mb_size > planes->x &&
+        y < target->end_row && y + mb_size > target->first_row;
+}
+
+// Decodes a frame's pictures at the scale planes are set up for, into planes themselves or, when
+// image isn't NULL, converted to RGB into image. The two fields of an interlaced frame are decoded
+// together, their slices shared out among the threads as one batch and written straight into
+// alternate lines. For a crop only the slices overlapping it are decoded.
+void decode_pictures(const uint8_t* data, size_t size, const frame_header* hdr, slice_scheduler* scheduler, const planar_image_t* planes, image_t* image) {
+    uint8_t picture_count = hdr->interlace_mode ? 2 : 1;
+    slice_t* slices = NULL;
+    uint32_t slice_count = 0;
+    for(uint8_t p = 0; p < picture_count; p++) {
+        uint32_t picture_size;
+        slices = read_slice_index(data,size,hdr,p,slices,&slice_count,&picture_size);
+        data += picture_size;
+        size -= picture_size;
+    }
+
+    struct picture_decode decode = {
+        .hdr = hdr,
+        .slices = slices,
+        .steps = malloc(sizeof(int16_t[2][64])*225),
+        .idct = select_idct_kernel(),
+        .matrix = init_colour_matrix(hdr->colour_space,hdr->colour_primaries,planes->bit_depth),
+        .planes = *planes,
+        .image = image
+    };
+    assert(decode.steps != NULL,"Error: unable to allocate memory");
+    for(uint8_t p = 0; p < picture_count; p++) {
+        decode.targets[p] = picture_target(hdr,planes,p);
+    }
+    if(planes->cropped) {
+        uint32_t kept = 0;
+        for(uint32_t i = 0; i < slice_count; i++) {
+            if(slice_in_planes(&slices[i],&decode.targets[slices[i].picture],planes)) slices[kept++] = slices[i];
+        }
+        slice_count = kept;
+    }
+    // Steps are worked out once for each quantizer, which a frame has few of. Quantizers above
+    // 128 step in fours.
+    bool scaled[225] = {false};
+    for(uint32_t i = 0; i < slice_count; i++) {
+        uint8_t quantizer = slices[i].quantizer;
+        if(scaled[quantizer]) continue;
+        int32_t qscale = quantizer > 128 ? (quantizer - 96) << 2 : quantizer;
+        scale_qmat(decode.steps[quantizer][0],hdr->qmat_luma,qscale);
+        scale_qmat(decode.steps[quantizer][1],hdr->qmat_chroma,qscale);
+        scaled[quantizer] = true;
+    }
+    bool decoded = run_slice_jobs(scheduler,decode_slice_job,&decode,slice_count);
+    free(decode.steps);
+    free(slices);
+    if(!decoded) raise_prores_error(scheduler->error);
+}
+
+// Checks a frame's icpf atom and reads its header, setting where its picture starts
+frame_header read_frame(const uint8_t* data, uint32_t size, uint32_t* picture_offset) {
+    assert(size >= 8,"Error: unexpected end of file");
+    uint32_t atom_size = (uint32_t)data[0]<<24|data[1]<<16|data[2]<<8|data[3];
+    assert(atom_size<=size && atom_size>=28,"Atom not large enough");
+    assert(memcmp(data+4,"icpf",4)==0,"Invalid header");
+
     uint16_t header_size;
-    frame_header frame_hdr = read_frame_header(file_data, &header_size);
-    file_data += header_size;
+    frame_header hdr = read_frame_header(data+8,atom_size-8,&header_size);
+    assert(hdr.interlace_mode != 3,"Error: unknown interlace mode");
+    *picture_offset = 8 + header_size;
+    return hdr;
+}
 
-    printf("Created by: %.4s\n",frame_hdr.creator);
-    printf("Image dimensions: %dx%d\n",frame_hdr.width,frame_hdr.height);
+void print_frame_header(const frame_header* hdr) {
+    printf("Created by: %.4s\n",hdr->creator);
+    printf("Image dimensions: %dx%d\n",hdr->width,hdr->height);
     printf(
         "Colour primaries: %d | %s\n",
-        frame_hdr.colour_primaries,
-        frame_hdr.colour_primaries<=22?colour_primaries[frame_hdr.colour_primaries]:"Unknown"
+        hdr->colour_primaries,
+        hdr->colour_primaries<=22?colour_primaries[hdr->colour_primaries]:"Unknown"
     );
     printf(
         "Transfer function: %d | %s\n",
-        frame_hdr.transfer_function,
-        frame_hdr.transfer_function<=18?transfer_function[frame_hdr.transfer_function]:"Unknown"
+        hdr->transfer_function,
+        hdr->transfer_function<=18?transfer_function[hdr->transfer_function]:"Unknown"
     );
     printf(
         "Colour space: %d | %s\n",
-        frame_hdr.colour_space,
-        frame_hdr.colour_space<=17?colour_space[frame_hdr.colour_space]:"Unknown"
+        hdr->colour_space,
+        hdr->colour_space<=17?colour_space[hdr->colour_space]:"Unknown"
     );
-    printf("Luma matrix: \n");
-    for(int i = 0; i < 64; i++) {
-        printf("%3d ",frame_hdr.qmat_luma[i]);
-        if((i&7)==7) printf("\n");
-    }
-    printf("Chroma matrix: \n");
-    for(int i = 0; i < 64; i++) {
-        printf("%3d ",frame_hdr.qmat_chroma[i]);
-        if((i&7)==7) printf("\n");
-    }
-    free(_file_data);
-}
\ No newline at end of file
+}
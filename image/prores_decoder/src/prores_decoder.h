@@ -0,0 +1,203 @@
+#ifndef PRORES_DECODER_H
+#define PRORES_DECODER_H
+
+#include <stdlib.h>
+#include <memory.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <setjmp.h>
+
+#include "image_output.h"
+#include "threads.h"
+
+#define err(x) {raise_prores_error((prores_error){"Error",x,__LINE__});}
+#define assert(x,y) {if(!(x)){raise_prores_error((prores_error){"Assertion failure",y,__LINE__});}}
+#define todo(x) {raise_prores_error((prores_error){"Not implemented",x,__LINE__});}
+
+// An error raised by err, assert or todo, with the line it was raised on
+typedef struct {
+    const char* kind;
+    const char* message;
+    int line;
+} prores_error;
+
+typedef struct {
+    uint16_t r;
+    uint16_t g;
+    uint16_t b;
+    uint16_t a;
+} pixel_t;
+
+typedef struct {
+    pixel_t* data;
+    uint16_t width;
+    uint16_t height;
+    uint8_t bit_depth;
+} image_t;
+
+typedef struct {
+    uint8_t creator[4];
+    uint16_t width;
+    uint16_t height;
+    bool is_444;
+    // 0 for progressive frames, 1 and 2 for interlaced ones with the top or bottom field first
+    uint8_t interlace_mode;
+    uint8_t colour_primaries;
+    uint8_t transfer_function;
+    uint8_t colour_space;
+    // Bits per alpha value, 8 or 16, or 0 for frames without alpha
+    uint8_t alpha_bits;
+    uint8_t qmat_luma[64];
+    uint8_t qmat_chroma[64];
+} frame_header;
+
+// Y'CbCr planes, chroma halved horizontally for 4:2:2, then alpha at luma's size. Frames
+// without alpha have a stride of 0 for it.
+typedef struct {
+    uint16_t* planes[4];
+    uint32_t strides[4];
+    uint32_t width;
+    uint32_t height;
+    uint8_t chroma_shift;
+    uint8_t bit_depth;
+    // Blocks are decoded at 1/2^log2_scale of their full size, 8 by 8 down to 1 by 1
+    uint8_t log2_scale;
+    // Cropped planes hold just the region from x, y in the scaled frame, with no padding
+    bool cropped;
+    uint32_t x;
+    uint32_t y;
+} planar_image_t;
+
+// A rectangle of a frame in pixels
+typedef struct {
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
+    uint32_t height;
+} rect_t;
+
+// Fixed point factors taking limited range Y'CbCr to full range RGB at the same bit depth
+typedef struct {
+    int32_t luma;
+    int32_t cr_r;
+    int32_t cb_g;
+    int32_t cr_g;
+    int32_t cb_b;
+    int32_t luma_offset;
+    int32_t chroma_offset;
+    int32_t max;
+} colour_matrix;
+
+typedef struct {
+    const uint8_t* data;
+    uint32_t size;
+    uint32_t mb_x;
+    uint32_t mb_y;
+    uint32_t mb_count;
+    uint8_t quantizer;
+    // Which picture of the frame the slice is in, interlaced frames coding each field as one
+    uint8_t picture;
+} slice_t;
+
+// Slices of a frame are split into contiguous runs, one per thread. A thread that runs out takes
+// half of what is left of the fullest run, so uneven slices still keep every thread busy.
+typedef struct {
+    pthread_t* threads;
+    int thread_count;
+    // Each thread's run of jobs, the first job in the low half and the end in the high half
+    _Atomic uint64_t* runs;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    void (*job)(void* context, uint32_t index);
+    void* context;
+    // The first error a job raised in the current run
+    bool failed;
+    prores_error error;
+    uint32_t generation;
+    int started;
+    int running;
+    bool shutdown;
+} slice_scheduler;
+
+// Where each frame's icpf atom sits in the input file
+typedef struct {
+    uint64_t* offsets;
+    uint32_t* sizes;
+    uint32_t count;
+    // Number of the first frame, when the index covers only part of a file
+    uint32_t first;
+    // Whether the frames come from a QuickTime or MP4 file rather than being a lone raw frame
+    bool from_container;
+} frame_index;
+
+typedef struct {
+    // Output file names start with this
+    const char* name;
+    // Writes the decoded Y'CbCr planes rather than converting them to format
+    bool ycbcr_output;
+    enum image_format format;
+    uint8_t log2_scale;
+    // Only the part of each frame in crop is decoded, when cropped
+    bool cropped;
+    rect_t crop;
+    // Prints the first frame's header
+    bool verbose;
+} output_options;
+
+// Dequantized coefficients and the IDCT's first pass outputs are clamped to this, which real
+// blocks stay within, so the 16 bit values multiplied into 32 bit sums can't overflow
+#define COEFFICIENT_LIMIT 17408
+
+// Dequantizes two consecutive blocks of levels and writes their inverse DCTs at first and second
+typedef void (*idct_pair_kernel)(uint16_t* first, uint16_t* second, uint32_t stride, const int16_t* levels, const int16_t* qmat, uint8_t bit_depth);
+
+// prores_decoder.c
+image_t malloc_new_image(uint16_t width, uint16_t height, uint8_t bit_depth);
+void write_image(image_t image_data, const char* output_file_name, enum image_format format, bool alpha);
+planar_image_t frame_planes(const frame_header* hdr, const output_options* options);
+void malloc_planes(planar_image_t* image);
+void write_planar_image(const planar_image_t* image, const char* output_file_name);
+frame_header read_frame(const uint8_t* data, uint32_t size, uint32_t* picture_offset);
+void print_frame_header(const frame_header* hdr);
+void decode_pictures(const uint8_t* data, size_t size, const frame_header* hdr, slice_scheduler* scheduler, const planar_image_t* planes, image_t* image);
+
+// colour.c
+colour_matrix init_colour_matrix(uint8_t colour_space, uint8_t colour_primaries, uint8_t bit_depth);
+void convert_to_rgb(const planar_image_t* planes, const colour_matrix* matrix, pixel_t* output, uint32_t stride, uint32_t width, uint32_t height);
+
+// container.c
+void read_at(int file, uint8_t* data, size_t size, uint64_t offset);
+bool read_frame_index(int file, frame_index* index);
+void free_frame_index(frame_index* index);
+
+// entropy.c
+void decode_coefficients(const uint8_t* data, uint32_t size, int16_t* blocks, uint32_t log2_block_count, bool interlaced, bool dc_only);
+void decode_alpha(const uint8_t* data, uint32_t size, uint16_t* output, uint32_t stride, uint32_t width, uint32_t height, uint8_t alpha_bits, uint8_t bit_depth);
+
+// error.c
+_Noreturn void raise_prores_error(prores_error error);
+void print_prores_error(prores_error error);
+bool catch_prores_errors(void (*body)(void* context), void* context, prores_error* error);
+
+// idct.c
+void scale_qmat(int16_t* output, const uint8_t* qmat, int32_t qscale);
+idct_pair_kernel select_idct_kernel(void);
+void idct_put_pair_c(uint16_t* first, uint16_t* second, uint32_t stride, const int16_t* levels, const int16_t* qmat, uint8_t bit_depth);
+#if defined(__SSE2__)
+void idct_put_pair_sse2(uint16_t* first, uint16_t* second, uint32_t stride, const int16_t* levels, const int16_t* qmat, uint8_t bit_depth);
+void idct_put_pair_avx2(uint16_t* first, uint16_t* second, uint32_t stride, const int16_t* levels, const int16_t* qmat, uint8_t bit_depth);
+#endif
+void idct_put_reduced(uint16_t* output, uint32_t stride, const int16_t* levels, const int16_t* qmat, uint8_t bit_depth, uint32_t size);
+
+// pipeline.c
+void decode_frames(int file, const frame_index* index, const output_options* options, slice_scheduler* scheduler);
+
+// scheduler.c
+void init_slice_scheduler(slice_scheduler* scheduler, int thread_count);
+void free_slice_scheduler(slice_scheduler* scheduler);
+bool run_slice_jobs(slice_scheduler* scheduler, void (*job)(void* context, uint32_t index), void* context, uint32_t count);
+
+#endif
@@ -0,0 +1,149 @@
+#include "prores_decoder.h"
+
+#define RUN(begin,end) ((uint64_t)(end) << 32 | (begin))
+
+// Takes the next job of the thread's own run
+static bool take_job(slice_scheduler* scheduler, int self, uint32_t* index) {
+    uint64_t run = scheduler->runs[self];
+    while((uint32_t)run < (uint32_t)(run >> 32)) {
+        if(atomic_compare_exchange_weak(&scheduler->runs[self],&run,run+1)) {
+            *index = (uint32_t)run;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Moves the back half of the fullest run into the thread's own, which has run out. Runs only
+// ever shrink, so once every run is empty there is nothing left to steal.
+static bool steal_jobs(slice_scheduler* scheduler, int self) {
+    while(true) {
+        int victim = -1;
+        uint64_t victim_run = 0;
+        uint32_t most = 0;
+        for(int i = 0; i < scheduler->thread_count; i++) {
+            uint64_t run = scheduler->runs[i];
+            uint32_t left = (uint32_t)(run >> 32) - (uint32_t)run;
+            if(i != self && left > most) {
+                victim = i;
+                victim_run = run;
+                most = left;
+            }
+        }
+        if(victim < 0) return false;
+        uint32_t begin = victim_run, end = victim_run >> 32;
+        uint32_t split = end - (most+1)/2;
+        if(atomic_compare_exchange_strong(&scheduler->runs[victim],&victim_run,RUN(begin,split))) {
+            scheduler->runs[self] = RUN(split,end);
+            return true;
+        }
+    }
+}
+
+struct thread_work {
+    slice_scheduler* scheduler;
+    int self;
+    void (*job)(void* context, uint32_t index);
+    void* context;
+};
+
+static void take_jobs(void* arg) {
+    struct thread_work* work = arg;
+    uint32_t index;
+    do {
+        while(take_job(work->scheduler,work->self,&index)) {
+            work->job(work->context,index);
+        }
+    } while(steal_jobs(work->scheduler,work->self));
+}
+
+// A job raising an error stops its thread, the others taking what it had left. The first error
+// is kept for run_slice_jobs to report.
+static void work(slice_scheduler* scheduler, int self, void (*job)(void* context, uint32_t index), void* context) {
+    struct thread_work work = {scheduler,self,job,context};
+    prores_error error;
+    if(catch_prores_errors(take_jobs,&work,&error)) return;
+    pthread_mutex_lock(&scheduler->lock);
+    if(!scheduler->failed) {
+        scheduler->failed = true;
+        scheduler->error = error;
+    }
+    pthread_mutex_unlock(&scheduler->lock);
+}
+
+static void* scheduler_thread(void* arg) {
+    slice_scheduler* scheduler = arg;
+    pthread_mutex_lock(&scheduler->lock);
+    // The calling thread of run_slice_jobs is always thread 0
+    int self = ++scheduler->started;
+    uint32_t generation = 0;
+    while(true) {
+        while(!scheduler->shutdown && scheduler->generation == generation) {
+            pthread_cond_wait(&scheduler->changed,&scheduler->lock);
+        }
+        if(scheduler->shutdown) break;
+        generation = scheduler->generation;
+        void (*job)(void*, uint32_t) = scheduler->job;
+        void* context = scheduler->context;
+        pthread_mutex_unlock(&scheduler->lock);
+        work(scheduler,self,job,context);
+        pthread_mutex_lock(&scheduler->lock);
+        if(--scheduler->running == 0) pthread_cond_broadcast(&scheduler->changed);
+    }
+    pthread_mutex_unlock(&scheduler->lock);
+    return NULL;
+}
+
+void init_slice_scheduler(slice_scheduler* scheduler, int thread_count) {
+    memset(scheduler,0,sizeof(*scheduler));
+    pthread_mutex_init(&scheduler->lock,NULL);
+    pthread_cond_init(&scheduler->changed,NULL);
+    scheduler->thread_count = thread_count;
+    scheduler->runs = calloc(thread_count,sizeof(uint64_t));
+    scheduler->threads = malloc(sizeof(pthread_t)*thread_count);
+    assert(scheduler->runs != NULL && scheduler->threads != NULL,"Error: unable to allocate memory");
+    for(int i = 1; i < thread_count; i++) {
+        assert(pthread_create(&scheduler->threads[i],NULL,scheduler_thread,scheduler)==0,"Error: unable to start thread");
+    }
+}
+
+void free_slice_scheduler(slice_scheduler* scheduler) {
+    pthread_mutex_lock(&scheduler->lock);
+    scheduler->shutdown = true;
+    pthread_cond_broadcast(&scheduler->changed);
+    pthread_mutex_unlock(&scheduler->lock);
+    for(int i = 1; i < scheduler->thread_count; i++) {
+        pthread_join(scheduler->threads[i],NULL);
+    }
+    free(scheduler->threads);
+    free((void*)scheduler->runs);
+    pthread_mutex_destroy(&scheduler->lock);
+    pthread_cond_destroy(&scheduler->changed);
+}
+
+// Runs job(context, i) for every i below count across all the threads, the calling one
+// included, and returns once they are all done. Returns false if a job raised an error, which is
+// left in the scheduler's error.
+bool run_slice_jobs(slice_scheduler* scheduler, void (*job)(void* context, uint32_t index), void* context, uint32_t count) {
+    pthread_mutex_lock(&scheduler->lock);
+    for(int i = 0; i < scheduler->thread_count; i++) {
+        scheduler->runs[i] = RUN((uint64_t)count*i/scheduler->thread_count,(uint64_t)count*(i+1)/scheduler->thread_count);
+    }
+    scheduler->job = job;
+    scheduler->context = context;
+    scheduler->generation++;
+    scheduler->running = scheduler->thread_count;
+    scheduler->failed = false;
+    pthread_cond_broadcast(&scheduler->changed);
+    pthread_mutex_unlock(&scheduler->lock);
+
+    work(scheduler,0,job,context);
+    pthread_mutex_lock(&scheduler->lock);
+    scheduler->running--;
+    while(scheduler->running > 0) {
+        pthread_cond_wait(&scheduler->changed,&scheduler->lock);
+    }
+    bool failed = scheduler->failed;
+    pthread_mutex_unlock(&scheduler->lock);
+    return !failed;
+}
@@ -0,0 +1,100 @@
+#include "prores_decoder.h"
+
+#include <math.h>
+
+// Checks the SIMD IDCT kernels give exactly what the C reference does, at both bit depths, on
+// random blocks and on blocks pushed to the coefficient limit
+
+#define RANDOM_BLOCKS 2048
+
+static bool same_output(idct_pair_kernel kernel, const int16_t* levels, const int16_t* qmat, uint8_t bit_depth) {
+    uint16_t expected[16*8], actual[16*8];
+    idct_put_pair_c(expected,expected+8,16,levels,qmat,bit_depth);
+    kernel(actual,actual+8,16,levels,qmat,bit_depth);
+    return memcmp(expected,actual,sizeof(expected)) == 0;
+}
+
+// Dense and sparse blocks, with levels and steps out to their extremes
+static bool matches_on_random_blocks(idct_pair_kernel kernel) {
+    uint32_t seed = 1;
+    for(int test = 0; test < RANDOM_BLOCKS; test++) {
+        int16_t levels[128], qmat[64];
+        uint8_t factors[64];
+        for(int i = 0; i < 64; i++) {
+            seed = seed*1103515245 + 12345;
+            factors[i] = test & 1 ? (seed >> 16) : 2 + ((seed >> 16) & 7);
+        }
+        scale_qmat(qmat,factors,test & 2 ? 1 + test % 512 : 1 + test % 8);
+        for(int i = 0; i < 128; i++) {
+            seed = seed*1103515245 + 12345;
+            uint32_t random = seed >> 8;
+            levels[i] = test & 4 ? (int16_t)random : (random & 3) == 0 ? (int16_t)(random >> 4) % (1 << (test % 12)) : 0;
+        }
+        if(!same_output(kernel,levels,qmat,test & 8 ? 12 : 10)) {
+            printf("Random block %d differs\n",test);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Coefficients at and just past the limit, alone and filling the block with the signs that add
+// up at one output sample, which drives the first pass's outputs into their clamp too
+static bool matches_at_limit(idct_pair_kernel kernel) {
+    static const int16_t magnitudes[5] = {COEFFICIENT_LIMIT-1,COEFFICIENT_LIMIT,COEFFICIENT_LIMIT+1,INT16_MAX,INT16_MIN};
+    int16_t unit_steps[64], largest_steps[64];
+    uint8_t largest_factors[64];
+    memset(largest_factors,255,64);
+    scale_qmat(largest_steps,largest_factors,224);
+    for(int i = 0; i < 64; i++) unit_steps[i] = 1;
+    for(int m = 0; m < 5; m++) {
+        for(int bit_depth = 10; bit_depth <= 12; bit_depth += 2) {
+            for(int steps = 0; steps < 2; steps++) {
+                const int16_t* qmat = steps ? largest_steps : unit_steps;
+                for(int i = 0; i < 64; i++) {
+                    int16_t levels[128] = {0};
+                    levels[i] = magnitudes[m];
+                    levels[64+i] = -magnitudes[m];
+                    if(!same_output(kernel,levels,qmat,bit_depth)) {
+                        printf("Lone coefficient %d of %d differs\n",i,magnitudes[m]);
+                        return false;
+                    }
+                }
+                for(int sample = 0; sample < 64; sample++) {
+                    int16_t levels[128];
+                    for(int i = 0; i < 64; i++) {
+                        double basis = cos((2*(sample % 8) + 1)*(i % 8)*M_PI/16) * cos((2*(sample / 8) + 1)*(i / 8)*M_PI/16);
+                        levels[i] = basis < 0 ? -magnitudes[m] : magnitudes[m];
+                        levels[64+i] = -levels[i];
+                    }
+                    if(!same_output(kernel,levels,qmat,bit_depth)) {
+                        printf("Block peaking at sample %d with %d differs\n",sample,magnitudes[m]);
+                        return false;
+                    }
+                }
+            }
+        }
+    }
+    return true;
+}
+
+static bool check_kernel(const char* name, idct_pair_kernel kernel) {
+    bool matches = matches_on_random_blocks(kernel) && matches_at_limit(kernel);
+    printf("%s: %s\n",name,matches ? "matches the reference" : "differs from the reference");
+    return matches;
+}
+
+int main(void) {
+    bool passed = true;
+#if defined(__SSE2__)
+    passed &= check_kernel("SSE2",idct_put_pair_sse2);
+    if(__builtin_cpu_supports("avx2")) {
+        passed &= check_kernel("AVX2",idct_put_pair_avx2);
+    } else {
+        printf("AVX2: not supported by this CPU, skipped\n");
+    }
+#else
+    printf("No SIMD kernels in this build\n");
+#endif
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,261 @@
+#include "webp_decoder.h"
+
+static uint32_t read_le24(const uint8_t* data) {
+    return data[0] | data[1]<<8 | data[2]<<16;
+}
+static uint32_t read_le32(const uint8_t* data) {
+    return read_le24(data) | (uint32_t)data[3]<<24;
+}
+
+// Finds the image data among the chunks of a frame, skipping anything unknown. Lossy image
+// data may have an ALPH chunk ahead of it.
+static void read_frame_data(struct webp_frame* frame, const uint8_t* data, size_t size) {
+    frame->data = NULL;
+    frame->alpha = NULL;
+    frame->lossy = false;
+    for(size_t offset = 0; offset + 8 <= size;) {
+        uint32_t chunk_size = read_le32(data+offset+4);
+        assert(chunk_size <= size - offset - 8,"Error: chunk runs past the end of the file");
+        if(memcmp(data+offset,"VP8L",4) == 0) {
+            assert(chunk_size >= 5,"Error: invalid VP8L chunk");
+            frame->data = data+offset+8;
+            frame->size = chunk_size;
+            // The alpha hint sits after the signature byte and the two 14 bit dimensions
+            frame->has_alpha = (read_le32(frame->data+1) >> 28) & 1;
+            return;
+        }
+        if(memcmp(data+offset,"ALPH",4) == 0) {
+            frame->alpha = data+offset+8;
+            frame->alpha_size = chunk_size;
+        }
+        if(memcmp(data+offset,"VP8 ",4) == 0) {
+            frame->data = data+offset+8;
+            frame->size = chunk_size;
+            frame->lossy = true;
+            frame->has_alpha = frame->alpha != NULL;
+            return;
+        }
+        offset += 8 + chunk_size + (chunk_size&1);
+    }
+    err("Error: frame has no image data");
+}
+
+void read_webp_container(struct webp_animation* animation, const uint8_t* data, size_t size) {
+    assert(size >= 30 && memcmp(data,"RIFF",4) == 0 && memcmp(data+8,"WEBP",4) == 0,"Error: invalid WebP header");
+    assert(memcmp(data+12,"VP8X",4) == 0,"Error: not an extended WebP");
+    assert(read_le32(data+4) + 8 <= size,"Error: unexpected end of file");
+    size = read_le32(data+4) + 8;
+    uint8_t flags = data[20];
+    animation->canvas_width = read_le24(data+24) + 1;
+    animation->canvas_height = read_le24(data+27) + 1;
+    animation->has_alpha = flags & 0x10;
+    animation->background = 0;
+    animation->loop_count = 0;
+    animation->frame_count = 0;
+    animation->frames = NULL;
+    uint32_t frame_capacity = 0;
+    bool animated = flags & 0x02;
+    const uint8_t* alpha_chunk = NULL;
+
+    for(size_t offset = 12 + 8 + read_le32(data+16); offset + 8 <= size;) {
+        const uint8_t* chunk = data + offset;
+        uint32_t chunk_size = read_le32(chunk+4);
+        assert(chunk_size <= size - offset - 8,"Error: chunk runs past the end of the file");
+        bool still_image = !animated && (memcmp(chunk,"VP8L",4) == 0 || memcmp(chunk,"VP8 ",4) == 0);
+        if(memcmp(chunk,"ANIM",4) == 0) {
+            assert(chunk_size >= 6,"Error: invalid ANIM chunk");
+            animation->background = read_le32(chunk+8);
+            animation->loop_count = chunk[12] | chunk[13]<<8;
+        } else if(!animated && memcmp(chunk,"ALPH",4) == 0) {
+            alpha_chunk = chunk;
+        } else if((animated && memcmp(chunk,"ANMF",4) == 0) || still_image) {
+            if(animation->frame_count == frame_capacity) {
+                frame_capacity = frame_capacity ? frame_capacity*2 : 16;
+                animation->frames = realloc(animation->frames,sizeof(struct webp_frame)*frame_capacity);
+                check_alloc(animation->frames);
+            }
+            struct webp_frame* frame = &animation->frames[animation->frame_count++];
+            if(still_image) {
+                // A still image in an extended file is a single frame covering the canvas
+                *frame = (struct webp_frame){
+                    .width = animation->canvas_width,
+                    .height = animation->canvas_height
+                };
+                const uint8_t* start = alpha_chunk != NULL ? alpha_chunk : chunk;
+                read_frame_data(frame,start,chunk+8+chunk_size-start);
+            } else {
+                assert(chunk_size >= 16,"Error: invalid ANMF chunk");
+                const uint8_t* header = chunk+8;
+                frame->x = read_le24(header)*2;
+                frame->y = read_le24(header+3)*2;
+                frame->width = read_le24(header+6) + 1;
+                frame->height = read_le24(header+9) + 1;
+                frame->duration = read_le24(header+12);
+                frame->blend = !(header[15] & 0x02);
+                frame->dispose = header[15] & 0x01;
+                read_frame_data(frame,header+16,chunk_size-16);
+            }
+            assert(frame->x + frame->width <= animation->canvas_width && frame->y + frame->height <= animation->canvas_height,"Error: frame lies outside the canvas");
+        }
+        offset += 8 + chunk_size + (chunk_size&1);
+    }
+    assert(animation->frame_count > 0,"Error: no frames found");
+    log_info("Canvas %d x %d, %d frame%s, loop count %d\n",animation->canvas_width,animation->canvas_height,animation->frame_count,animation->frame_count==1?"":"s",animation->loop_count);
+}
+
+void free_webp_animation(struct webp_animation* animation) {
+    free(animation->frames);
+}
+
+// Non-premultiplied alpha blending of src over dst, in the same integer steps libwebp takes
+static pixel_t blend_pixel(pixel_t src, pixel_t dst) {
+    uint32_t src_a = src >> 24;
+    if(src_a == 0) return dst;
+    uint32_t dst_a = ((dst >> 24) * (256 - src_a)) >> 8;
+    uint32_t blend_a = src_a + dst_a;
+    uint32_t scale = (1u << 24) / blend_a;
+    pixel_t output = blend_a << 24;
+    for(int shift = 0; shift < 24; shift += 8) {
+        uint32_t channel = ((src >> shift) & 0xff) * src_a + ((dst >> shift) & 0xff) * dst_a;
+        output |= ((channel * scale) >> 24) << shift;
+    }
+    return output;
+}
+
+static bool is_full_frame(const struct webp_animation* animation, const struct webp_frame* frame) {
+    return frame->width == animation->canvas_width && frame->height == animation->canvas_height;
+}
+
+// A frame's decoded pixels, or the error decoding it raised on its worker thread
+struct decoded_frame {
+    pixel_t* pixels;
+    enum webp_error error;
+    int line;
+    const char* message;
+};
+
+struct animation_decode {
+    const struct webp_animation* animation;
+    struct decoded_frame* frames;
+};
+
+// Decodes a frame's image into output, rows being stride pixels apart. Both decoders are reset
+// and reused, the second only being needed for lossy frames with compressed alpha.
+void decode_webp_frame(const struct webp_frame* frame, pixel_t* output, uint32_t stride, struct webp_decoder* decoder, struct webp_decoder* alpha_decoder) {
+    if(frame->lossy) {
+        uint16_t width, height;
+        read_vp8_frame_size(frame->data,frame->size,&width,&height);
+        assert(width == frame->width && height == frame->height,"Error: frame size does not match its image");
+        // Only the arena is wanted, for the VP8 decoder's working memory
+        reset_webp_decoder(decoder,0,NULL,NULL);
+        decode_vp8(frame->data,frame->size,output,stride,NULL,NULL,&decoder->arena);
+        if(frame->alpha != NULL) apply_alpha_chunk(frame->alpha,frame->alpha_size,output,stride,frame->width,frame->height,&decoder->arena,alpha_decoder);
+        return;
+    }
+    reset_webp_decoder(decoder,frame->size,NULL,NULL);
+    decoder->output = output;
+    decoder->output_stride = stride;
+    assert(webp_decoder_append(decoder,frame->data,frame->size)==WEBP_STATUS_DONE,"Error: unexpected end of frame");
+    assert(decoder->width == frame->width && decoder->height == frame->height,"Error: frame size does not match its image");
+}
+
+struct frame_job {
+    const struct webp_frame* frame;
+    pixel_t* pixels;
+    struct webp_decoder decoder;
+    struct webp_decoder alpha_decoder;
+};
+
+static void decode_frame_pixels(void* context) {
+    struct frame_job* job = context;
+    job->pixels = malloc(sizeof(pixel_t)*job->frame->width*job->frame->height);
+    check_alloc(job->pixels);
+    decode_webp_frame(job->frame,job->pixels,job->frame->width,&job->decoder,&job->alpha_decoder);
+}
+
+// An error is kept with the frame, and raised again on the compositing thread once it gets there
+static void decode_frame(void* context, uint32_t index) {
+    struct animation_decode* decode = context;
+    struct decoded_frame* result = &decode->frames[index];
+    struct frame_job job = {.frame = &decode->animation->frames[index]};
+    init_webp_decoder(&job.decoder,NULL,NULL);
+    init_webp_decoder(&job.alpha_decoder,NULL,NULL);
+    result->error = webp_catch(decode_frame_pixels,&job,&result->line,&result->message);
+    free_webp_decoder(&job.decoder);
+    free_webp_decoder(&job.alpha_decoder);
+    if(result->error != WEBP_OK) {
+        free(job.pixels);
+        job.pixels = NULL;
+    }
+    result->pixels = job.pixels;
+}
+
+// Frames are independent bitstreams, so they are decoded on the pool while this thread
+// composites them onto the canvas in order and hands out each result
+void decode_webp_animation(const struct webp_animation* animation, int thread_count, webp_frame_callback callback, void* user) {
+    struct animation_decode decode = {
+        .animation = animation,
+        .frames = calloc(animation->frame_count,sizeof(struct decoded_frame))
+    };
+    check_alloc(decode.frames);
+    uint32_t canvas_width = animation->canvas_width;
+    pixel_t* canvas = calloc((size_t)canvas_width*animation->canvas_height,sizeof(pixel_t));
+    check_alloc(canvas);
+
+    struct thread_pool pool;
+    bool previous_key_frame = false;
+    init_thread_pool(&pool,thread_count);
+    thread_pool_start(&pool,decode_frame,&decode,animation->frame_count,2*thread_count);
+    for(uint32_t i = 0; i < animation->frame_count; i++) {
+        const struct webp_frame* frame = &animation->frames[i];
+        const struct webp_frame* previous = i > 0 ? &animation->frames[i-1] : NULL;
+        if(previous != NULL && previous->dispose) {
+            // Disposal clears to transparent like libwebp does, the ANIM background being only a hint
+            for(uint32_t y = 0; y < previous->height; y++) {
+                memset(canvas+(size_t)(previous->y+y)*canvas_width+previous->x,0,sizeof(pixel_t)*previous->width);
+            }
+        }
+        thread_pool_wait(&pool,i);
+        struct decoded_frame decoded = decode.frames[i];
+        if(decoded.error != WEBP_OK) {
+            free_thread_pool(&pool);
+            for(uint32_t j = i; j < animation->frame_count; j++) {
+                free(decode.frames[j].pixels);
+            }
+            free(canvas);
+            free(decode.frames);
+            webp_raise(decoded.error,decoded.line,decoded.message);
+        }
+        const pixel_t* pixels = decoded.pixels;
+        // Keyframes are drawn onto a cleared canvas without blending, as libwebp does. Its integer
+        // blend is not exact over transparent black, so this matters for matching it.
+        bool key_frame = previous == NULL || ((!frame->has_alpha || !frame->blend) && is_full_frame(animation,frame)) ||
+            (previous->dispose && (is_full_frame(animation,previous) || previous_key_frame));
+        if(key_frame) memset(canvas,0,sizeof(pixel_t)*canvas_width*animation->canvas_height);
+        for(uint32_t y = 0; y < frame->height; y++) {
+            pixel_t* canvas_row = canvas + (size_t)(frame->y+y)*canvas_width + frame->x;
+            const pixel_t* frame_row = pixels + (size_t)y*frame->width;
+            if(key_frame || !frame->blend) {
+                memcpy(canvas_row,frame_row,sizeof(pixel_t)*frame->width);
+                continue;
+            }
+            // Nor is anything blended over the rectangle the previous frame was just cleared from
+            int32_t skip_start = 0, skip_end = 0;
+            if(previous->dispose && frame->y+y >= previous->y && frame->y+y < previous->y+previous->height) {
+                skip_start = (int32_t)previous->x - (int32_t)frame->x;
+                skip_end = skip_start + previous->width;
+            }
+            for(int32_t x = 0; x < frame->width; x++) {
+                // Opaque pixels, by far the most common, replace the canvas outright
+                bool replace = (frame_row[x] >> 24) == 0xff || (x >= skip_start && x < skip_end);
+                canvas_row[x] = replace ? frame_row[x] : blend_pixel(frame_row[x],canvas_row[x]);
+            }
+        }
+        previous_key_frame = key_frame;
+        free(decoded.pixels);
+        callback(user,canvas,i);
+    }
+    free_thread_pool(&pool);
+    free(canvas);
+    free(decode.frames);
+}
@@ -0,0 +1,61 @@
+#include "webp_decoder.h"
+
+#define ARENA_BLOCK_SIZE (64*1024)
+
+struct arena_block {
+    struct arena_block* next;
+    size_t size;
+    size_t used;
+    _Alignas(32) uint8_t data[];
+};
+
+void init_arena(struct arena* arena) {
+    arena->first = NULL;
+    arena->current = NULL;
+}
+
+void* arena_alloc(struct arena* arena, size_t size) {
+    // Keep every allocation aligned for SIMD loads
+    size = (size + 31) & ~(size_t)31;
+    struct arena_block* block = arena->current;
+    while(block != NULL && block->used + size > block->size) {
+        block = block->next;
+    }
+    if(block == NULL) {
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = aligned_alloc(32,(sizeof(struct arena_block) + block_size + 31) & ~(size_t)31);
+        check_alloc(block);
+        block->size = block_size;
+        block->used = 0;
+        // New blocks go after current so blocks kept from before a reset are still tried first
+        if(arena->current == NULL) {
+            block->next = arena->first;
+            arena->first = block;
+        } else {
+            block->next = arena->current->next;
+            arena->current->next = block;
+        }
+    }
+    arena->current = block;
+    void* output = block->data + block->used;
+    block->used += size;
+    return output;
+}
+
+// Drops everything allocated so far but keeps the blocks for the next round of allocations
+void arena_reset(struct arena* arena) {
+    for(struct arena_block* block = arena->first; block != NULL; block = block->next) {
+        block->used = 0;
+    }
+    arena->current = arena->first;
+}
+
+void free_arena(struct arena* arena) {
+    struct arena_block* block = arena->first;
+    while(block != NULL) {
+        struct arena_block* next = block->next;
+        free(block);
+        block = next;
+    }
+    init_arena(arena);
+}
@@ -0,0 +1,170 @@
+#include "webp_decoder.h"
+
+struct webp_error_handler {
+    jmp_buf jump;
+    enum webp_error error;
+    int line;
+    const char* message;
+};
+static _Thread_local struct webp_error_handler* error_handler = NULL;
+
+_Noreturn void webp_raise(enum webp_error error, int line, const char* message) {
+    if(error_handler != NULL) {
+        error_handler->error = error;
+        error_handler->line = line;
+        error_handler->message = message;
+        longjmp(error_handler->jump,1);
+    }
+    printf(error == WEBP_ERROR_UNSUPPORTED ? "Not implemented at line %d: %s\n" : "Error at line %d: %s\n",line,message);
+    exit(1);
+}
+
+// Runs body(context) with errors caught, for work a call hands to other threads. Returns the
+// error, if any, with where it was raised.
+enum webp_error webp_catch(void (*body)(void* context), void* context, int* line, const char** message) {
+    struct webp_error_handler handler;
+    struct webp_error_handler* previous = error_handler;
+    error_handler = &handler;
+    if(setjmp(handler.jump)) {
+        error_handler = previous;
+        *line = handler.line;
+        *message = handler.message;
+        return handler.error;
+    }
+    body(context);
+    error_handler = previous;
+    return WEBP_OK;
+}
+
+void init_webp_context(struct webp_context* context) {
+    init_webp_decoder(&context->decoder,NULL,NULL);
+    init_webp_decoder(&context->alpha_decoder,NULL,NULL);
+    context->container.frames = NULL;
+    context->error_line = 0;
+    context->error_message = NULL;
+}
+
+void free_webp_context(struct webp_context* context) {
+    free_webp_decoder(&context->decoder);
+    free_webp_decoder(&context->alpha_decoder);
+    free_webp_animation(&context->container);
+}
+
+struct decode_call {
+    const uint8_t* data;
+    size_t size;
+    pixel_t* output;
+    uint32_t output_stride;
+    uint32_t output_height;
+    uint32_t width;
+    uint32_t height;
+    bool has_alpha;
+    int thread_count;
+    webp_frame_callback callback;
+    void* user;
+};
+
+static void read_info(struct webp_context* context, struct decode_call* call) {
+    const uint8_t* data = call->data;
+    if(call->size < 30) webp_raise(WEBP_ERROR_TRUNCATED,__LINE__,"Error: unexpected end of file");
+    assert(memcmp(data,"RIFF",4) == 0 && memcmp(data+8,"WEBP",4) == 0,"Error: invalid WebP header");
+    if(memcmp(data+12,"VP8X",4) == 0) {
+        call->width = (data[24] | data[25]<<8 | data[26]<<16) + 1;
+        call->height = (data[27] | data[28]<<8 | data[29]<<16) + 1;
+        call->has_alpha = data[20] & 0x10;
+    } else if(memcmp(data+12,"VP8 ",4) == 0) {
+        uint16_t width, height;
+        read_vp8_frame_size(data+20,call->size-20,&width,&height);
+        call->width = width;
+        call->height = height;
+    } else if(memcmp(data+12,"VP8L",4) == 0) {
+        assert(data[20] == 0x2f,"Error: invalid WebP header");
+        uint32_t header = data[21] | data[22]<<8 | data[23]<<16 | (uint32_t)data[24]<<24;
+        call->width = (header & 0x3fff) + 1;
+        call->height = ((header >> 14) & 0x3fff) + 1;
+        call->has_alpha = (header >> 28) & 1;
+    } else {
+        err("Error: unknown WebP image chunk");
+    }
+}
+
+static void decode_into(struct webp_context* context, struct decode_call* call) {
+    read_info(context,call);
+    if(call->width > call->output_stride || call->height > call->output_height) {
+        webp_raise(WEBP_ERROR_BUFFER_TOO_SMALL,__LINE__,"Error: output buffer too small for the image");
+    }
+    if(memcmp(call->data+12,"VP8X",4) == 0) {
+        if(call->data[20] & 0x02) todo("Animations are only decoded through webp_decode_animation");
+        read_webp_container(&context->container,call->data,call->size);
+        decode_webp_frame(&context->container.frames[0],call->output,call->output_stride,&context->decoder,&context->alpha_decoder);
+        free_webp_animation(&context->container);
+        context->container.frames = NULL;
+        return;
+    }
+    reset_webp_decoder(&context->decoder,0,NULL,NULL);
+    context->decoder.output = call->output;
+    context->decoder.output_stride = call->output_stride;
+    if(webp_decoder_append(&context->decoder,call->data,call->size) != WEBP_STATUS_DONE) {
+        webp_raise(WEBP_ERROR_TRUNCATED,__LINE__,"Error: unexpected end of file");
+    }
+}
+
+static void decode_animation(struct webp_context* context, struct decode_call* call) {
+    read_webp_container(&context->container,call->data,call->size);
+    decode_webp_animation(&context->container,call->thread_count,call->callback,call->user);
+    free_webp_animation(&context->container);
+    context->container.frames = NULL;
+}
+
+// Runs a call with errors caught, leaving whatever it allocated for the next call to reuse or free
+static enum webp_error run_call(struct webp_context* context, void (*function)(struct webp_context*, struct decode_call*), struct decode_call* call) {
+    struct webp_error_handler handler;
+    struct webp_error_handler* previous = error_handler;
+    error_handler = &handler;
+    if(setjmp(handler.jump)) {
+        error_handler = previous;
+        free_webp_animation(&context->container);
+        context->container.frames = NULL;
+        context->error_line = handler.line;
+        context->error_message = handler.message;
+        return handler.error;
+    }
+    function(context,call);
+    error_handler = previous;
+    return WEBP_OK;
+}
+
+enum webp_error webp_get_info(struct webp_context* context, const uint8_t* data, size_t size, uint32_t* width, uint32_t* height, bool* has_alpha) {
+    struct decode_call call = {.data = data, .size = size};
+    enum webp_error error = run_call(context,read_info,&call);
+    *width = call.width;
+    *height = call.height;
+    *has_alpha = call.has_alpha;
+    return error;
+}
+
+enum webp_error webp_decode_argb(struct webp_context* context, const uint8_t* data, size_t size, pixel_t* output, uint32_t output_stride, uint32_t output_height) {
+    struct decode_call call = {
+        .data = data,
+        .size = size,
+        .output = output,
+        .output_stride = output_stride,
+        .output_height = output_height
+    };
+    return run_call(context,decode_into,&call);
+}
+
+bool webp_is_animation(const uint8_t* data, size_t size) {
+    return size >= 30 && memcmp(data+12,"VP8X",4) == 0 && (data[20] & 0x02);
+}
+
+enum webp_error webp_decode_animation(struct webp_context* context, const uint8_t* data, size_t size, int thread_count, webp_frame_callback callback, void* user) {
+    struct decode_call call = {
+        .data = data,
+        .size = size,
+        .thread_count = thread_count,
+        .callback = callback,
+        .user = user
+    };
+    return run_call(context,decode_animation,&call);
+}
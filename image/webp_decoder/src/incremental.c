@@ -0,0 +1,255 @@
+#include "webp_decoder.h"
+
+// Smaller images aren't worth starting threads for
+#define PARALLEL_TRANSFORM_PIXELS (1024*1024)
+
+void init_webp_decoder(struct webp_decoder* decoder, webp_row_callback callback, void* user) {
+    memset(decoder,0,sizeof(*decoder));
+    init_arena(&decoder->arena);
+    decoder->callback = callback;
+    decoder->user = user;
+}
+
+// For the VP8L bitstream of an animation frame, which comes without a RIFF header
+void init_vp8l_decoder(struct webp_decoder* decoder, size_t size, webp_row_callback callback, void* user) {
+    init_webp_decoder(decoder,callback,user);
+    decoder->bitstream_size = size;
+}
+
+// Readies the decoder for another file, or bare VP8L bitstream when bitstream_size is set. Its
+// buffers, arena blocks and threads are kept, so decoding many images allocates little after the first.
+void reset_webp_decoder(struct webp_decoder* decoder, size_t bitstream_size, webp_row_callback callback, void* user) {
+    arena_reset(&decoder->arena);
+    decoder->size = 0;
+    decoder->bitstream_size = bitstream_size;
+    decoder->vp8_size = 0;
+    decoder->headers_done = false;
+    decoder->pixels_started = false;
+    memset(&decoder->pipeline,0,sizeof(decoder->pipeline));
+    memset(&decoder->entropy,0,sizeof(decoder->entropy));
+    decoder->rows_done = 0;
+    decoder->callback = callback;
+    decoder->user = user;
+    decoder->output = NULL;
+    decoder->output_stride = 0;
+}
+
+void free_webp_decoder(struct webp_decoder* decoder) {
+    free(decoder->data);
+    free(decoder->image.data);
+    free(decoder->checkpoint_colour_cache);
+    free(decoder->band);
+    if(decoder->pool_started) free_thread_pool(&decoder->pool);
+    free_arena(&decoder->arena);
+}
+
+// Grows a buffer kept across images to hold at least size bytes
+static void* reserve_buffer(void* buffer, size_t* capacity, size_t size) {
+    if(size <= *capacity) return buffer;
+    free(buffer);
+    buffer = malloc(size);
+    check_alloc(buffer);
+    *capacity = size;
+    return buffer;
+}
+
+// Headers are parsed from the start of the file every time until they have all arrived,
+// anything they allocated being dropped with the arena in between
+static void read_headers(struct webp_decoder* decoder) {
+    struct bitstream* file = &decoder->bitstream;
+    file->current_read = 0;
+    if(decoder->bitstream_size == 0) {
+        uint32_t riff = read_bits(file,32);
+        uint32_t riff_size = read_bits(file,32);
+        uint32_t webp = read_bits(file,32);
+        uint32_t chunk = read_bits(file,32);
+        uint32_t a = read_bits(file,32);
+        check_bitstream(file);
+        assert(riff==(*(uint32_t*)"RIFF"),"Error: invalid RIFF header");
+        assert(webp==(*(uint32_t*)"WEBP"),"Error: invalid WebP header");
+        assert(chunk==(*(uint32_t*)"VP8L") || chunk==(*(uint32_t*)"VP8 "),"Error: not a simple WebP");
+        uint32_t b = riff_size-12-(a&1);
+        assert(a==b,"Error: invalid WebP header");
+        if(chunk==(*(uint32_t*)"VP8 ")) {
+            // Only the frame size is needed up front, the rest being read when the frame is decoded
+            file->current_read += 10*8;
+            check_bitstream(file);
+            read_vp8_frame_size(decoder->data+20,a,&decoder->width,&decoder->height);
+            decoder->vp8_size = a;
+            log_info("Image dimensions: %d x %d lossy\n",decoder->width,decoder->height);
+            return;
+        }
+    }
+    uint8_t signature = read_bits(file,8);
+    decoder->width = read_bits(file,14) + 1;
+    decoder->height = read_bits(file,14) + 1;
+    decoder->use_alpha = read_bits(file,1);
+    uint8_t version = read_bits(file,3);
+    check_bitstream(file);
+    assert(signature==0x2f,"Error: invalid WebP header");
+    assert(version==0,"Error: invalid WebP version");
+    log_info("Image dimensions: %d x %d %s\n",decoder->width,decoder->height,decoder->use_alpha?"with alpha":"");
+
+    struct transform_pipeline* pipeline = &decoder->pipeline;
+    init_transform_pipeline(pipeline,decoder->width,decoder->height,&decoder->arena);
+    while(read_bit(file)) {
+        enum transform_type type = read_bits(file,2);
+        check_bitstream(file);
+        assert(pipeline->count < 4,"Error: too many image transforms");
+        struct transform* transform = &pipeline->transforms[pipeline->count];
+        transform->type = type;
+        transform->width = pipeline->coded_width;
+        transform->block_scale = 0;
+        transform->subimage.data = NULL;
+        transform->palette_lut = NULL;
+        log_info("Transform %s\n",transform_names[transform->type]);
+        switch(transform->type) {
+            case SUBTRACT_GREEN_TRANSFORM:
+                break;
+            case PREDICTOR_TRANSFORM: {
+                transform->block_scale = read_bits(file,3)+2;
+                uint32_t subimage_width = ceil_div(pipeline->coded_width,1<<transform->block_scale);
+                uint32_t subimage_height = ceil_div(decoder->height,1<<transform->block_scale);
+                transform->subimage = arena_new_image(&decoder->arena,subimage_width,subimage_height);
+                log_info("Decoding predictor subimage\n");
+                decode_image(file,&transform->subimage,&decoder->arena);
+            }; break;
+            case COLOUR_TRANSFORM: {
+                transform->block_scale = read_bits(file,3)+2;
+                uint32_t subimage_width = ceil_div(pipeline->coded_width,1<<transform->block_scale);
+                uint32_t subimage_height = ceil_div(decoder->height,1<<transform->block_scale);
+                transform->subimage = arena_new_image(&decoder->arena,subimage_width,subimage_height);
+                log_info("Decoding colour subimage\n");
+                decode_image(file,&transform->subimage,&decoder->arena);
+            }; break;
+            case COLOUR_INDEXING_TRANSFORM: {
+                uint32_t colour_table_size = read_bits(file,8)+1;
+                // Small palettes bundle 2, 4 or 8 indices into the green channel of each coded pixel
+                transform->block_scale = colour_table_size <= 2 ? 3 : colour_table_size <= 4 ? 2 : colour_table_size <= 16 ? 1 : 0;
+                transform->subimage = arena_new_image(&decoder->arena,colour_table_size,1);
+                log_info("Decoding colour table of %d colours\n",colour_table_size);
+                decode_image(file,&transform->subimage,&decoder->arena);
+                init_colour_indexing(transform,&decoder->arena);
+                pipeline->coded_width = ceil_div(pipeline->coded_width,1<<transform->block_scale);
+            }; break;
+        }
+        pipeline->count++;
+    }
+    check_bitstream(file);
+
+    // The main image is entropy decoded at its coded width and expanded to full width band by band
+    decoder->image.width = pipeline->coded_width;
+    decoder->image.height = decoder->height;
+    log_info("Decoding main image\n");
+    read_entropy_header(file,&decoder->entropy,&decoder->image,true,&decoder->arena);
+}
+
+static size_t colour_cache_bytes(const struct entropy_image* entropy) {
+    return entropy->colour_cache_bits ? sizeof(pixel_t)<<entropy->colour_cache_bits : 0;
+}
+
+static void save_checkpoint(struct webp_decoder* decoder) {
+    decoder->checkpoint_bit = decoder->bitstream.current_read;
+    decoder->checkpoint_pixel = decoder->pixel;
+    memcpy(decoder->checkpoint_colour_cache,decoder->entropy.colour_cache,colour_cache_bytes(&decoder->entropy));
+}
+
+static void restore_checkpoint(struct webp_decoder* decoder) {
+    decoder->bitstream.current_read = decoder->checkpoint_bit;
+    decoder->pixel = decoder->checkpoint_pixel;
+    memcpy(decoder->entropy.colour_cache,decoder->checkpoint_colour_cache,colour_cache_bytes(&decoder->entropy));
+}
+
+// Runs the inverse transforms over every entropy decoded row up to y_end and hands them out
+static void finish_rows(struct webp_decoder* decoder, uint32_t y_end) {
+    while(decoder->rows_done < y_end) {
+        uint32_t y = decoder->rows_done;
+        uint32_t row_count = y_end - y < decoder->band_rows ? y_end - y : decoder->band_rows;
+        pixel_t* rows = decoder->band;
+        uint32_t stride = decoder->width;
+        if(decoder->output != NULL) {
+            rows = decoder->output + y*decoder->output_stride;
+            stride = decoder->output_stride;
+        }
+        transform_band(&decoder->pipeline,decoder->image.data+y*decoder->image.width,rows,stride,y,y+row_count);
+        if(decoder->callback != NULL) decoder->callback(decoder->user,rows,stride,y,row_count);
+        decoder->rows_done += row_count;
+    }
+}
+
+enum webp_status webp_decoder_append(struct webp_decoder* decoder, const uint8_t* data, size_t size) {
+    if(decoder->size + size + BITSTREAM_PADDING > decoder->capacity) {
+        decoder->capacity = (decoder->size + size + BITSTREAM_PADDING) * 2;
+        decoder->data = realloc(decoder->data,decoder->capacity);
+        check_alloc(decoder->data);
+    }
+    memcpy(decoder->data+decoder->size,data,size);
+    decoder->size += size;
+    memset(decoder->data+decoder->size,0,BITSTREAM_PADDING);
+    size_t expected_size = decoder->bitstream_size;
+    if(expected_size == 0) {
+        if(decoder->size < 8) return WEBP_STATUS_NEED_MORE_DATA;
+        uint32_t riff_size;
+        memcpy(&riff_size,decoder->data+4,4);
+        expected_size = (size_t)riff_size + 8;
+    }
+
+    // Once everything is here running out of data is an error rather than a reason to wait
+    bool complete = decoder->size >= expected_size;
+    decoder->bitstream.data = decoder->data;
+    decoder->bitstream.bit_length = (uint64_t)decoder->size * 8;
+    decoder->bitstream.underflow = complete ? NULL : &decoder->underflow;
+
+    if(setjmp(decoder->underflow)) {
+        if(!decoder->headers_done) {
+            arena_reset(&decoder->arena);
+            return WEBP_STATUS_NEED_MORE_DATA;
+        }
+        // Give out what was finished before the last row boundary, and carry on from there next time
+        restore_checkpoint(decoder);
+        finish_rows(decoder,decoder->pixel / decoder->image.width);
+        return WEBP_STATUS_NEED_MORE_DATA;
+    }
+
+    if(!decoder->headers_done) {
+        read_headers(decoder);
+        decoder->headers_done = true;
+    }
+    if(decoder->vp8_size != 0) {
+        // VP8 token partitions are not stored in decoding order, so there is no decoding part of one
+        if(!complete) return WEBP_STATUS_NEED_MORE_DATA;
+        decode_vp8(decoder->data+20,decoder->vp8_size,decoder->output,decoder->output_stride,decoder->callback,decoder->user,&decoder->arena);
+        decoder->rows_done = decoder->height;
+        return WEBP_STATUS_DONE;
+    }
+    if(!decoder->pixels_started) {
+        decoder->image.data = reserve_buffer(decoder->image.data,&decoder->image_capacity,sizeof(pixel_t)*decoder->image.width*decoder->image.height);
+        decoder->checkpoint_colour_cache = reserve_buffer(decoder->checkpoint_colour_cache,&decoder->checkpoint_capacity,colour_cache_bytes(&decoder->entropy)+sizeof(pixel_t));
+        decoder->band_rows = transform_band_rows(&decoder->pipeline);
+        if(decoder->thread_count > 1 && (uint32_t)decoder->width*decoder->height >= PARALLEL_TRANSFORM_PIXELS) {
+            // Each thread gets a band's worth of rows, so bands grow with the pool
+            decoder->band_rows *= decoder->thread_count;
+            if(!decoder->pool_started) init_thread_pool(&decoder->pool,decoder->thread_count);
+            decoder->pool_started = true;
+            init_transform_threads(&decoder->pipeline,&decoder->pool,decoder->band_rows,&decoder->arena);
+        }
+        if(decoder->output == NULL) {
+            decoder->band = reserve_buffer(decoder->band,&decoder->band_capacity,sizeof(pixel_t)*decoder->width*decoder->band_rows);
+        }
+        decoder->pixel = 0;
+        save_checkpoint(decoder);
+        decoder->pixels_started = true;
+    }
+
+    uint32_t width = decoder->image.width;
+    uint32_t pixel_count = width * decoder->height;
+    while(decoder->pixel < pixel_count) {
+        uint32_t row_end = (decoder->pixel / width + 1) * width;
+        decoder->pixel = decode_pixels(&decoder->bitstream,&decoder->entropy,&decoder->image,decoder->pixel,row_end);
+        if(!complete) save_checkpoint(decoder);
+        uint32_t rows_decoded = decoder->pixel / width;
+        if(rows_decoded - decoder->rows_done >= decoder->band_rows) finish_rows(decoder,rows_decoded);
+    }
+    finish_rows(decoder,decoder->height);
+    return WEBP_STATUS_DONE;
+}
@@ -0,0 +1,121 @@
+#include "webp_decoder.h"
+
+static void write_scaled_rows(void* user, const pixel_t* rows, uint32_t stride, uint32_t y, uint32_t row_count) {
+    write_argb_rows(user,rows,stride,row_count);
+}
+
+// Rows are written out as the decoder finishes them, so the full image is never held. With a max
+// size set they are shrunk on their way to the file and the full size image is never written.
+struct still_output {
+    const struct webp_decoder* decoder;
+    const char* name;
+    enum image_format format;
+    uint32_t max_size;
+    bool scaled;
+    struct image_scaler scaler;
+    struct image_output writer;
+};
+static void write_decoded_rows(void* user, const pixel_t* rows, uint32_t stride, uint32_t y, uint32_t row_count) {
+    struct still_output* output = user;
+    if(y == 0) {
+        uint32_t width, height;
+        fit_scaled_size(output->decoder->width,output->decoder->height,output->max_size,&width,&height);
+        output->scaled = width != output->decoder->width || height != output->decoder->height;
+        if(output->scaled) init_image_scaler(&output->scaler,output->decoder->width,output->decoder->height,width,height,write_scaled_rows,&output->writer);
+        open_image_output(&output->writer,output->name,output->format,width,height,8,output->decoder->use_alpha);
+    }
+    if(output->scaled) {
+        scale_rows(&output->scaler,rows,stride,row_count);
+    } else {
+        write_argb_rows(&output->writer,rows,stride,row_count);
+    }
+}
+
+struct animation_output {
+    const struct webp_animation* animation;
+    const char* name;
+    enum image_format format;
+    bool scaled;
+    struct image_scaler scaler;
+};
+static void write_animation_frame(void* user, const pixel_t* canvas, uint32_t frame) {
+    struct animation_output* output = user;
+    uint32_t canvas_width = output->animation->canvas_width;
+    uint32_t canvas_height = output->animation->canvas_height;
+    char* frame_name = malloc(strlen(output->name) + 20);
+    sprintf(frame_name,"%s.%d",output->name,frame);
+    struct image_output writer;
+    if(output->scaled) {
+        // The scaler starts over after each frame, so it is only pointed at this frame's file
+        output->scaler.user = &writer;
+        open_image_output(&writer,frame_name,output->format,output->scaler.width,output->scaler.height,8,output->animation->has_alpha);
+        scale_rows(&output->scaler,canvas,canvas_width,canvas_height);
+    } else {
+        open_image_output(&writer,frame_name,output->format,canvas_width,canvas_height,8,output->animation->has_alpha);
+        write_argb_rows(&writer,canvas,canvas_width,canvas_height);
+    }
+    close_image_output(&writer);
+    printf("Frame %s: %d ms%s\n",frame_name,output->animation->frames[frame].duration,writer.has_alpha?" with alpha":"");
+    free(frame_name);
+}
+
+int main(int argc, char* argv[]) {
+    webp_verbose = true;
+    assert(argc >= 2, "No input file!");
+    FILE* input_file = fopen(argv[1],"rb");
+    assert(input_file != NULL, "Error: no such file or directory");
+    fseek(input_file,0,SEEK_END);
+    long file_length = ftell(input_file);
+    fseek(input_file,0,SEEK_SET);
+    uint8_t* file_data = malloc(file_length);
+    check_alloc(file_data);
+    size_t read_data_count = fread(file_data,1,file_length,input_file);
+    assert(read_data_count == file_length, "Error: unable to read complete file");
+    fclose(input_file);
+
+    // Optional thread count, the size thumbnails should fit within and the output format,
+    // where 0 picks the default thread count or leaves the size alone
+    int thread_count = argc >= 3 ? atoi(argv[2]) : 0;
+    if(thread_count == 0) thread_count = default_thread_count();
+    assert(thread_count > 0,"Error: invalid thread count");
+    int size_argument = argc >= 4 ? atoi(argv[3]) : 0;
+    assert(size_argument >= 0,"Error: invalid size");
+    uint32_t max_size = size_argument > 0 ? size_argument : UINT32_MAX;
+    enum image_format format = argc >= 5 ? parse_image_format(argv[4]) : IMAGE_FORMAT_PPM;
+
+    // Extended files, animated or not, go through the frame index and are decoded whole
+    if(file_length >= 16 && memcmp(file_data+12,"VP8X",4) == 0) {
+        struct webp_animation animation;
+        read_webp_container(&animation,file_data,file_length);
+        struct animation_output output = {
+            .animation = &animation,
+            .name = argv[1],
+            .format = format
+        };
+        uint32_t width, height;
+        fit_scaled_size(animation.canvas_width,animation.canvas_height,max_size,&width,&height);
+        output.scaled = width != animation.canvas_width || height != animation.canvas_height;
+        if(output.scaled) init_image_scaler(&output.scaler,animation.canvas_width,animation.canvas_height,width,height,write_scaled_rows,NULL);
+        decode_webp_animation(&animation,thread_count,write_animation_frame,&output);
+        if(output.scaled) free_image_scaler(&output.scaler);
+        free_webp_animation(&animation);
+        free(file_data);
+        return 0;
+    }
+
+    struct webp_decoder decoder;
+    struct still_output output = {
+        .decoder = &decoder,
+        .name = argv[1],
+        .format = format,
+        .max_size = max_size
+    };
+    init_webp_decoder(&decoder,write_decoded_rows,&output);
+    decoder.thread_count = thread_count;
+    assert(webp_decoder_append(&decoder,file_data,file_length)==WEBP_STATUS_DONE,"Error: unexpected end of file");
+    close_image_output(&output.writer);
+    printf("Image %s: %d x %d%s\n",argv[1],decoder.width,decoder.height,output.writer.has_alpha?" with alpha":"");
+    if(output.scaled) free_image_scaler(&output.scaler);
+    free_webp_decoder(&decoder);
+    free(file_data);
+}
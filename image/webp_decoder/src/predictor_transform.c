@@ -0,0 +1,379 @@
+#include "webp_decoder.h"
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// Each row kernel reconstructs `count` pixels of a single predictor block in place.
+// row[-1] is L for the first pixel, and top[-1], top[0], top[1] are TL, T and TR.
+typedef void (*predictor_row_t)(pixel_t* row, const pixel_t* top, int count);
+
+// Per-byte arithmetic on packed ARGB, so channels never need unpacking
+static inline pixel_t add_pixels(pixel_t a, pixel_t b) {
+    pixel_t ag = (a & 0xff00ff00) + (b & 0xff00ff00);
+    pixel_t rb = (a & 0x00ff00ff) + (b & 0x00ff00ff);
+    return (ag & 0xff00ff00) | (rb & 0x00ff00ff);
+}
+static inline pixel_t average2(pixel_t a, pixel_t b) {
+    return (((a ^ b) & 0xfefefefe) >> 1) + (a & b);
+}
+static inline uint32_t clamp_channel(int32_t x) {
+    if(x<0) return 0;
+    if(x>255) return 255;
+    return x;
+}
+static inline int32_t abs_channel_diff(pixel_t a, pixel_t b, int shift) {
+    return abs((int32_t)((a>>shift)&0xff) - (int32_t)((b>>shift)&0xff));
+}
+static inline pixel_t select_pixel(pixel_t L, pixel_t T, pixel_t TL) {
+    int32_t pL = 0, pT = 0;
+    for(int shift = 0; shift < 32; shift += 8) {
+        pL += abs_channel_diff(T,TL,shift);
+        pT += abs_channel_diff(L,TL,shift);
+    }
+    return (pL<pT)?L:T;
+}
+static inline pixel_t clamp_add_subtract_full(pixel_t L, pixel_t T, pixel_t TL) {
+    pixel_t o = 0;
+    for(int shift = 0; shift < 32; shift += 8) {
+        int32_t c = (int32_t)((L>>shift)&0xff) + (int32_t)((T>>shift)&0xff) - (int32_t)((TL>>shift)&0xff);
+        o |= clamp_channel(c) << shift;
+    }
+    return o;
+}
+static inline pixel_t clamp_add_subtract_half(pixel_t avg, pixel_t TL) {
+    pixel_t o = 0;
+    for(int shift = 0; shift < 32; shift += 8) {
+        int32_t a = (avg>>shift)&0xff;
+        o |= clamp_channel(a + (a - (int32_t)((TL>>shift)&0xff)) / 2) << shift;
+    }
+    return o;
+}
+
+static void predict_row0_c(pixel_t* row, const pixel_t* top, int count) {
+    for(int i = 0; i < count; i++) row[i] = add_pixels(row[i],0xff000000);
+}
+static void predict_row1_c(pixel_t* row, const pixel_t* top, int count) {
+    for(int i = 0; i < count; i++) row[i] = add_pixels(row[i],row[i-1]);
+}
+static void predict_row2_c(pixel_t* row, const pixel_t* top, int count) {
+    for(int i = 0; i < count; i++) row[i] = add_pixels(row[i],top[i]);
+}
+static void predict_row3_c(pixel_t* row, const pixel_t* top, int count) {
+    for(int i = 0; i < count; i++) row[i] = add_pixels(row[i],top[i+1]);
+}
+static void predict_row4_c(pixel_t* row, const pixel_t* top, int count) {
+    for(int i = 0; i < count; i++) row[i] = add_pixels(row[i],top[i-1]);
+}
+static void predict_row5_c(pixel_t* row, const pixel_t* top, int count) {
+    for(int i = 0; i < count; i++) row[i] = add_pixels(row[i],average2(average2(row[i-1],top[i+1]),top[i]));
+}
+static void predict_row6_c(pixel_t* row, const pixel_t* top, int count) {
+    for(int i = 0; i < count; i++) row[i] = add_pixels(row[i],average2(row[i-1],top[i-1]));
+}
+static void predict_row7_c(pixel_t* row, const pixel_t* top, int count) {
+    for(int i = 0; i < count; i++) row[i] = add_pixels(row[i],average2(row[i-1],top[i]));
+}
+static void predict_row8_c(pixel_t* row, const pixel_t* top, int count) {
+    for(int i = 0; i < count; i++) row[i] = add_pixels(row[i],average2(top[i-1],top[i]));
+}
+static void predict_row9_c(pixel_t* row, const pixel_t* top, int count) {
+    for(int i = 0; i < count; i++) row[i] = add_pixels(row[i],average2(top[i],top[i+1]));
+}
+static void predict_row10_c(pixel_t* row, const pixel_t* top, int count) {
+    for(int i = 0; i < count; i++) {
+        row[i] = add_pixels(row[i],average2(average2(row[i-1],top[i-1]),average2(top[i],top[i+1])));
+    }
+}
+static void predict_row11_c(pixel_t* row, const pixel_t* top, int count) {
+    for(int i = 0; i < count; i++) row[i] = add_pixels(row[i],select_pixel(row[i-1],top[i],top[i-1]));
+}
+static void predict_row12_c(pixel_t* row, const pixel_t* top, int count) {
+    for(int i = 0; i < count; i++) row[i] = add_pixels(row[i],clamp_add_subtract_full(row[i-1],top[i],top[i-1]));
+}
+static void predict_row13_c(pixel_t* row, const pixel_t* top, int count) {
+    for(int i = 0; i < count; i++) row[i] = add_pixels(row[i],clamp_add_subtract_half(average2(row[i-1],top[i]),top[i-1]));
+}
+
+#if defined(__SSE2__)
+#define load_4(p) _mm_loadu_si128((const __m128i*)(p))
+#define store_4(p,x) _mm_storeu_si128((__m128i*)(p),x)
+
+static inline __m128i average2_sse2(__m128i a, __m128i b) {
+    // _mm_avg_epu8 rounds up, WebP averages round down
+    return _mm_sub_epi8(_mm_avg_epu8(a,b),_mm_and_si128(_mm_xor_si128(a,b),_mm_set1_epi8(1)));
+}
+
+// Predictors that only look at the row above are independent per pixel. Each uses only some of
+// the loads, and the compiler drops the others.
+#define PREDICT_TOP_SSE2(name, PRED, PRED_C) \
+static void name(pixel_t* row, const pixel_t* top, int count) { \
+    int i = 0; \
+    for(; i + 4 <= count; i += 4) { \
+        __m128i T = load_4(top+i), TL = load_4(top+i-1), TR = load_4(top+i+1); \
+        (void)T; (void)TL; (void)TR; \
+        store_4(row+i,_mm_add_epi8(load_4(row+i),PRED)); \
+    } \
+    PRED_C(row+i,top+i,count-i); \
+}
+PREDICT_TOP_SSE2(predict_row2_sse2, T, predict_row2_c)
+PREDICT_TOP_SSE2(predict_row3_sse2, TR, predict_row3_c)
+PREDICT_TOP_SSE2(predict_row4_sse2, TL, predict_row4_c)
+PREDICT_TOP_SSE2(predict_row8_sse2, average2_sse2(TL,T), predict_row8_c)
+PREDICT_TOP_SSE2(predict_row9_sse2, average2_sse2(T,TR), predict_row9_c)
+
+static void predict_row0_sse2(pixel_t* row, const pixel_t* top, int count) {
+    const __m128i black = _mm_set1_epi32(0xff000000);
+    int i = 0;
+    for(; i + 4 <= count; i += 4) store_4(row+i,_mm_add_epi8(load_4(row+i),black));
+    predict_row0_c(row+i,top,count-i);
+}
+static void predict_row1_sse2(pixel_t* row, const pixel_t* top, int count) {
+    // Running per-byte prefix sum, four pixels at a time
+    __m128i L = _mm_set1_epi32(row[-1]);
+    int i = 0;
+    for(; i + 4 <= count; i += 4) {
+        __m128i x = load_4(row+i);
+        x = _mm_add_epi8(x,_mm_slli_si128(x,4));
+        x = _mm_add_epi8(x,_mm_slli_si128(x,8));
+        x = _mm_add_epi8(x,L);
+        store_4(row+i,x);
+        L = _mm_shuffle_epi32(x,0xff);
+    }
+    predict_row1_c(row+i,top,count-i);
+}
+
+// Predictors that depend on L form a serial chain, so each step works on one packed
+// pixel in the low lane. Upper lanes hold the following pixels and are ignored.
+static inline __m128i pred5_sse2(__m128i L, __m128i T, __m128i TL, __m128i TR) {
+    return average2_sse2(average2_sse2(L,TR),T);
+}
+static inline __m128i pred6_sse2(__m128i L, __m128i T, __m128i TL, __m128i TR) {
+    return average2_sse2(L,TL);
+}
+static inline __m128i pred7_sse2(__m128i L, __m128i T, __m128i TL, __m128i TR) {
+    return average2_sse2(L,T);
+}
+static inline __m128i pred10_sse2(__m128i L, __m128i T, __m128i TL, __m128i TR) {
+    return average2_sse2(average2_sse2(L,TL),average2_sse2(T,TR));
+}
+static inline __m128i pred11_sse2(__m128i L, __m128i T, __m128i TL, __m128i TR) {
+    const __m128i low_pixel = _mm_cvtsi32_si128(-1);
+    __m128i tl = _mm_and_si128(TL,low_pixel);
+    int32_t pL = _mm_cvtsi128_si32(_mm_sad_epu8(_mm_and_si128(T,low_pixel),tl));
+    int32_t pT = _mm_cvtsi128_si32(_mm_sad_epu8(_mm_and_si128(L,low_pixel),tl));
+    return (pL<pT)?L:T;
+}
+static inline __m128i pred12_sse2(__m128i L, __m128i T, __m128i TL, __m128i TR) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i sum = _mm_add_epi16(_mm_unpacklo_epi8(L,zero),_mm_unpacklo_epi8(T,zero));
+    return _mm_packus_epi16(_mm_sub_epi16(sum,_mm_unpacklo_epi8(TL,zero)),zero);
+}
+static inline __m128i pred13_sse2(__m128i L, __m128i T, __m128i TL, __m128i TR) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i avg = _mm_unpacklo_epi8(average2_sse2(L,T),zero);
+    __m128i tl = _mm_unpacklo_epi8(TL,zero);
+    // (avg - TL) / 2 rounding towards zero, as in the spec
+    __m128i diff = _mm_sub_epi16(avg,tl);
+    diff = _mm_srai_epi16(_mm_sub_epi16(diff,_mm_cmpgt_epi16(tl,avg)),1);
+    return _mm_packus_epi16(_mm_add_epi16(avg,diff),zero);
+}
+
+#define PREDICT_SERIAL_SSE2(name, PRED) \
+static void name(pixel_t* row, const pixel_t* top, int count) { \
+    __m128i L = _mm_cvtsi32_si128(row[-1]); \
+    int i = 0; \
+    for(; i + 4 <= count; i += 4) { \
+        __m128i src = load_4(row+i), T = load_4(top+i), TL = load_4(top+i-1), TR = load_4(top+i+1); \
+        for(int j = 0; j < 4; j++) { \
+            L = _mm_add_epi8(PRED(L,T,TL,TR),src); \
+            row[i+j] = _mm_cvtsi128_si32(L); \
+            src = _mm_srli_si128(src,4); \
+            T = _mm_srli_si128(T,4); \
+            TL = _mm_srli_si128(TL,4); \
+            TR = _mm_srli_si128(TR,4); \
+        } \
+    } \
+    for(; i < count; i++) { \
+        __m128i T = _mm_cvtsi32_si128(top[i]), TL = _mm_cvtsi32_si128(top[i-1]), TR = _mm_cvtsi32_si128(top[i+1]); \
+        L = _mm_add_epi8(PRED(L,T,TL,TR),_mm_cvtsi32_si128(row[i])); \
+        row[i] = _mm_cvtsi128_si32(L); \
+    } \
+}
+PREDICT_SERIAL_SSE2(predict_row5_sse2, pred5_sse2)
+PREDICT_SERIAL_SSE2(predict_row6_sse2, pred6_sse2)
+PREDICT_SERIAL_SSE2(predict_row7_sse2, pred7_sse2)
+PREDICT_SERIAL_SSE2(predict_row10_sse2, pred10_sse2)
+PREDICT_SERIAL_SSE2(predict_row11_sse2, pred11_sse2)
+PREDICT_SERIAL_SSE2(predict_row12_sse2, pred12_sse2)
+PREDICT_SERIAL_SSE2(predict_row13_sse2, pred13_sse2)
+
+// AVX2 handles eight pixels per step for the top-only predictors. For the L-dependent ones
+// it precomputes the terms that only involve the row above, then runs the serial chain.
+#define AVX2 __attribute__((target("avx2")))
+#define load_8(p) _mm256_loadu_si256((const __m256i*)(p))
+#define store_8(p,x) _mm256_storeu_si256((__m256i*)(p),x)
+
+static inline AVX2 __m256i average2_avx2(__m256i a, __m256i b) {
+    return _mm256_sub_epi8(_mm256_avg_epu8(a,b),_mm256_and_si256(_mm256_xor_si256(a,b),_mm256_set1_epi8(1)));
+}
+
+#define PREDICT_TOP_AVX2(name, PRED, PRED_SSE2) \
+static AVX2 void name(pixel_t* row, const pixel_t* top, int count) { \
+    int i = 0; \
+    for(; i + 8 <= count; i += 8) { \
+        __m256i T = load_8(top+i), TL = load_8(top+i-1), TR = load_8(top+i+1); \
+        (void)T; (void)TL; (void)TR; \
+        store_8(row+i,_mm256_add_epi8(load_8(row+i),PRED)); \
+    } \
+    PRED_SSE2(row+i,top+i,count-i); \
+}
+PREDICT_TOP_AVX2(predict_row2_avx2, T, predict_row2_sse2)
+PREDICT_TOP_AVX2(predict_row3_avx2, TR, predict_row3_sse2)
+PREDICT_TOP_AVX2(predict_row4_avx2, TL, predict_row4_sse2)
+PREDICT_TOP_AVX2(predict_row8_avx2, average2_avx2(TL,T), predict_row8_sse2)
+PREDICT_TOP_AVX2(predict_row9_avx2, average2_avx2(T,TR), predict_row9_sse2)
+
+static AVX2 void predict_row10_avx2(pixel_t* row, const pixel_t* top, int count) {
+    __m128i L = _mm_cvtsi32_si128(row[-1]);
+    int i = 0;
+    for(; i + 8 <= count; i += 8) {
+        __m256i top_avg = average2_avx2(load_8(top+i),load_8(top+i+1));
+        for(int half = 0; half < 2; half++) {
+            __m128i src = load_4(row+i+half*4), TL = load_4(top+i+half*4-1);
+            __m128i T_TR = half ? _mm256_extracti128_si256(top_avg,1) : _mm256_castsi256_si128(top_avg);
+            for(int j = 0; j < 4; j++) {
+                L = _mm_add_epi8(average2_sse2(average2_sse2(L,TL),T_TR),src);
+                row[i+half*4+j] = _mm_cvtsi128_si32(L);
+                src = _mm_srli_si128(src,4);
+                TL = _mm_srli_si128(TL,4);
+                T_TR = _mm_srli_si128(T_TR,4);
+            }
+        }
+    }
+    predict_row10_sse2(row+i,top+i,count-i);
+}
+static AVX2 void predict_row11_avx2(pixel_t* row, const pixel_t* top, int count) {
+    const __m256i ones8 = _mm256_set1_epi8(1);
+    const __m256i ones16 = _mm256_set1_epi16(1);
+    int32_t pL[8];
+    int i = 0;
+    for(; i + 8 <= count; i += 8) {
+        // Sum of |T - TL| over the four channels of each pixel
+        __m256i T = load_8(top+i), TL = load_8(top+i-1);
+        __m256i diff = _mm256_sub_epi8(_mm256_max_epu8(T,TL),_mm256_min_epu8(T,TL));
+        _mm256_storeu_si256((__m256i*)pL,_mm256_madd_epi16(_mm256_maddubs_epi16(diff,ones8),ones16));
+        for(int j = 0; j < 8; j++) {
+            __m128i L = _mm_cvtsi32_si128(row[i+j-1]);
+            int32_t pT = _mm_cvtsi128_si32(_mm_sad_epu8(L,_mm_cvtsi32_si128(top[i+j-1])));
+            row[i+j] = add_pixels(row[i+j],(pL[j]<pT)?row[i+j-1]:top[i+j]);
+        }
+    }
+    predict_row11_sse2(row+i,top+i,count-i);
+}
+static AVX2 void predict_row12_avx2(pixel_t* row, const pixel_t* top, int count) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m128i zero_4 = _mm_setzero_si128();
+    __m128i L = _mm_unpacklo_epi8(_mm_cvtsi32_si128(row[-1]),zero_4);
+    int16_t gradient[8*4];
+    int i = 0;
+    for(; i + 8 <= count; i += 8) {
+        // T - TL widened to 16 bits. The unpacks work within 128-bit lanes, so lo holds
+        // pixels 0,1,4,5 and hi holds 2,3,6,7 until the permutes put them back in order.
+        __m256i T = load_8(top+i), TL = load_8(top+i-1);
+        __m256i lo = _mm256_sub_epi16(_mm256_unpacklo_epi8(T,zero),_mm256_unpacklo_epi8(TL,zero));
+        __m256i hi = _mm256_sub_epi16(_mm256_unpackhi_epi8(T,zero),_mm256_unpackhi_epi8(TL,zero));
+        store_8(gradient,_mm256_permute2x128_si256(lo,hi,0x20));
+        store_8(gradient+16,_mm256_permute2x128_si256(lo,hi,0x31));
+        for(int j = 0; j < 8; j++) {
+            __m128i pred = _mm_add_epi16(L,_mm_loadl_epi64((const __m128i*)(gradient+j*4)));
+            __m128i out = _mm_add_epi8(_mm_packus_epi16(pred,zero_4),_mm_cvtsi32_si128(row[i+j]));
+            row[i+j] = _mm_cvtsi128_si32(out);
+            L = _mm_unpacklo_epi8(out,zero_4);
+        }
+    }
+    predict_row12_sse2(row+i,top+i,count-i);
+}
+#endif
+
+static predictor_row_t predictor_rows[14];
+static pthread_once_t predictor_rows_once = PTHREAD_ONCE_INIT;
+
+static void init_predictor_rows(void) {
+    predictor_row_t c[14] = {
+        predict_row0_c, predict_row1_c, predict_row2_c, predict_row3_c, predict_row4_c,
+        predict_row5_c, predict_row6_c, predict_row7_c, predict_row8_c, predict_row9_c,
+        predict_row10_c, predict_row11_c, predict_row12_c, predict_row13_c
+    };
+    memcpy(predictor_rows,c,sizeof(c));
+#if defined(__SSE2__)
+    predictor_row_t sse2[14] = {
+        predict_row0_sse2, predict_row1_sse2, predict_row2_sse2, predict_row3_sse2, predict_row4_sse2,
+        predict_row5_sse2, predict_row6_sse2, predict_row7_sse2, predict_row8_sse2, predict_row9_sse2,
+        predict_row10_sse2, predict_row11_sse2, predict_row12_sse2, predict_row13_sse2
+    };
+    memcpy(predictor_rows,sse2,sizeof(sse2));
+    if(__builtin_cpu_supports("avx2")) {
+        predictor_rows[2] = predict_row2_avx2;
+        predictor_rows[3] = predict_row3_avx2;
+        predictor_rows[4] = predict_row4_avx2;
+        predictor_rows[8] = predict_row8_avx2;
+        predictor_rows[9] = predict_row9_avx2;
+        predictor_rows[10] = predict_row10_avx2;
+        predictor_rows[11] = predict_row11_avx2;
+        predictor_rows[12] = predict_row12_avx2;
+    }
+#endif
+}
+
+// Undoes the predictor transform on pixels [x_start, x_end) of row y, top being row y-1 as it
+// was straight after prediction with room for width+1 pixels. Spans of a row must be given in order.
+void apply_predictor_span(const struct transform* transform, pixel_t* row, pixel_t* top, uint32_t y, uint32_t x_start, uint32_t x_end) {
+    pthread_once(&predictor_rows_once,init_predictor_rows);
+    const struct image_data* predictor_map = &transform->subimage;
+    uint8_t block_scale = transform->block_scale;
+    uint32_t width = transform->width;
+    uint32_t x = x_start;
+    if(y == 0) {
+        // First row: opaque black for the first pixel, then L
+        if(x == 0) {
+            row[0] = add_pixels(row[0],0xff000000);
+            x = 1;
+        }
+        if(x < x_end) predictor_rows[1](row+x,NULL,x_end-x);
+        return;
+    }
+    const pixel_t* predictor_row = predictor_map->data + predictor_map->width * (y >> block_scale);
+
+    // First column: T. For the last column TR is the first pixel of this row, which the
+    // kernels read as top[width]. That slot is either row[0] itself or the caller's padding
+    // past the end of the row, which is put back afterwards.
+    if(x == 0) {
+        row[0] = add_pixels(row[0],top[0]);
+        x = 1;
+    }
+    bool borrow_top = x_end == width && top + width != row;
+    pixel_t past_top = top[width];
+    if(borrow_top) top[width] = row[0];
+
+    // The rest of the span, one predictor block at a time
+    while(x < x_end) {
+        uint32_t block_end = ((x >> block_scale) + 1) << block_scale;
+        if(block_end > x_end) block_end = x_end;
+        uint8_t predictor = (predictor_row[x >> block_scale] >> 8) & 0xff;
+        if(predictor > 13) err("Invalid predictor mode");
+        predictor_rows[predictor](row+x,top+x,block_end-x);
+        x = block_end;
+    }
+    if(borrow_top) top[width] = past_top;
+}
+
+// Undoes the predictor transform on rows [y_start, y_end), stored `stride` pixels apart from `rows`.
+// top_row holds row y_start-1 as it was straight after prediction, with room for width+1 pixels.
+void apply_predictor_rows(const struct transform* transform, pixel_t* rows, uint32_t stride, uint32_t y_start, uint32_t y_end, pixel_t* top_row) {
+    for(uint32_t y = y_start; y < y_end; y++) {
+        pixel_t* row = rows + (y-y_start)*stride;
+        pixel_t* top = (y == y_start) ? top_row : row - stride;
+        apply_predictor_span(transform,row,top,y,0,transform->width);
+    }
+}
@@ -0,0 +1,117 @@
+#include "webp_decoder.h"
+
+// Largest size within max_size by max_size with the same aspect ratio. Images are only ever shrunk.
+void fit_scaled_size(uint32_t width, uint32_t height, uint32_t max_size, uint32_t* scaled_width, uint32_t* scaled_height) {
+    uint32_t longest = width > height ? width : height;
+    *scaled_width = width;
+    *scaled_height = height;
+    if(longest <= max_size) return;
+    *scaled_width = ((uint64_t)width*max_size + longest/2) / longest;
+    *scaled_height = ((uint64_t)height*max_size + longest/2) / longest;
+    if(*scaled_width == 0) *scaled_width = 1;
+    if(*scaled_height == 0) *scaled_height = 1;
+}
+
+// Source pixel x covers [x*width, (x+1)*width) and output pixel X covers [X*src_width, (X+1)*src_width),
+// so every overlap is a whole number. When shrinking a source pixel overlaps at most two outputs.
+static void split_source(uint32_t src, uint32_t size, uint32_t src_size, uint32_t* output, uint32_t* weight) {
+    uint64_t start = (uint64_t)src*size;
+    *output = start / src_size;
+    uint64_t end = (uint64_t)src*size + size;
+    uint64_t boundary = (uint64_t)(*output + 1)*src_size;
+    *weight = (end < boundary ? end : boundary) - start;
+}
+
+void init_image_scaler(struct image_scaler* scaler, uint32_t src_width, uint32_t src_height, uint32_t width, uint32_t height, webp_row_callback callback, void* user) {
+    assert(width > 0 && height > 0 && width <= src_width && height <= src_height,"Error: images can only be scaled down");
+    scaler->src_width = src_width;
+    scaler->src_height = src_height;
+    scaler->width = width;
+    scaler->height = height;
+    scaler->callback = callback;
+    scaler->user = user;
+    scaler->column_output = malloc(sizeof(uint32_t)*src_width);
+    scaler->column_weight = malloc(sizeof(uint32_t)*src_width);
+    scaler->row = malloc(sizeof(uint64_t)*4*(width+1));
+    scaler->sums = calloc(2*4*(width+1),sizeof(uint64_t));
+    scaler->output_row = malloc(sizeof(pixel_t)*width);
+    assert(scaler->column_output!=NULL && scaler->column_weight!=NULL && scaler->row!=NULL && scaler->sums!=NULL && scaler->output_row!=NULL,"Error allocating memory");
+    for(uint32_t x = 0; x < src_width; x++) {
+        split_source(x,width,src_width,&scaler->column_output[x],&scaler->column_weight[x]);
+    }
+    scaler->src_y = 0;
+    scaler->y = 0;
+}
+
+void free_image_scaler(struct image_scaler* scaler) {
+    free(scaler->column_output);
+    free(scaler->column_weight);
+    free(scaler->row);
+    free(scaler->sums);
+    free(scaler->output_row);
+}
+
+// Colour is weighted by alpha so transparent pixels don't bleed their colour into the average
+static void emit_row(struct image_scaler* scaler, uint64_t* sums) {
+    uint64_t total = (uint64_t)scaler->src_width*scaler->src_height;
+    for(uint32_t x = 0; x < scaler->width; x++) {
+        uint64_t* sum = sums + 4*x;
+        uint64_t alpha = sum[3];
+        pixel_t pixel = ((alpha + total/2) / total) << 24;
+        if(alpha != 0) {
+            for(int c = 0; c < 3; c++) {
+                pixel |= ((sum[c] + alpha/2) / alpha) << (8*c);
+            }
+        }
+        scaler->output_row[x] = pixel;
+    }
+    memset(sums,0,sizeof(uint64_t)*4*(scaler->width+1));
+    scaler->callback(scaler->user,scaler->output_row,scaler->width,scaler->y++,1);
+}
+
+// Rows are taken in order and reduced as they arrive, so only one source row's worth of sums and
+// the two output rows it can touch are ever held. Once the last row is in, the scaler starts over
+// and can take another image of the same size.
+void scale_rows(struct image_scaler* scaler, const pixel_t* rows, uint32_t stride, uint32_t row_count) {
+    uint32_t width = scaler->width;
+    uint64_t* row = scaler->row;
+    for(uint32_t r = 0; r < row_count; r++) {
+        const pixel_t* pixels = rows + (size_t)r*stride;
+        memset(row,0,sizeof(uint64_t)*4*(width+1));
+        for(uint32_t x = 0; x < scaler->src_width; x++) {
+            pixel_t pixel = pixels[x];
+            uint32_t alpha = pixel >> 24;
+            uint64_t* first = row + 4*scaler->column_output[x];
+            uint32_t weight = scaler->column_weight[x];
+            uint32_t rest = width - weight;
+            // The last output column's spill lands in the padding entry past the end
+            for(int c = 0; c < 3; c++) {
+                uint32_t value = ((pixel >> (8*c)) & 0xff) * alpha;
+                first[c] += (uint64_t)value*weight;
+                first[4+c] += (uint64_t)value*rest;
+            }
+            first[3] += alpha*weight;
+            first[7] += alpha*rest;
+        }
+
+        uint32_t output_y, weight;
+        split_source(scaler->src_y,scaler->height,scaler->src_height,&output_y,&weight);
+        uint32_t rest = scaler->height - weight;
+        uint64_t* current = scaler->sums + 4*(width+1)*(output_y&1);
+        uint64_t* next = scaler->sums + 4*(width+1)*((output_y+1)&1);
+        for(uint32_t i = 0; i < 4*width; i++) {
+            current[i] += row[i]*weight;
+            next[i] += row[i]*rest;
+        }
+        scaler->src_y++;
+        // An output row is done once a source row reaches its bottom edge
+        if((uint64_t)scaler->src_y*scaler->height >= (uint64_t)(output_y+1)*scaler->src_height) {
+            emit_row(scaler,current);
+        }
+        if(scaler->src_y == scaler->src_height) {
+            memset(scaler->sums,0,sizeof(uint64_t)*2*4*(width+1));
+            scaler->src_y = 0;
+            scaler->y = 0;
+        }
+    }
+}
@@ -0,0 +1,82 @@
+#include "webp_decoder.h"
+
+static void* thread_pool_worker(void* arg) {
+    struct thread_pool* pool = arg;
+    pthread_mutex_lock(&pool->lock);
+    while(true) {
+        while(!pool->shutdown && (pool->next >= pool->count || pool->next >= pool->limit)) {
+            pthread_cond_wait(&pool->changed,&pool->lock);
+        }
+        if(pool->shutdown) break;
+        uint32_t index = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        pool->job(pool->context,index);
+        pthread_mutex_lock(&pool->lock);
+        pool->done[index] = 1;
+        pthread_cond_broadcast(&pool->changed);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+void init_thread_pool(struct thread_pool* pool, int thread_count) {
+    memset(pool,0,sizeof(*pool));
+    pthread_mutex_init(&pool->lock,NULL);
+    pthread_cond_init(&pool->changed,NULL);
+    pool->thread_count = thread_count;
+    pool->threads = malloc(sizeof(pthread_t)*thread_count);
+    check_alloc(pool->threads);
+    for(int i = 0; i < thread_count; i++) {
+        assert(pthread_create(&pool->threads[i],NULL,thread_pool_worker,pool)==0,"Error: unable to start thread");
+    }
+}
+
+void free_thread_pool(struct thread_pool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = true;
+    pthread_cond_broadcast(&pool->changed);
+    pthread_mutex_unlock(&pool->lock);
+    for(int i = 0; i < pool->thread_count; i++) {
+        pthread_join(pool->threads[i],NULL);
+    }
+    free(pool->threads);
+    free(pool->done);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->changed);
+}
+
+// Starts job(context, i) for every i below count. Jobs are picked up in order, and with a
+// window no job starts more than window places past the last one waited for, which bounds
+// how much finished work can pile up ahead of an ordered consumer. 0 means no limit.
+void thread_pool_start(struct thread_pool* pool, void (*job)(void* context, uint32_t index), void* context, uint32_t count, uint32_t window) {
+    pthread_mutex_lock(&pool->lock);
+    free(pool->done);
+    pool->done = calloc(count ? count : 1,1);
+    check_alloc(pool->done);
+    pool->job = job;
+    pool->context = context;
+    pool->count = count;
+    pool->next = 0;
+    pool->window = window ? window : count;
+    pool->limit = pool->window;
+    pthread_cond_broadcast(&pool->changed);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void thread_pool_wait(struct thread_pool* pool, uint32_t index) {
+    pthread_mutex_lock(&pool->lock);
+    while(!pool->done[index]) {
+        pthread_cond_wait(&pool->changed,&pool->lock);
+    }
+    if(index + 1 + pool->window > pool->limit) {
+        pool->limit = index + 1 + pool->window;
+        pthread_cond_broadcast(&pool->changed);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void thread_pool_finish(struct thread_pool* pool) {
+    for(uint32_t i = 0; i < pool->count; i++) {
+        thread_pool_wait(pool,i);
+    }
+}
@@ -0,0 +1,296 @@
+#include "webp_decoder.h"
+
+#include <sched.h>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// Rows per band are picked so one band of ARGB stays in L2 while every transform runs over it
+#define TRANSFORM_BAND_BYTES (256*1024)
+
+int32_t ALPHA(pixel_t x) {return x>>24;}
+int32_t RED(pixel_t x) {return (x>>16)&0xff;}
+int32_t GREEN(pixel_t x) {return (x>>8)&0xff;}
+int32_t BLUE(pixel_t x) {return x&0xff;}
+
+static void apply_subtract_green_rows(const struct transform* transform, pixel_t* rows, uint32_t stride, uint32_t row_count) {
+    for(uint32_t y = 0; y < row_count; y++) {
+        pixel_t* row = rows + y*stride;
+        for(int x = 0; x < transform->width; x++) {
+            pixel_t output_pixel = row[x]&0xff00ff00;
+            output_pixel |= (BLUE(row[x])+GREEN(row[x])) & 0xff;
+            output_pixel |= ((RED(row[x])+GREEN(row[x])) & 0xff)<<16;
+            row[x]=output_pixel;
+        }
+    }
+}
+
+int8_t colour_transform_delta(uint8_t t_, uint8_t c_) {
+    int32_t t = t_ >= 128 ? -256+t_ : t_;
+    int32_t c = c_ >= 128 ? -256+c_ : c_;
+    return ((t*c) >> 5)&0xff;
+}
+
+static void apply_colour_transform_rows(const struct transform* transform, pixel_t* rows, uint32_t stride, uint32_t y_start, uint32_t y_end) {
+    const struct image_data* colour_info_map = &transform->subimage;
+    uint8_t block_scale = transform->block_scale;
+    for(uint32_t y = y_start; y < y_end; y++) {
+        pixel_t* row = rows + (y-y_start)*stride;
+        const pixel_t* ctx_row = colour_info_map->data + colour_info_map->width * (y >> block_scale);
+        for(int x = 0; x < transform->width; x++) {
+            pixel_t pixel = row[x];
+            pixel_t ctx_pixel = ctx_row[x >> block_scale];
+            uint8_t red_to_blue = (uint8_t)RED(ctx_pixel);
+            uint8_t green_to_blue = (uint8_t)GREEN(ctx_pixel);
+            uint8_t green_to_red = (uint8_t)BLUE(ctx_pixel);
+            uint8_t temp_red = RED(pixel);
+            uint8_t temp_blue = BLUE(pixel);
+            temp_red += colour_transform_delta(green_to_red,GREEN(pixel));
+            temp_blue += colour_transform_delta(green_to_blue,GREEN(pixel));
+            temp_blue += colour_transform_delta(red_to_blue,temp_red&0xff);
+            row[x] = pixel&0xff00ff00 | (temp_red&0xff) << 16 | (temp_blue&0xff);
+        }
+    }
+}
+
+void init_colour_indexing(struct transform* transform, struct arena* arena) {
+    const struct image_data* colour_table = &transform->subimage;
+    // Indices past the end of the colour table decode as transparent black
+    pixel_t palette[256] = {0};
+    pixel_t previous = 0;
+    for(int i = 0; i < colour_table->width; i++) {
+        // The colour table is delta coded, each entry adding onto the one before per channel
+        pixel_t delta = colour_table->data[i];
+        pixel_t ag = (delta & 0xff00ff00) + (previous & 0xff00ff00);
+        pixel_t rb = (delta & 0x00ff00ff) + (previous & 0x00ff00ff);
+        palette[i] = previous = (ag & 0xff00ff00) | (rb & 0x00ff00ff);
+    }
+
+    int pixels_per_byte = 1 << transform->block_scale;
+    int bits_per_pixel = 8 >> transform->block_scale;
+    int index_mask = (1 << bits_per_pixel) - 1;
+    transform->palette_lut = arena_alloc(arena,sizeof(pixel_t)*256*pixels_per_byte);
+    for(int byte = 0; byte < 256; byte++) {
+        for(int i = 0; i < pixels_per_byte; i++) {
+            transform->palette_lut[byte*pixels_per_byte+i] = palette[(byte >> (i*bits_per_pixel)) & index_mask];
+        }
+    }
+}
+
+static void colour_index_row_c(const pixel_t* lut, const pixel_t* in, pixel_t* out, int width) {
+    for(int x = 0; x < width; x++) out[x] = lut[(in[x]>>8)&0xff];
+}
+
+#if defined(__SSE2__)
+static __attribute__((target("avx2"))) void colour_index_row_avx2(const pixel_t* lut, const pixel_t* in, pixel_t* out, int width) {
+    const __m256i index_mask = _mm256_set1_epi32(0xff);
+    int x = 0;
+    for(; x + 8 <= width; x += 8) {
+        __m256i index = _mm256_and_si256(_mm256_srli_epi32(_mm256_loadu_si256((const __m256i*)(in+x)),8),index_mask);
+        _mm256_storeu_si256((__m256i*)(out+x),_mm256_i32gather_epi32((const int*)lut,index,4));
+    }
+    colour_index_row_c(lut,in+x,out+x,width-x);
+}
+#endif
+
+static void (*colour_index_row)(const pixel_t* lut, const pixel_t* in, pixel_t* out, int width);
+static pthread_once_t colour_index_row_once = PTHREAD_ONCE_INIT;
+
+static void init_colour_index_row(void) {
+    colour_index_row = colour_index_row_c;
+#if defined(__SSE2__)
+    if(__builtin_cpu_supports("avx2")) colour_index_row = colour_index_row_avx2;
+#endif
+}
+
+// Expands coded rows through the palette. in may equal out, in which case the bundled
+// indices at the start of each row are expanded right to left so nothing is read after
+// it has been overwritten.
+static void apply_colour_indexing_rows(const struct transform* transform, const pixel_t* in, uint32_t in_stride, pixel_t* out, uint32_t out_stride, uint32_t row_count) {
+    pthread_once(&colour_index_row_once,init_colour_index_row);
+    const pixel_t* lut = transform->palette_lut;
+    uint8_t bundle_bits = transform->block_scale;
+    uint32_t width = transform->width;
+    uint32_t full_bundles = width >> bundle_bits;
+    uint32_t tail = width & ((1 << bundle_bits) - 1);
+    for(uint32_t y = 0; y < row_count; y++) {
+        const pixel_t* in_row = in + y*in_stride;
+        pixel_t* out_row = out + y*out_stride;
+        if(bundle_bits == 0) {
+            colour_index_row(lut,in_row,out_row,width);
+            continue;
+        }
+        if(tail) {
+            const pixel_t* entry = lut + (((in_row[full_bundles]>>8)&0xff) << bundle_bits);
+            memcpy(out_row+(full_bundles<<bundle_bits),entry,sizeof(pixel_t)*tail);
+        }
+        // Fixed size copies per bundle width so each expansion is a couple of wide moves
+        switch(bundle_bits) {
+            case 1:
+                for(int32_t i = full_bundles-1; i >= 0; i--) memcpy(out_row+(i<<1),lut+(((in_row[i]>>8)&0xff)<<1),sizeof(pixel_t)*2);
+                break;
+            case 2:
+                for(int32_t i = full_bundles-1; i >= 0; i--) memcpy(out_row+(i<<2),lut+(((in_row[i]>>8)&0xff)<<2),sizeof(pixel_t)*4);
+                break;
+            case 3:
+                for(int32_t i = full_bundles-1; i >= 0; i--) memcpy(out_row+(i<<3),lut+(((in_row[i]>>8)&0xff)<<3),sizeof(pixel_t)*8);
+                break;
+        }
+    }
+}
+
+void init_transform_pipeline(struct transform_pipeline* pipeline, uint16_t width, uint16_t height, struct arena* arena) {
+    pipeline->count = 0;
+    pipeline->width = width;
+    pipeline->height = height;
+    pipeline->coded_width = width;
+    // One spare pixel so the predictor can place TR for the last column after the row
+    pipeline->predictor_top_row = arena_alloc(arena,sizeof(pixel_t)*(width+1));
+    pipeline->pool = NULL;
+    pipeline->row_progress = NULL;
+}
+
+// Bands of up to band_rows rows are then split over the pool
+void init_transform_threads(struct transform_pipeline* pipeline, struct thread_pool* pool, uint32_t band_rows, struct arena* arena) {
+    pipeline->pool = pool;
+    pipeline->row_progress = arena_alloc(arena,sizeof(_Atomic uint32_t)*band_rows);
+}
+
+uint32_t transform_band_rows(const struct transform_pipeline* pipeline) {
+    uint32_t band_rows = TRANSFORM_BAND_BYTES / (sizeof(pixel_t)*pipeline->width);
+    return band_rows == 0 ? 1 : band_rows;
+}
+
+// Runs transforms first down to last over the rows in dst. With src set the coded rows are
+// first brought over from there, the caller passing the last transform read as first.
+static void apply_transforms(struct transform_pipeline* pipeline, int first, int last, const pixel_t* src, pixel_t* dst, uint32_t stride, uint32_t y_start, uint32_t y_end) {
+    uint32_t row_count = y_end - y_start;
+    int i = first;
+    if(src != NULL) {
+        if(i >= 0 && pipeline->transforms[i].type == COLOUR_INDEXING_TRANSFORM) {
+            // Expand straight from the coded rows rather than copying them over first
+            apply_colour_indexing_rows(&pipeline->transforms[i],src,pipeline->coded_width,dst,stride,row_count);
+            i--;
+        } else {
+            for(uint32_t y = 0; y < row_count; y++) {
+                memcpy(dst+y*stride,src+y*pipeline->coded_width,sizeof(pixel_t)*pipeline->coded_width);
+            }
+        }
+    }
+    for(; i >= last; i--) {
+        const struct transform* transform = &pipeline->transforms[i];
+        switch(transform->type) {
+            case PREDICTOR_TRANSFORM:
+                apply_predictor_rows(transform,dst,stride,y_start,y_end,pipeline->predictor_top_row);
+                // Later transforms overwrite the band, so keep its last row as the next band's context
+                memcpy(pipeline->predictor_top_row,dst+(row_count-1)*stride,sizeof(pixel_t)*transform->width);
+                break;
+            case COLOUR_TRANSFORM:
+                apply_colour_transform_rows(transform,dst,stride,y_start,y_end);
+                break;
+            case SUBTRACT_GREEN_TRANSFORM:
+                apply_subtract_green_rows(transform,dst,stride,row_count);
+                break;
+            case COLOUR_INDEXING_TRANSFORM:
+                apply_colour_indexing_rows(transform,dst,stride,dst,stride,row_count);
+                break;
+        }
+    }
+}
+
+// Pixels the predictor does between progress updates
+#define WAVEFRONT_SPAN 256
+
+struct parallel_band {
+    struct transform_pipeline* pipeline;
+    const pixel_t* src;
+    pixel_t* dst;
+    uint32_t stride;
+    uint32_t y_start;
+    uint32_t y_end;
+    // Index of the predictor transform, or -1
+    int predictor;
+    uint32_t job_count;
+};
+
+static void wait_for_progress(_Atomic uint32_t* progress, uint32_t x) {
+    while(atomic_load_explicit(progress,memory_order_acquire) < x) sched_yield();
+}
+
+// Job i takes every job_count'th row from i, bringing it through the transforms up to and
+// including the predictor. Each predictor span waits for the row above to be far enough
+// along to have its T and TR pixels, so rows move down the band as a wavefront.
+static void transform_rows_job(void* context, uint32_t index) {
+    struct parallel_band* band = context;
+    struct transform_pipeline* pipeline = band->pipeline;
+    int first = pipeline->count-1;
+    for(uint32_t y = band->y_start + index; y < band->y_end; y += band->job_count) {
+        uint32_t band_row = y - band->y_start;
+        pixel_t* row = band->dst + band_row*band->stride;
+        const pixel_t* src_row = band->src + band_row*pipeline->coded_width;
+        if(band->predictor < 0) {
+            apply_transforms(pipeline,first,0,src_row,row,band->stride,y,y+1);
+            continue;
+        }
+        apply_transforms(pipeline,first,band->predictor+1,src_row,row,band->stride,y,y+1);
+        const struct transform* transform = &pipeline->transforms[band->predictor];
+        pixel_t* top = band_row == 0 ? pipeline->predictor_top_row : row - band->stride;
+        uint32_t width = transform->width;
+        for(uint32_t x = 0; x < width; x += WAVEFRONT_SPAN) {
+            uint32_t x_end = x + WAVEFRONT_SPAN < width ? x + WAVEFRONT_SPAN : width;
+            if(band_row > 0) wait_for_progress(&pipeline->row_progress[band_row-1],x_end < width ? x_end+1 : width);
+            apply_predictor_span(transform,row,top,y,x,x_end);
+            atomic_store_explicit(&pipeline->row_progress[band_row],x_end,memory_order_release);
+        }
+    }
+}
+
+// Everything after the predictor only looks at one pixel at a time, so job i takes a run of rows
+static void finish_rows_job(void* context, uint32_t index) {
+    struct parallel_band* band = context;
+    uint32_t row_count = band->y_end - band->y_start;
+    uint32_t rows_per_job = ceil_div(row_count,band->job_count);
+    uint32_t start = index*rows_per_job;
+    uint32_t end = start + rows_per_job < row_count ? start + rows_per_job : row_count;
+    if(start >= end) return;
+    apply_transforms(band->pipeline,band->predictor-1,0,NULL,band->dst+start*band->stride,band->stride,band->y_start+start,band->y_start+end);
+}
+
+// Runs a band over the pool. Jobs only ever wait on rows above theirs and there are no more jobs
+// than threads, so the row holding everyone up is always being worked on.
+static void transform_band_parallel(struct transform_pipeline* pipeline, const pixel_t* src, pixel_t* dst, uint32_t stride, uint32_t y_start, uint32_t y_end) {
+    struct parallel_band band = {
+        .pipeline = pipeline,
+        .src = src,
+        .dst = dst,
+        .stride = stride,
+        .y_start = y_start,
+        .y_end = y_end,
+        .predictor = -1,
+        .job_count = pipeline->pool->thread_count
+    };
+    for(int i = 0; i < pipeline->count; i++) {
+        if(pipeline->transforms[i].type == PREDICTOR_TRANSFORM) band.predictor = i;
+    }
+    uint32_t row_count = y_end - y_start;
+    if(band.job_count > row_count) band.job_count = row_count;
+    for(uint32_t i = 0; i < row_count; i++) atomic_init(&pipeline->row_progress[i],0);
+    thread_pool_start(pipeline->pool,transform_rows_job,&band,band.job_count,0);
+    thread_pool_finish(pipeline->pool);
+    if(band.predictor < 0) return;
+    memcpy(pipeline->predictor_top_row,dst+(row_count-1)*stride,sizeof(pixel_t)*pipeline->transforms[band.predictor].width);
+    if(band.predictor == 0) return;
+    thread_pool_start(pipeline->pool,finish_rows_job,&band,band.job_count,0);
+    thread_pool_finish(pipeline->pool);
+}
+
+// src holds the coded rows at coded_width and is left untouched, dst receives the rows at
+// full width. Bands must be given in order as the predictor carries its context across them.
+void transform_band(struct transform_pipeline* pipeline, const pixel_t* src, pixel_t* dst, uint32_t stride, uint32_t y_start, uint32_t y_end) {
+    if(pipeline->pool != NULL && y_end - y_start > 1) {
+        transform_band_parallel(pipeline,src,dst,stride,y_start,y_end);
+    } else {
+        apply_transforms(pipeline,pipeline->count-1,0,src,dst,stride,y_start,y_end);
+    }
+}
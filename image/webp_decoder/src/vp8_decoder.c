@@ -0,0 +1,890 @@
+#include "webp_decoder.h"
+
+// Binary arithmetic decoder that every VP8 partition is coded with
+struct bool_decoder {
+    const uint8_t* data;
+    const uint8_t* end;
+    // Bits not yet decoded, the current 8 bit window sitting just above the lowest `bits` bits
+    uint64_t value;
+    int32_t bits;
+    // One less than the range, kept between 127 and 254
+    uint32_t range;
+    // Set once a read has needed bits past the end of the partition
+    bool eof;
+};
+
+static void load_bool_bytes(struct bool_decoder* decoder) {
+    if(decoder->end - decoder->data >= 8) {
+        uint64_t bytes;
+        memcpy(&bytes,decoder->data,8);
+        decoder->value = (decoder->value << 56) | (__builtin_bswap64(bytes) >> 8);
+        decoder->data += 7;
+        decoder->bits += 56;
+    } else if(decoder->data < decoder->end) {
+        decoder->value = (decoder->value << 8) | *decoder->data++;
+        decoder->bits += 8;
+    } else if(!decoder->eof) {
+        decoder->value <<= 8;
+        decoder->bits += 8;
+        decoder->eof = true;
+    } else {
+        decoder->bits = 0;
+    }
+}
+
+static void init_bool_decoder(struct bool_decoder* decoder, const uint8_t* data, size_t size) {
+    *decoder = (struct bool_decoder){
+        .data = data,
+        .end = data + size,
+        .bits = -8,
+        .range = 254
+    };
+    load_bool_bytes(decoder);
+}
+
+static inline int read_bool(struct bool_decoder* decoder, uint8_t prob) {
+    if(decoder->bits < 0) load_bool_bytes(decoder);
+    uint32_t range = decoder->range;
+    uint32_t split = (range * prob) >> 8;
+    int bit = (uint32_t)(decoder->value >> decoder->bits) > split;
+    if(bit) {
+        range -= split;
+        decoder->value -= (uint64_t)(split + 1) << decoder->bits;
+    } else {
+        range = split + 1;
+    }
+    int shift = 7 ^ (31 - __builtin_clz(range));
+    decoder->range = (range << shift) - 1;
+    decoder->bits -= shift;
+    return bit;
+}
+
+static uint32_t read_literal(struct bool_decoder* decoder, int bit_count) {
+    uint32_t value = 0;
+    while(bit_count--) value = (value << 1) | read_bool(decoder,128);
+    return value;
+}
+
+// Magnitude first, then the sign
+static int32_t read_signed_literal(struct bool_decoder* decoder, int bit_count) {
+    int32_t value = read_literal(decoder,bit_count);
+    return read_bool(decoder,128) ? -value : value;
+}
+
+// Header fields that are 0 unless a flag says they follow
+static int32_t read_optional_signed(struct bool_decoder* decoder, int bit_count) {
+    return read_bool(decoder,128) ? read_signed_literal(decoder,bit_count) : 0;
+}
+
+// Prediction modes, in the order the subblock mode probabilities are indexed by. Whole
+// macroblocks and chroma only use the first four.
+enum vp8_mode {
+    DC_PRED, TM_PRED, V_PRED, H_PRED,
+    RD_PRED, VR_PRED, LD_PRED, VL_PRED, HD_PRED, HU_PRED
+};
+
+// Each node is a pair of entries, leaves being negated modes
+static const int8_t subblock_mode_tree[18] = {
+    -DC_PRED, 1,
+    -TM_PRED, 2,
+    -V_PRED, 3,
+    4, 6,
+    -H_PRED, 5,
+    -RD_PRED, -VR_PRED,
+    -LD_PRED, 7,
+    -VL_PRED, 8,
+    -HD_PRED, -HU_PRED
+};
+
+static const uint8_t zigzag[16] = {0, 1, 4, 8, 5, 2, 3, 6, 9, 12, 13, 10, 7, 11, 14, 15};
+// Coefficient band of each position, with one past the end for looking ahead from the last
+static const uint8_t coefficient_bands[17] = {0, 1, 2, 3, 6, 4, 5, 6, 6, 6, 6, 6, 6, 6, 6, 7, 0};
+
+// Extra bits of the DCT_CAT3 to DCT_CAT6 tokens, each list ending in 0
+static const uint8_t cat3_probs[] = {173, 148, 140, 0};
+static const uint8_t cat4_probs[] = {176, 155, 140, 135, 0};
+static const uint8_t cat5_probs[] = {180, 157, 141, 134, 130, 0};
+static const uint8_t cat6_probs[] = {254, 254, 243, 230, 196, 177, 153, 140, 133, 130, 129, 0};
+static const uint8_t* const category_probs[4] = {cat3_probs, cat4_probs, cat5_probs, cat6_probs};
+
+#define Y_OFFSET (VP8_BPS + 8)
+#define U_OFFSET (Y_OFFSET + 17*VP8_BPS)
+#define V_OFFSET (U_OFFSET + 16)
+#define WORK_SIZE (26*VP8_BPS)
+
+// Rows converted to ARGB at a time when there is no output to put them in
+#define VP8_BAND_ROWS 16
+
+struct vp8_filter {
+    // Edge limit for inner edges, 0 when the macroblock is not filtered at all
+    uint8_t limit;
+    uint8_t interior;
+    uint8_t hev_thresh;
+    bool inner;
+};
+
+struct vp8_segment {
+    // Dequantisation factors, DC then AC
+    int16_t y_quant[2];
+    int16_t y2_quant[2];
+    int16_t uv_quant[2];
+    // Indexed by whether the macroblock is predicted in subblocks
+    struct vp8_filter filters[2];
+};
+
+struct vp8_macroblock {
+    uint8_t segment;
+    bool skip;
+    bool subblocks;
+    uint8_t y_mode;
+    uint8_t uv_mode;
+    uint8_t modes[16];
+    // Blocks with residuals, luma in the low 16 bits then 4 each of u and v
+    uint32_t coded_blocks;
+    // Whether any tokens were read at all, which decides if the inner edges are filtered
+    bool has_coefficients;
+};
+
+struct vp8_decoder {
+    uint16_t width;
+    uint16_t height;
+    uint32_t mb_width;
+    uint32_t mb_height;
+    struct bool_decoder header;
+    struct bool_decoder partitions[8];
+    uint32_t partition_count;
+    bool update_segment_map;
+    uint8_t segment_probs[3];
+    struct vp8_segment segments[4];
+    bool simple_filter;
+    bool filtering;
+    uint8_t coefficient_probs[4][8][3][11];
+    bool use_skip_prob;
+    uint8_t skip_prob;
+    // Contexts from the macroblocks above and to the left
+    uint8_t* top_modes;
+    uint8_t left_modes[4];
+    uint8_t (*top_nonzero)[9];
+    uint8_t left_nonzero[9];
+    // Bottom rows of the macroblock row above as they were before loop filtering
+    uint8_t* top_y;
+    uint8_t* top_u;
+    uint8_t* top_v;
+    // Loop filter strengths for the current macroblock row
+    struct vp8_filter* filters;
+    // Reconstructed planes, padded to whole macroblocks
+    uint8_t* y_plane;
+    uint8_t* u_plane;
+    uint8_t* v_plane;
+    uint32_t y_stride;
+    uint32_t uv_stride;
+    const struct vp8_kernels* kernels;
+    _Alignas(16) int16_t coefficients[384];
+    // A macroblock with the row above and the column to the left, laid out VP8_BPS wide
+    _Alignas(16) uint8_t work[WORK_SIZE];
+    pixel_t* output;
+    uint32_t output_stride;
+    pixel_t* band;
+    uint32_t rows_done;
+    webp_row_callback callback;
+    void* user;
+};
+
+static inline int clamp_int(int v, int low, int high) {
+    return v < low ? low : v > high ? high : v;
+}
+static inline uint8_t clip_pixel(int v) {
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+void read_vp8_frame_size(const uint8_t* data, size_t size, uint16_t* width, uint16_t* height) {
+    assert(size >= 10,"Error: invalid VP8 frame");
+    assert(!(data[0] & 1),"Error: VP8 frame is not a key frame");
+    assert(((data[0] >> 1) & 7) <= 3,"Error: invalid VP8 version");
+    assert(data[0] & 0x10,"Error: VP8 frame is not shown");
+    assert(data[3] == 0x9d && data[4] == 0x01 && data[5] == 0x2a,"Error: invalid VP8 start code");
+    // The top two bits of each are an upscaling hint, which is left to whoever displays the image
+    *width = (data[6] | data[7]<<8) & 0x3fff;
+    *height = (data[8] | data[9]<<8) & 0x3fff;
+    assert(*width > 0 && *height > 0,"Error: invalid VP8 frame size");
+}
+
+static struct vp8_filter filter_strength(int level, int sharpness, int ref_delta, int mode_delta, bool subblocks) {
+    // Key frames are all intra coded, so only the intra delta and the subblock mode delta apply
+    level += ref_delta;
+    if(subblocks) level += mode_delta;
+    level = clamp_int(level,0,63);
+    if(level == 0) return (struct vp8_filter){0};
+    int interior = level;
+    if(sharpness > 0) {
+        interior >>= sharpness > 4 ? 2 : 1;
+        if(interior > 9 - sharpness) interior = 9 - sharpness;
+    }
+    if(interior < 1) interior = 1;
+    return (struct vp8_filter){
+        .limit = 2*level + interior,
+        .interior = interior,
+        .hev_thresh = level >= 40 ? 2 : level >= 15 ? 1 : 0,
+        .inner = subblocks
+    };
+}
+
+static void read_frame_header(struct vp8_decoder* decoder, const uint8_t* data, size_t size) {
+    read_vp8_frame_size(data,size,&decoder->width,&decoder->height);
+    uint32_t first_partition_size = (data[0] | data[1]<<8 | data[2]<<16) >> 5;
+    assert(first_partition_size <= size - 10,"Error: VP8 partition runs past the end of the frame");
+    struct bool_decoder* header = &decoder->header;
+    init_bool_decoder(header,data+10,first_partition_size);
+    // Colour space and clamping type, neither of which changes how the frame is decoded
+    read_literal(header,2);
+
+    int8_t segment_quant[4] = {0}, segment_level[4] = {0};
+    bool segmentation = read_bool(header,128), absolute_values = false;
+    decoder->update_segment_map = false;
+    if(segmentation) {
+        decoder->update_segment_map = read_bool(header,128);
+        if(read_bool(header,128)) {
+            absolute_values = read_bool(header,128);
+            for(int i = 0; i < 4; i++) segment_quant[i] = read_optional_signed(header,7);
+            for(int i = 0; i < 4; i++) segment_level[i] = read_optional_signed(header,6);
+        }
+        if(decoder->update_segment_map) {
+            for(int i = 0; i < 3; i++) decoder->segment_probs[i] = read_bool(header,128) ? read_literal(header,8) : 255;
+        }
+    }
+
+    decoder->simple_filter = read_bool(header,128);
+    int level = read_literal(header,6);
+    int sharpness = read_literal(header,3);
+    int ref_delta = 0, mode_delta = 0;
+    if(read_bool(header,128) && read_bool(header,128)) {
+        int8_t ref_deltas[4] = {0}, mode_deltas[4] = {0};
+        for(int i = 0; i < 4; i++) ref_deltas[i] = read_optional_signed(header,6);
+        for(int i = 0; i < 4; i++) mode_deltas[i] = read_optional_signed(header,6);
+        ref_delta = ref_deltas[0];
+        mode_delta = mode_deltas[0];
+    }
+    decoder->filtering = level > 0;
+
+    // The sizes of all but the last token partition come first, 3 bytes each
+    decoder->partition_count = 1 << read_literal(header,2);
+    const uint8_t* partition = data + 10 + first_partition_size;
+    size_t remaining = size - 10 - first_partition_size;
+    const uint8_t* partition_sizes = partition;
+    assert(remaining >= 3*(decoder->partition_count-1),"Error: VP8 partition runs past the end of the frame");
+    partition += 3*(decoder->partition_count-1);
+    remaining -= 3*(decoder->partition_count-1);
+    for(uint32_t i = 0; i + 1 < decoder->partition_count; i++) {
+        const uint8_t* p = partition_sizes + 3*i;
+        uint32_t partition_size = p[0] | p[1]<<8 | p[2]<<16;
+        assert(partition_size <= remaining,"Error: VP8 partition runs past the end of the frame");
+        init_bool_decoder(&decoder->partitions[i],partition,partition_size);
+        partition += partition_size;
+        remaining -= partition_size;
+    }
+    init_bool_decoder(&decoder->partitions[decoder->partition_count-1],partition,remaining);
+
+    int base_quant = read_literal(header,7);
+    int y_dc_delta = read_optional_signed(header,4);
+    int y2_dc_delta = read_optional_signed(header,4);
+    int y2_ac_delta = read_optional_signed(header,4);
+    int uv_dc_delta = read_optional_signed(header,4);
+    int uv_ac_delta = read_optional_signed(header,4);
+    for(int i = 0; i < 4; i++) {
+        struct vp8_segment* segment = &decoder->segments[i];
+        int q = base_quant, segment_filter_level = level;
+        if(segmentation) {
+            q = absolute_values ? segment_quant[i] : base_quant + segment_quant[i];
+            segment_filter_level = absolute_values ? segment_level[i] : level + segment_level[i];
+        }
+        segment->y_quant[0] = vp8_dc_quant[clamp_int(q+y_dc_delta,0,127)];
+        segment->y_quant[1] = vp8_ac_quant[clamp_int(q,0,127)];
+        segment->y2_quant[0] = vp8_dc_quant[clamp_int(q+y2_dc_delta,0,127)] * 2;
+        segment->y2_quant[1] = vp8_ac_quant[clamp_int(q+y2_ac_delta,0,127)] * 155 / 100;
+        if(segment->y2_quant[1] < 8) segment->y2_quant[1] = 8;
+        segment->uv_quant[0] = vp8_dc_quant[clamp_int(q+uv_dc_delta,0,117)];
+        segment->uv_quant[1] = vp8_ac_quant[clamp_int(q+uv_ac_delta,0,127)];
+        for(int subblocks = 0; subblocks < 2; subblocks++) {
+            segment->filters[subblocks] = decoder->filtering ? filter_strength(segment_filter_level,sharpness,ref_delta,mode_delta,subblocks) : (struct vp8_filter){0};
+        }
+    }
+
+    // Whether to keep the probabilities for the next frame, meaningless for a single one
+    read_bool(header,128);
+    for(int t = 0; t < 4; t++) {
+        for(int b = 0; b < 8; b++) {
+            for(int c = 0; c < 3; c++) {
+                for(int p = 0; p < 11; p++) {
+                    bool update = read_bool(header,vp8_coefficient_update_probs[t][b][c][p]);
+                    decoder->coefficient_probs[t][b][c][p] = update ? read_literal(header,8) : vp8_default_coefficient_probs[t][b][c][p];
+                }
+            }
+        }
+    }
+    decoder->use_skip_prob = read_bool(header,128);
+    decoder->skip_prob = decoder->use_skip_prob ? read_literal(header,8) : 0;
+    assert(!header->eof,"Error: truncated VP8 frame header");
+}
+
+static void read_macroblock_header(struct vp8_decoder* decoder, struct vp8_macroblock* mb, uint32_t mb_x) {
+    struct bool_decoder* header = &decoder->header;
+    mb->segment = 0;
+    if(decoder->update_segment_map) {
+        const uint8_t* p = decoder->segment_probs;
+        mb->segment = !read_bool(header,p[0]) ? read_bool(header,p[1]) : 2 + read_bool(header,p[2]);
+    }
+    mb->skip = decoder->use_skip_prob && read_bool(header,decoder->skip_prob);
+    uint8_t* top = decoder->top_modes + 4*mb_x;
+    uint8_t* left = decoder->left_modes;
+    mb->subblocks = !read_bool(header,145);
+    if(!mb->subblocks) {
+        uint8_t mode = read_bool(header,156) ? (read_bool(header,128) ? TM_PRED : H_PRED) : (read_bool(header,163) ? V_PRED : DC_PRED);
+        mb->y_mode = mode;
+        // Subblocks next to this macroblock see its mode as theirs
+        memset(top,mode,4);
+        memset(left,mode,4);
+    } else {
+        for(int y = 0; y < 4; y++) {
+            for(int x = 0; x < 4; x++) {
+                const uint8_t* probs = vp8_subblock_mode_probs[top[x]][left[y]];
+                int i = subblock_mode_tree[read_bool(header,probs[0])];
+                while(i > 0) i = subblock_mode_tree[2*i + read_bool(header,probs[i])];
+                mb->modes[4*y+x] = top[x] = left[y] = -i;
+            }
+        }
+    }
+    mb->uv_mode = !read_bool(header,142) ? DC_PRED : !read_bool(header,114) ? V_PRED : read_bool(header,183) ? TM_PRED : H_PRED;
+}
+
+// Values from 5 up: the token says how many extra bits follow
+static int read_large_value(struct bool_decoder* tokens, const uint8_t* p) {
+    if(!read_bool(tokens,p[3])) {
+        if(!read_bool(tokens,p[4])) return 2;
+        return 3 + read_bool(tokens,p[5]);
+    }
+    if(!read_bool(tokens,p[6])) {
+        if(!read_bool(tokens,p[7])) return 5 + read_bool(tokens,159);
+        return 7 + 2*read_bool(tokens,165) + read_bool(tokens,145);
+    }
+    int high = read_bool(tokens,p[8]);
+    int category = 2*high + read_bool(tokens,p[9+high]);
+    int value = 0;
+    for(const uint8_t* extra = category_probs[category]; *extra; extra++) {
+        value = 2*value + read_bool(tokens,*extra);
+    }
+    return value + 3 + (8 << category);
+}
+
+// Reads the tokens of one block from position first, dequantising them into out in raster
+// order. Returns one past the last position read, which is first when the block is empty.
+static int read_coefficients(struct bool_decoder* tokens, const uint8_t (*probs)[3][11], int context, const int16_t* quant, int first, int16_t* out) {
+    const uint8_t* p = probs[coefficient_bands[first]][context];
+    for(int n = first; n < 16; n++) {
+        if(!read_bool(tokens,p[0])) return n;
+        // No end of block can follow a zero, so runs of them are read without checking for one
+        while(!read_bool(tokens,p[1])) {
+            p = probs[coefficient_bands[++n]][0];
+            if(n == 16) return 16;
+        }
+        int value;
+        if(!read_bool(tokens,p[2])) {
+            value = 1;
+            p = probs[coefficient_bands[n+1]][1];
+        } else {
+            value = read_large_value(tokens,p);
+            p = probs[coefficient_bands[n+1]][2];
+        }
+        out[zigzag[n]] = (read_bool(tokens,128) ? -value : value) * quant[n > 0];
+    }
+    return 16;
+}
+
+// Walsh-Hadamard transform of the luma DCs, putting each at the start of its block
+static void inverse_wht(const int16_t* in, int16_t* out) {
+    int tmp[16];
+    for(int i = 0; i < 4; i++) {
+        int a0 = in[i] + in[12+i];
+        int a1 = in[4+i] + in[8+i];
+        int a2 = in[4+i] - in[8+i];
+        int a3 = in[i] - in[12+i];
+        tmp[i] = a0 + a1;
+        tmp[8+i] = a0 - a1;
+        tmp[4+i] = a3 + a2;
+        tmp[12+i] = a3 - a2;
+    }
+    for(int i = 0; i < 4; i++) {
+        int dc = tmp[4*i] + 3;
+        int a0 = dc + tmp[4*i+3];
+        int a1 = tmp[4*i+1] + tmp[4*i+2];
+        int a2 = tmp[4*i+1] - tmp[4*i+2];
+        int a3 = dc - tmp[4*i+3];
+        out[16*(4*i)] = (a0 + a1) >> 3;
+        out[16*(4*i+1)] = (a3 + a2) >> 3;
+        out[16*(4*i+2)] = (a0 - a1) >> 3;
+        out[16*(4*i+3)] = (a3 - a2) >> 3;
+    }
+}
+
+// Non-zero contexts are 4 luma columns or rows, then 2 each for u and v, then the Y2 block
+static void read_residuals(struct vp8_decoder* decoder, struct vp8_macroblock* mb, struct bool_decoder* tokens, uint8_t* top, uint8_t* left) {
+    const struct vp8_segment* segment = &decoder->segments[mb->segment];
+    int16_t* coefficients = decoder->coefficients;
+    const uint8_t (*luma_probs)[3][11] = decoder->coefficient_probs[3];
+    int first = 0;
+    uint32_t coded = 0;
+    bool any = false;
+    if(!mb->subblocks) {
+        // The DCs of all 16 luma blocks come together in a block of their own
+        int16_t dc[16] = {0};
+        int end = read_coefficients(tokens,decoder->coefficient_probs[1],top[8]+left[8],segment->y2_quant,0,dc);
+        top[8] = left[8] = end > 0;
+        if(end > 0) {
+            inverse_wht(dc,coefficients);
+            any = true;
+        }
+        luma_probs = decoder->coefficient_probs[0];
+        first = 1;
+    }
+    for(int y = 0; y < 4; y++) {
+        for(int x = 0; x < 4; x++) {
+            int16_t* block = coefficients + 16*(4*y+x);
+            int end = read_coefficients(tokens,luma_probs,top[x]+left[y],segment->y_quant,first,block);
+            top[x] = left[y] = end > first;
+            any |= end > first;
+            if(end > first || block[0] != 0) coded |= 1 << (4*y+x);
+        }
+    }
+    for(int plane = 0; plane < 2; plane++) {
+        for(int y = 0; y < 2; y++) {
+            for(int x = 0; x < 2; x++) {
+                uint8_t* t = top + 4 + 2*plane + x;
+                uint8_t* l = left + 4 + 2*plane + y;
+                int end = read_coefficients(tokens,decoder->coefficient_probs[2],*t+*l,segment->uv_quant,0,coefficients+256+64*plane+16*(2*y+x));
+                *t = *l = end > 0;
+                if(end > 0) {
+                    any = true;
+                    coded |= 1 << (16 + 4*plane + 2*y + x);
+                }
+            }
+        }
+    }
+    mb->coded_blocks = coded;
+    mb->has_coefficients = any;
+}
+
+#define AVG2(a,b) (((a) + (b) + 1) >> 1)
+#define AVG3(a,b,c) (((a) + 2*(b) + (c) + 2) >> 2)
+#define DST(x,y) dst[(x) + (y)*VP8_BPS]
+
+static void predict_true_motion(uint8_t* dst, int size) {
+    const uint8_t* top = dst - VP8_BPS;
+    for(int y = 0; y < size; y++) {
+        int left = dst[y*VP8_BPS-1] - top[-1];
+        for(int x = 0; x < size; x++) DST(x,y) = clip_pixel(left + top[x]);
+    }
+}
+
+// Whole macroblock luma and chroma prediction. Only DC looks at where the frame edges are,
+// the rest predicting from the 127 and 129 filled in beyond them.
+static void predict_block(uint8_t* dst, int size, uint8_t mode, bool has_top, bool has_left) {
+    int log2_size = size == 16 ? 4 : 3;
+    switch(mode) {
+        case DC_PRED: {
+            int sum = 0, dc = 128;
+            for(int i = 0; i < size; i++) {
+                if(has_top) sum += dst[i-VP8_BPS];
+                if(has_left) sum += dst[i*VP8_BPS-1];
+            }
+            if(has_top && has_left) dc = (sum + size) >> (log2_size + 1);
+            else if(has_top || has_left) dc = (sum + size/2) >> log2_size;
+            for(int y = 0; y < size; y++) memset(dst+y*VP8_BPS,dc,size);
+        }; break;
+        case TM_PRED:
+            predict_true_motion(dst,size);
+            break;
+        case V_PRED:
+            for(int y = 0; y < size; y++) memcpy(dst+y*VP8_BPS,dst-VP8_BPS,size);
+            break;
+        case H_PRED:
+            for(int y = 0; y < size; y++) memset(dst+y*VP8_BPS,dst[y*VP8_BPS-1],size);
+            break;
+    }
+}
+
+static void predict_subblock(uint8_t* dst, uint8_t mode) {
+    const uint8_t* top = dst - VP8_BPS;
+    int X = top[-1], A = top[0], B = top[1], C = top[2], D = top[3];
+    int E = top[4], F = top[5], G = top[6], H = top[7];
+    int I = DST(-1,0), J = DST(-1,1), K = DST(-1,2), L = DST(-1,3);
+    switch(mode) {
+        case DC_PRED: {
+            int dc = (A + B + C + D + I + J + K + L + 4) >> 3;
+            for(int y = 0; y < 4; y++) memset(dst+y*VP8_BPS,dc,4);
+        }; break;
+        case TM_PRED:
+            predict_true_motion(dst,4);
+            break;
+        case V_PRED: {
+            uint8_t row[4] = {AVG3(X,A,B), AVG3(A,B,C), AVG3(B,C,D), AVG3(C,D,E)};
+            for(int y = 0; y < 4; y++) memcpy(dst+y*VP8_BPS,row,4);
+        }; break;
+        case H_PRED:
+            memset(dst,AVG3(X,I,J),4);
+            memset(dst+VP8_BPS,AVG3(I,J,K),4);
+            memset(dst+2*VP8_BPS,AVG3(J,K,L),4);
+            memset(dst+3*VP8_BPS,AVG3(K,L,L),4);
+            break;
+        case RD_PRED: {
+            // Down and to the right along the left column, the corner and the top row
+            int edge[9] = {L, K, J, I, X, A, B, C, D};
+            for(int y = 0; y < 4; y++) {
+                for(int x = 0; x < 4; x++) DST(x,y) = AVG3(edge[3-y+x],edge[4-y+x],edge[5-y+x]);
+            }
+        }; break;
+        case LD_PRED:
+            for(int y = 0; y < 4; y++) {
+                for(int x = 0; x < 4; x++) {
+                    int i = x + y;
+                    DST(x,y) = AVG3(top[i],top[i+1],top[i < 6 ? i+2 : 7]);
+                }
+            }
+            break;
+        case VR_PRED:
+            DST(0,0) = DST(1,2) = AVG2(X,A);
+            DST(1,0) = DST(2,2) = AVG2(A,B);
+            DST(2,0) = DST(3,2) = AVG2(B,C);
+            DST(3,0) = AVG2(C,D);
+            DST(0,3) = AVG3(K,J,I);
+            DST(0,2) = AVG3(J,I,X);
+            DST(0,1) = DST(1,3) = AVG3(I,X,A);
+            DST(1,1) = DST(2,3) = AVG3(X,A,B);
+            DST(2,1) = DST(3,3) = AVG3(A,B,C);
+            DST(3,1) = AVG3(B,C,D);
+            break;
+        case VL_PRED:
+            DST(0,0) = AVG2(A,B);
+            DST(1,0) = DST(0,2) = AVG2(B,C);
+            DST(2,0) = DST(1,2) = AVG2(C,D);
+            DST(3,0) = DST(2,2) = AVG2(D,E);
+            DST(0,1) = AVG3(A,B,C);
+            DST(1,1) = DST(0,3) = AVG3(B,C,D);
+            DST(2,1) = DST(1,3) = AVG3(C,D,E);
+            DST(3,1) = DST(2,3) = AVG3(D,E,F);
+            DST(3,2) = AVG3(E,F,G);
+            DST(3,3) = AVG3(F,G,H);
+            break;
+        case HD_PRED:
+            DST(0,0) = DST(2,1) = AVG2(I,X);
+            DST(0,1) = DST(2,2) = AVG2(J,I);
+            DST(0,2) = DST(2,3) = AVG2(K,J);
+            DST(0,3) = AVG2(L,K);
+            DST(3,0) = AVG3(A,B,C);
+            DST(2,0) = AVG3(X,A,B);
+            DST(1,0) = DST(3,1) = AVG3(I,X,A);
+            DST(1,1) = DST(3,2) = AVG3(J,I,X);
+            DST(1,2) = DST(3,3) = AVG3(K,J,I);
+            DST(1,3) = AVG3(L,K,J);
+            break;
+        case HU_PRED:
+            DST(0,0) = AVG2(I,J);
+            DST(2,0) = DST(0,1) = AVG2(J,K);
+            DST(2,1) = DST(0,2) = AVG2(K,L);
+            DST(1,0) = AVG3(I,J,K);
+            DST(3,0) = DST(1,1) = AVG3(J,K,L);
+            DST(3,1) = DST(1,2) = AVG3(K,L,L);
+            DST(3,2) = DST(2,2) = DST(0,3) = DST(1,3) = DST(2,3) = DST(3,3) = L;
+            break;
+    }
+}
+
+static void reconstruct_macroblock(struct vp8_decoder* decoder, const struct vp8_macroblock* mb, uint32_t mb_x, uint32_t mb_y) {
+    uint8_t* y_dst = decoder->work + Y_OFFSET;
+    uint8_t* u_dst = decoder->work + U_OFFSET;
+    uint8_t* v_dst = decoder->work + V_OFFSET;
+    const struct vp8_kernels* kernels = decoder->kernels;
+
+    // The left column, corner included, is what the previous macroblock left on its right
+    if(mb_x > 0) {
+        for(int j = -1; j < 16; j++) memcpy(y_dst+j*VP8_BPS-4,y_dst+j*VP8_BPS+12,4);
+        for(int j = -1; j < 8; j++) {
+            memcpy(u_dst+j*VP8_BPS-4,u_dst+j*VP8_BPS+4,4);
+            memcpy(v_dst+j*VP8_BPS-4,v_dst+j*VP8_BPS+4,4);
+        }
+    } else {
+        for(int j = 0; j < 16; j++) y_dst[j*VP8_BPS-1] = 129;
+        for(int j = 0; j < 8; j++) u_dst[j*VP8_BPS-1] = v_dst[j*VP8_BPS-1] = 129;
+        if(mb_y > 0) {
+            y_dst[-VP8_BPS-1] = u_dst[-VP8_BPS-1] = v_dst[-VP8_BPS-1] = 129;
+        } else {
+            // The first row stays 127 along the top, top right included
+            memset(y_dst-VP8_BPS-1,127,16+4+1);
+            memset(u_dst-VP8_BPS-1,127,8+1);
+            memset(v_dst-VP8_BPS-1,127,8+1);
+        }
+    }
+    if(mb_y > 0) {
+        memcpy(y_dst-VP8_BPS,decoder->top_y+16*mb_x,16);
+        memcpy(u_dst-VP8_BPS,decoder->top_u+8*mb_x,8);
+        memcpy(v_dst-VP8_BPS,decoder->top_v+8*mb_x,8);
+    }
+
+    const int16_t* coefficients = decoder->coefficients;
+    uint32_t coded = mb->coded_blocks;
+    if(mb->subblocks) {
+        uint8_t* top_right = y_dst - VP8_BPS + 16;
+        if(mb_y > 0) {
+            if(mb_x + 1 < decoder->mb_width) memcpy(top_right,decoder->top_y+16*mb_x+16,4);
+            else memset(top_right,decoder->top_y[16*mb_x+15],4);
+        }
+        // Subblocks down the right hand side all see the pixels above and right of the macroblock
+        for(int j = 4; j < 16; j += 4) memcpy(top_right+j*VP8_BPS,top_right,4);
+        for(int n = 0; n < 16; n++) {
+            uint8_t* dst = y_dst + (n>>2)*4*VP8_BPS + (n&3)*4;
+            predict_subblock(dst,mb->modes[n]);
+            if(coded & (1 << n)) kernels->transform(coefficients+16*n,dst,1);
+        }
+    } else {
+        predict_block(y_dst,16,mb->y_mode,mb_y > 0,mb_x > 0);
+        for(int row = 0; row < 4; row++) {
+            if((coded >> (4*row)) & 0xf) kernels->transform(coefficients+64*row,y_dst+4*row*VP8_BPS,4);
+        }
+    }
+    predict_block(u_dst,8,mb->uv_mode,mb_y > 0,mb_x > 0);
+    predict_block(v_dst,8,mb->uv_mode,mb_y > 0,mb_x > 0);
+    for(int row = 0; row < 2; row++) {
+        if((coded >> (16+2*row)) & 3) kernels->transform(coefficients+256+32*row,u_dst+4*row*VP8_BPS,2);
+        if((coded >> (20+2*row)) & 3) kernels->transform(coefficients+320+32*row,v_dst+4*row*VP8_BPS,2);
+    }
+
+    uint8_t* y_out = decoder->y_plane + (size_t)16*mb_y*decoder->y_stride + 16*mb_x;
+    uint8_t* u_out = decoder->u_plane + (size_t)8*mb_y*decoder->uv_stride + 8*mb_x;
+    uint8_t* v_out = decoder->v_plane + (size_t)8*mb_y*decoder->uv_stride + 8*mb_x;
+    for(int j = 0; j < 16; j++) memcpy(y_out+j*decoder->y_stride,y_dst+j*VP8_BPS,16);
+    for(int j = 0; j < 8; j++) {
+        memcpy(u_out+j*decoder->uv_stride,u_dst+j*VP8_BPS,8);
+        memcpy(v_out+j*decoder->uv_stride,v_dst+j*VP8_BPS,8);
+    }
+    memcpy(decoder->top_y+16*mb_x,y_dst+15*VP8_BPS,16);
+    memcpy(decoder->top_u+8*mb_x,u_dst+7*VP8_BPS,8);
+    memcpy(decoder->top_v+8*mb_x,v_dst+7*VP8_BPS,8);
+}
+
+static void decode_macroblock(struct vp8_decoder* decoder, uint32_t mb_x, uint32_t mb_y) {
+    struct vp8_macroblock mb;
+    read_macroblock_header(decoder,&mb,mb_x);
+    struct bool_decoder* tokens = &decoder->partitions[mb_y & (decoder->partition_count-1)];
+    uint8_t* top_nonzero = decoder->top_nonzero[mb_x];
+    memset(decoder->coefficients,0,sizeof(decoder->coefficients));
+    if(!mb.skip) {
+        read_residuals(decoder,&mb,tokens,top_nonzero,decoder->left_nonzero);
+        assert(!tokens->eof,"Error: truncated VP8 partition");
+    } else {
+        // A skipped macroblock without a Y2 block leaves the Y2 context to the next one that has
+        memset(top_nonzero,0,8);
+        memset(decoder->left_nonzero,0,8);
+        if(!mb.subblocks) top_nonzero[8] = decoder->left_nonzero[8] = 0;
+        mb.coded_blocks = 0;
+        mb.has_coefficients = false;
+    }
+    if(decoder->filtering) {
+        struct vp8_filter filter = decoder->segments[mb.segment].filters[mb.subblocks];
+        filter.inner |= mb.has_coefficients;
+        decoder->filters[mb_x] = filter;
+    }
+    reconstruct_macroblock(decoder,&mb,mb_x,mb_y);
+}
+
+// Each macroblock is filtered once the row is done, left edge first, which only ever reaches
+// back 3 pixels into the row above
+static void filter_macroblock_row(struct vp8_decoder* decoder, uint32_t mb_y) {
+    const struct vp8_kernels* kernels = decoder->kernels;
+    int y_stride = decoder->y_stride, uv_stride = decoder->uv_stride;
+    for(uint32_t mb_x = 0; mb_x < decoder->mb_width; mb_x++) {
+        struct vp8_filter filter = decoder->filters[mb_x];
+        if(filter.limit == 0) continue;
+        uint8_t* y = decoder->y_plane + (size_t)16*mb_y*y_stride + 16*mb_x;
+        uint8_t* u = decoder->u_plane + (size_t)8*mb_y*uv_stride + 8*mb_x;
+        uint8_t* v = decoder->v_plane + (size_t)8*mb_y*uv_stride + 8*mb_x;
+        if(decoder->simple_filter) {
+            if(mb_x > 0) kernels->simple_mb_left(y,y_stride,filter.limit+4);
+            if(filter.inner) kernels->simple_inner_left(y,y_stride,filter.limit);
+            if(mb_y > 0) kernels->simple_mb_above(y,y_stride,filter.limit+4);
+            if(filter.inner) kernels->simple_inner_above(y,y_stride,filter.limit);
+        } else {
+            if(mb_x > 0) kernels->mb_left(y,u,v,y_stride,uv_stride,filter.limit+4,filter.interior,filter.hev_thresh);
+            if(filter.inner) kernels->inner_left(y,u,v,y_stride,uv_stride,filter.limit,filter.interior,filter.hev_thresh);
+            if(mb_y > 0) kernels->mb_above(y,u,v,y_stride,uv_stride,filter.limit+4,filter.interior,filter.hev_thresh);
+            if(filter.inner) kernels->inner_above(y,u,v,y_stride,uv_stride,filter.limit,filter.interior,filter.hev_thresh);
+        }
+    }
+}
+
+// YUV to RGB in the same fixed point steps libwebp takes, with 6 fractional bits
+static inline int mult_hi(int v, int coeff) {
+    return (v * coeff) >> 8;
+}
+static inline uint32_t clip_yuv(int v) {
+    return (v & ~16383) == 0 ? v >> 6 : v < 0 ? 0 : 255;
+}
+static inline pixel_t yuv_to_argb(int y, int u, int v) {
+    int luma = mult_hi(y,19077);
+    uint32_t r = clip_yuv(luma + mult_hi(v,26149) - 14234);
+    uint32_t g = clip_yuv(luma - mult_hi(u,6419) - mult_hi(v,13320) + 8708);
+    uint32_t b = clip_yuv(luma + mult_hi(u,33050) - 17685);
+    return 0xff000000 | r<<16 | g<<8 | b;
+}
+
+// Chroma is upsampled with 9-3-3-1 weights between the nearer and further chroma rows and
+// columns. U and v are worked on together, packed into the two halves of a word.
+static void convert_row(const struct vp8_decoder* decoder, uint32_t y, pixel_t* out) {
+    uint32_t chroma_rows = (decoder->height + 1) / 2;
+    uint32_t near = y >> 1;
+    uint32_t far = y & 1 ? (near + 1 < chroma_rows ? near + 1 : near) : (near > 0 ? near - 1 : 0);
+    const uint8_t* luma = decoder->y_plane + (size_t)y*decoder->y_stride;
+    const uint8_t* near_u = decoder->u_plane + (size_t)near*decoder->uv_stride;
+    const uint8_t* near_v = decoder->v_plane + (size_t)near*decoder->uv_stride;
+    const uint8_t* far_u = decoder->u_plane + (size_t)far*decoder->uv_stride;
+    const uint8_t* far_v = decoder->v_plane + (size_t)far*decoder->uv_stride;
+    uint32_t width = decoder->width;
+
+    uint32_t near_left = near_u[0] | near_v[0]<<16;
+    uint32_t far_left = far_u[0] | far_v[0]<<16;
+    uint32_t uv = (3*near_left + far_left + 0x00020002) >> 2;
+    out[0] = yuv_to_argb(luma[0],uv & 0xff,uv >> 16);
+    for(uint32_t x = 1; x <= (width - 1) >> 1; x++) {
+        uint32_t near_right = near_u[x] | near_v[x]<<16;
+        uint32_t far_right = far_u[x] | far_v[x]<<16;
+        uint32_t sum = near_left + near_right + far_left + far_right + 0x00080008;
+        uint32_t diag_12 = (sum + 2*(near_right + far_left)) >> 3;
+        uint32_t diag_03 = (sum + 2*(near_left + far_right)) >> 3;
+        uint32_t uv0 = (diag_12 + near_left) >> 1;
+        uint32_t uv1 = (diag_03 + near_right) >> 1;
+        out[2*x-1] = yuv_to_argb(luma[2*x-1],uv0 & 0xff,uv0 >> 16);
+        out[2*x] = yuv_to_argb(luma[2*x],uv1 & 0xff,uv1 >> 16);
+        near_left = near_right;
+        far_left = far_right;
+    }
+    if(!(width & 1)) {
+        uv = (3*near_left + far_left + 0x00020002) >> 2;
+        out[width-1] = yuv_to_argb(luma[width-1],uv & 0xff,uv >> 16);
+    }
+}
+
+// Converts the rows up to y_end and hands them out, as finish_rows does for VP8L
+static void emit_rows(struct vp8_decoder* decoder, uint32_t y_end) {
+    while(decoder->rows_done < y_end) {
+        uint32_t y = decoder->rows_done;
+        uint32_t row_count = y_end - y < VP8_BAND_ROWS ? y_end - y : VP8_BAND_ROWS;
+        pixel_t* rows = decoder->band;
+        uint32_t stride = decoder->width;
+        if(decoder->output != NULL) {
+            rows = decoder->output + (size_t)y*decoder->output_stride;
+            stride = decoder->output_stride;
+        }
+        for(uint32_t i = 0; i < row_count; i++) convert_row(decoder,y+i,rows+i*stride);
+        if(decoder->callback != NULL) decoder->callback(decoder->user,rows,stride,y,row_count);
+        decoder->rows_done += row_count;
+    }
+}
+
+// Decodes a whole VP8 key frame into opaque ARGB, going into output when it is set and
+// otherwise through an internal band, with each run of rows passed to callback if there is one.
+// Working memory comes from arena, so nothing is left behind if decoding fails part way.
+void decode_vp8(const uint8_t* data, size_t size, pixel_t* output, uint32_t output_stride, webp_row_callback callback, void* user, struct arena* arena) {
+    struct vp8_decoder* decoder = arena_alloc(arena,sizeof(struct vp8_decoder));
+    memset(decoder,0,sizeof(*decoder));
+    read_frame_header(decoder,data,size);
+    decoder->kernels = get_vp8_kernels();
+    decoder->output = output;
+    decoder->output_stride = output_stride;
+    decoder->callback = callback;
+    decoder->user = user;
+    uint32_t mb_width = decoder->mb_width = ceil_div(decoder->width,16);
+    uint32_t mb_height = decoder->mb_height = ceil_div(decoder->height,16);
+    decoder->y_stride = 16*mb_width;
+    decoder->uv_stride = 8*mb_width;
+    decoder->y_plane = arena_alloc(arena,(size_t)decoder->y_stride*16*mb_height);
+    decoder->u_plane = arena_alloc(arena,(size_t)decoder->uv_stride*8*mb_height);
+    decoder->v_plane = arena_alloc(arena,(size_t)decoder->uv_stride*8*mb_height);
+    decoder->top_y = arena_alloc(arena,32*mb_width);
+    decoder->top_modes = arena_alloc(arena,4*mb_width);
+    decoder->top_nonzero = arena_alloc(arena,mb_width*sizeof(*decoder->top_nonzero));
+    decoder->filters = arena_alloc(arena,mb_width*sizeof(struct vp8_filter));
+    memset(decoder->top_modes,0,4*mb_width);
+    memset(decoder->top_nonzero,0,mb_width*sizeof(*decoder->top_nonzero));
+    memset(decoder->filters,0,mb_width*sizeof(struct vp8_filter));
+    decoder->top_u = decoder->top_y + 16*mb_width;
+    decoder->top_v = decoder->top_u + 8*mb_width;
+    if(output == NULL) decoder->band = arena_alloc(arena,sizeof(pixel_t)*decoder->width*VP8_BAND_ROWS);
+
+    for(uint32_t mb_y = 0; mb_y < mb_height; mb_y++) {
+        memset(decoder->left_modes,DC_PRED,sizeof(decoder->left_modes));
+        memset(decoder->left_nonzero,0,sizeof(decoder->left_nonzero));
+        for(uint32_t mb_x = 0; mb_x < mb_width; mb_x++) {
+            decode_macroblock(decoder,mb_x,mb_y);
+        }
+        assert(!decoder->header.eof,"Error: truncated VP8 frame header");
+        if(decoder->filtering) filter_macroblock_row(decoder,mb_y);
+        // Filtering the next row can still change the 3 rows above it, and chroma upsampling
+        // reaches one chroma row further
+        uint32_t y_end = mb_y + 1 == mb_height ? decoder->height : 16*mb_y + 8;
+        if(y_end > decoder->height) y_end = decoder->height;
+        emit_rows(decoder,y_end);
+    }
+}
+
+// Alpha rows are coded as differences from a prediction, with the first row and column
+// falling back to whichever neighbour they have
+static void unfilter_alpha(uint8_t* alpha, uint32_t width, uint32_t height, int filter) {
+    for(uint32_t y = 0; y < height; y++) {
+        uint8_t* row = alpha + (size_t)y*width;
+        const uint8_t* above = y > 0 ? row - width : NULL;
+        if(above == NULL || filter == 1) {
+            uint8_t left = above != NULL ? above[0] : 0;
+            for(uint32_t x = 0; x < width; x++) left = row[x] += left;
+        } else if(filter == 2) {
+            for(uint32_t x = 0; x < width; x++) row[x] += above[x];
+        } else {
+            uint8_t left = above[0], top_left = above[0];
+            for(uint32_t x = 0; x < width; x++) {
+                left = row[x] += clip_pixel(left + above[x] - top_left);
+                top_left = above[x];
+            }
+        }
+    }
+}
+
+// Fills in the alpha of a decoded lossy image, rows stride pixels apart, from its ALPH chunk.
+// Working memory comes from arena, and a compressed plane is decoded with alpha_decoder.
+void apply_alpha_chunk(const uint8_t* data, size_t size, pixel_t* pixels, uint32_t stride, uint32_t width, uint32_t height, struct arena* arena, struct webp_decoder* alpha_decoder) {
+    assert(size >= 1,"Error: invalid ALPH chunk");
+    int compression = data[0] & 3, filter = (data[0] >> 2) & 3;
+    assert(compression <= 1 && (data[0] >> 6) == 0,"Error: invalid ALPH chunk");
+    size_t pixel_count = (size_t)width*height;
+    uint8_t* alpha = arena_alloc(arena,pixel_count);
+    if(compression == 0) {
+        assert(size - 1 >= pixel_count,"Error: ALPH chunk too small");
+        memcpy(alpha,data+1,pixel_count);
+    } else {
+        // A VP8L stream without its header, alpha being in the green channel. One is made up
+        // so that it goes through the normal decoder.
+        uint8_t* stream = arena_alloc(arena,size+4);
+        uint32_t header = (width-1) | (height-1)<<14;
+        stream[0] = 0x2f;
+        memcpy(stream+1,&header,4);
+        memcpy(stream+5,data+1,size-1);
+        pixel_t* green = arena_alloc(arena,sizeof(pixel_t)*pixel_count);
+        reset_webp_decoder(alpha_decoder,size+4,NULL,NULL);
+        alpha_decoder->output = green;
+        alpha_decoder->output_stride = width;
+        assert(webp_decoder_append(alpha_decoder,stream,size+4)==WEBP_STATUS_DONE,"Error: unexpected end of alpha");
+        for(size_t i = 0; i < pixel_count; i++) alpha[i] = green[i] >> 8;
+    }
+    // Pre-processing only ever reduced the levels to help compression, so needs no undoing
+    if(filter != 0) unfilter_alpha(alpha,width,height,filter);
+    for(uint32_t y = 0; y < height; y++) {
+        pixel_t* row = pixels + (size_t)y*stride;
+        const uint8_t* alpha_row = alpha + (size_t)y*width;
+        for(uint32_t x = 0; x < width; x++) row[x] = (row[x] & 0x00ffffff) | (pixel_t)alpha_row[x] << 24;
+    }
+}
@@ -0,0 +1,567 @@
+#include "webp_decoder.h"
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+static inline uint8_t clip_pixel(int v) {
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+static inline int clamp_signed(int v, int low, int high) {
+    return v < low ? low : v > high ? high : v;
+}
+
+// The spec's fixed point sqrt(2)*cos(pi/8) and sqrt(2)*sin(pi/8), the first stored less one
+#define MUL_COS(a) ((((a) * 20091) >> 16) + (a))
+#define MUL_SIN(a) (((a) * 35468) >> 16)
+
+// Columns first, then rows, adding the result to the prediction already in dst
+static void transform_block_c(const int16_t* in, uint8_t* dst) {
+    int tmp[16];
+    for(int i = 0; i < 4; i++) {
+        int a = in[i] + in[8+i];
+        int b = in[i] - in[8+i];
+        int c = MUL_SIN(in[4+i]) - MUL_COS(in[12+i]);
+        int d = MUL_COS(in[4+i]) + MUL_SIN(in[12+i]);
+        tmp[i] = a + d;
+        tmp[4+i] = b + c;
+        tmp[8+i] = b - c;
+        tmp[12+i] = a - d;
+    }
+    for(int i = 0; i < 4; i++) {
+        const int* row = tmp + 4*i;
+        int dc = row[0] + 4;
+        int a = dc + row[2];
+        int b = dc - row[2];
+        int c = MUL_SIN(row[1]) - MUL_COS(row[3]);
+        int d = MUL_COS(row[1]) + MUL_SIN(row[3]);
+        uint8_t* out = dst + i*VP8_BPS;
+        out[0] = clip_pixel(out[0] + ((a + d) >> 3));
+        out[1] = clip_pixel(out[1] + ((b + c) >> 3));
+        out[2] = clip_pixel(out[2] + ((b - c) >> 3));
+        out[3] = clip_pixel(out[3] + ((a - d) >> 3));
+    }
+}
+static void transform_c(const int16_t* coeffs, uint8_t* dst, int blocks) {
+    for(int i = 0; i < blocks; i++) transform_block_c(coeffs+16*i,dst+4*i);
+}
+
+// Every loop filter takes p pointing at q0, the first pixel past the edge, and step crossing it
+static inline bool needs_filter(const uint8_t* p, int step, int limit) {
+    int p1 = p[-2*step], p0 = p[-step], q0 = p[0], q1 = p[step];
+    return 2*abs(p0-q0) + (abs(p1-q1) >> 1) <= limit;
+}
+static inline bool needs_normal_filter(const uint8_t* p, int step, int limit, int interior) {
+    if(!needs_filter(p,step,limit)) return false;
+    int p3 = p[-4*step], p2 = p[-3*step], p1 = p[-2*step], p0 = p[-step];
+    int q0 = p[0], q1 = p[step], q2 = p[2*step], q3 = p[3*step];
+    return abs(p3-p2) <= interior && abs(p2-p1) <= interior && abs(p1-p0) <= interior &&
+        abs(q3-q2) <= interior && abs(q2-q1) <= interior && abs(q1-q0) <= interior;
+}
+static inline bool high_edge_variance(const uint8_t* p, int step, int thresh) {
+    return abs(p[-2*step]-p[-step]) > thresh || abs(p[step]-p[0]) > thresh;
+}
+// Moves p0 and q0 towards each other, taking p1 and q1 into account
+static inline void filter_2(uint8_t* p, int step) {
+    int p1 = p[-2*step], p0 = p[-step], q0 = p[0], q1 = p[step];
+    int a = 3*(q0-p0) + clamp_signed(p1-q1,-128,127);
+    int a1 = clamp_signed((a+4) >> 3,-16,15);
+    int a2 = clamp_signed((a+3) >> 3,-16,15);
+    p[-step] = clip_pixel(p0+a2);
+    p[0] = clip_pixel(q0-a1);
+}
+// Subblock edges without high variance also move p1 and q1, by half as much
+static inline void filter_4(uint8_t* p, int step) {
+    int p1 = p[-2*step], p0 = p[-step], q0 = p[0], q1 = p[step];
+    int a = 3*(q0-p0);
+    int a1 = clamp_signed((a+4) >> 3,-16,15);
+    int a2 = clamp_signed((a+3) >> 3,-16,15);
+    int a3 = (a1+1) >> 1;
+    p[-2*step] = clip_pixel(p1+a3);
+    p[-step] = clip_pixel(p0+a2);
+    p[0] = clip_pixel(q0-a1);
+    p[step] = clip_pixel(q1-a3);
+}
+// Macroblock edges without high variance spread the adjustment over three pixels each side
+static inline void filter_6(uint8_t* p, int step) {
+    int p2 = p[-3*step], p1 = p[-2*step], p0 = p[-step], q0 = p[0], q1 = p[step], q2 = p[2*step];
+    int a = clamp_signed(3*(q0-p0) + clamp_signed(p1-q1,-128,127),-128,127);
+    int a1 = (27*a + 63) >> 7;
+    int a2 = (18*a + 63) >> 7;
+    int a3 = (9*a + 63) >> 7;
+    p[-3*step] = clip_pixel(p2+a3);
+    p[-2*step] = clip_pixel(p1+a2);
+    p[-step] = clip_pixel(p0+a1);
+    p[0] = clip_pixel(q0-a1);
+    p[step] = clip_pixel(q1-a2);
+    p[2*step] = clip_pixel(q2-a3);
+}
+
+// Filters count pixels along an edge, pitch apart
+static void simple_edge_c(uint8_t* p, int step, int pitch, int limit) {
+    for(int i = 0; i < 16; i++, p += pitch) {
+        if(needs_filter(p,step,limit)) filter_2(p,step);
+    }
+}
+static void normal_edge_c(uint8_t* p, int step, int pitch, int count, int limit, int interior, int hev_thresh, bool mb_edge) {
+    for(int i = 0; i < count; i++, p += pitch) {
+        if(!needs_normal_filter(p,step,limit,interior)) continue;
+        if(high_edge_variance(p,step,hev_thresh)) filter_2(p,step);
+        else if(mb_edge) filter_6(p,step);
+        else filter_4(p,step);
+    }
+}
+
+static void simple_mb_left_c(uint8_t* y, int stride, int limit) {
+    simple_edge_c(y,1,stride,limit);
+}
+static void simple_mb_above_c(uint8_t* y, int stride, int limit) {
+    simple_edge_c(y,stride,1,limit);
+}
+static void simple_inner_left_c(uint8_t* y, int stride, int limit) {
+    for(int x = 4; x < 16; x += 4) simple_edge_c(y+x,1,stride,limit);
+}
+static void simple_inner_above_c(uint8_t* y, int stride, int limit) {
+    for(int row = 4; row < 16; row += 4) simple_edge_c(y+row*stride,stride,1,limit);
+}
+static void mb_left_c(uint8_t* y, uint8_t* u, uint8_t* v, int y_stride, int uv_stride, int limit, int interior, int hev_thresh) {
+    normal_edge_c(y,1,y_stride,16,limit,interior,hev_thresh,true);
+    normal_edge_c(u,1,uv_stride,8,limit,interior,hev_thresh,true);
+    normal_edge_c(v,1,uv_stride,8,limit,interior,hev_thresh,true);
+}
+static void mb_above_c(uint8_t* y, uint8_t* u, uint8_t* v, int y_stride, int uv_stride, int limit, int interior, int hev_thresh) {
+    normal_edge_c(y,y_stride,1,16,limit,interior,hev_thresh,true);
+    normal_edge_c(u,uv_stride,1,8,limit,interior,hev_thresh,true);
+    normal_edge_c(v,uv_stride,1,8,limit,interior,hev_thresh,true);
+}
+static void inner_left_c(uint8_t* y, uint8_t* u, uint8_t* v, int y_stride, int uv_stride, int limit, int interior, int hev_thresh) {
+    for(int x = 4; x < 16; x += 4) normal_edge_c(y+x,1,y_stride,16,limit,interior,hev_thresh,false);
+    normal_edge_c(u+4,1,uv_stride,8,limit,interior,hev_thresh,false);
+    normal_edge_c(v+4,1,uv_stride,8,limit,interior,hev_thresh,false);
+}
+static void inner_above_c(uint8_t* y, uint8_t* u, uint8_t* v, int y_stride, int uv_stride, int limit, int interior, int hev_thresh) {
+    for(int row = 4; row < 16; row += 4) normal_edge_c(y+row*y_stride,y_stride,1,16,limit,interior,hev_thresh,false);
+    normal_edge_c(u+4*uv_stride,uv_stride,1,8,limit,interior,hev_thresh,false);
+    normal_edge_c(v+4*uv_stride,uv_stride,1,8,limit,interior,hev_thresh,false);
+}
+
+#if defined(__SSE2__)
+#define AVX2 __attribute__((target("avx2")))
+#define load_16(p) _mm_loadu_si128((const __m128i*)(p))
+#define store_16(p,x) _mm_storeu_si128((__m128i*)(p),x)
+#define load_8(p) _mm_loadl_epi64((const __m128i*)(p))
+#define store_8(p,x) _mm_storel_epi64((__m128i*)(p),x)
+
+// The arithmetic is the same at either vector width, so it is written once and instantiated
+// for SSE2 and AVX2, working within 128-bit lanes. Each lane runs the IDCT on two 4x4 blocks
+// side by side, or the loop filter on 16 pixels along an edge.
+#define VP8_KERNELS(ATTR, VEC, MM, SI, S) \
+/* sqrt(2)*sin(pi/8) is above 1/2, so its multiplier wraps negative and a is added back */ \
+static inline ATTR VEC mul_cos_##S(VEC a) { \
+    return MM##_add_epi16(MM##_mulhi_epi16(a,MM##_set1_epi16(20091)),a); \
+} \
+static inline ATTR VEC mul_sin_##S(VEC a) { \
+    return MM##_add_epi16(MM##_mulhi_epi16(a,MM##_set1_epi16(35468-65536)),a); \
+} \
+static inline ATTR void idct_pass_##S(VEC* x0, VEC* x1, VEC* x2, VEC* x3) { \
+    VEC a = MM##_add_epi16(*x0,*x2); \
+    VEC b = MM##_sub_epi16(*x0,*x2); \
+    VEC c = MM##_sub_epi16(mul_sin_##S(*x1),mul_cos_##S(*x3)); \
+    VEC d = MM##_add_epi16(mul_cos_##S(*x1),mul_sin_##S(*x3)); \
+    *x0 = MM##_add_epi16(a,d); \
+    *x1 = MM##_add_epi16(b,c); \
+    *x2 = MM##_sub_epi16(b,c); \
+    *x3 = MM##_sub_epi16(a,d); \
+} \
+/* Transposes the 4x4 block in each 64-bit half */ \
+static inline ATTR void transpose_4x4_##S(VEC* x0, VEC* x1, VEC* x2, VEC* x3) { \
+    VEC a0 = MM##_unpacklo_epi16(*x0,*x1), a1 = MM##_unpacklo_epi16(*x2,*x3); \
+    VEC a2 = MM##_unpackhi_epi16(*x0,*x1), a3 = MM##_unpackhi_epi16(*x2,*x3); \
+    VEC b0 = MM##_unpacklo_epi32(a0,a1), b1 = MM##_unpackhi_epi32(a0,a1); \
+    VEC b2 = MM##_unpacklo_epi32(a2,a3), b3 = MM##_unpackhi_epi32(a2,a3); \
+    *x0 = MM##_unpacklo_epi64(b0,b2); \
+    *x1 = MM##_unpackhi_epi64(b0,b2); \
+    *x2 = MM##_unpacklo_epi64(b1,b3); \
+    *x3 = MM##_unpackhi_epi64(b1,b3); \
+} \
+/* Takes the rows of the coefficient blocks to the rows of their residuals */ \
+static inline ATTR void idct_##S(VEC x[4]) { \
+    idct_pass_##S(&x[0],&x[1],&x[2],&x[3]); \
+    transpose_4x4_##S(&x[0],&x[1],&x[2],&x[3]); \
+    x[0] = MM##_add_epi16(x[0],MM##_set1_epi16(4)); \
+    idct_pass_##S(&x[0],&x[1],&x[2],&x[3]); \
+    transpose_4x4_##S(&x[0],&x[1],&x[2],&x[3]); \
+    for(int i = 0; i < 4; i++) x[i] = MM##_srai_epi16(x[i],3); \
+} \
+static inline ATTR VEC abs_diff_##S(VEC a, VEC b) { \
+    return MM##_or_##SI(MM##_subs_epu8(a,b),MM##_subs_epu8(b,a)); \
+} \
+/* Arithmetic shift of signed bytes */ \
+static inline ATTR VEC shift_right_##S(VEC x, int n) { \
+    VEC lo = MM##_srai_epi16(MM##_unpacklo_epi8(x,x),8+n); \
+    VEC hi = MM##_srai_epi16(MM##_unpackhi_epi8(x,x),8+n); \
+    return MM##_packs_epi16(lo,hi); \
+} \
+static inline ATTR VEC edge_mask_##S(VEC p1, VEC p0, VEC q0, VEC q1, int limit) { \
+    VEC a = abs_diff_##S(p0,q0); \
+    VEC b = MM##_srli_epi16(MM##_and_##SI(abs_diff_##S(p1,q1),MM##_set1_epi8((char)0xfe)),1); \
+    VEC sum = MM##_adds_epu8(MM##_adds_epu8(a,a),b); \
+    return MM##_cmpeq_epi8(MM##_subs_epu8(sum,MM##_set1_epi8((char)limit)),MM##_setzero_##SI()); \
+} \
+static inline ATTR VEC normal_mask_##S(VEC p3, VEC p2, VEC p1, VEC p0, VEC q0, VEC q1, VEC q2, VEC q3, int limit, int interior) { \
+    VEC m = MM##_max_epu8(abs_diff_##S(p3,p2),abs_diff_##S(p2,p1)); \
+    m = MM##_max_epu8(m,abs_diff_##S(p1,p0)); \
+    m = MM##_max_epu8(m,abs_diff_##S(q3,q2)); \
+    m = MM##_max_epu8(m,abs_diff_##S(q2,q1)); \
+    m = MM##_max_epu8(m,abs_diff_##S(q1,q0)); \
+    VEC interior_ok = MM##_cmpeq_epi8(MM##_subs_epu8(m,MM##_set1_epi8((char)interior)),MM##_setzero_##SI()); \
+    return MM##_and_##SI(interior_ok,edge_mask_##S(p1,p0,q0,q1,limit)); \
+} \
+static inline ATTR VEC hev_mask_##S(VEC p1, VEC p0, VEC q0, VEC q1, int thresh) { \
+    VEC m = MM##_max_epu8(abs_diff_##S(p1,p0),abs_diff_##S(q1,q0)); \
+    VEC low = MM##_cmpeq_epi8(MM##_subs_epu8(m,MM##_set1_epi8((char)thresh)),MM##_setzero_##SI()); \
+    return MM##_xor_##SI(low,MM##_set1_epi8(-1)); \
+} \
+/* Below, pixels are flipped to signed bytes so that saturating arithmetic does the clamping */ \
+static inline ATTR VEC to_signed_##S(VEC x) { \
+    return MM##_xor_##SI(x,MM##_set1_epi8((char)0x80)); \
+} \
+/* clamp(clamp(p1 - q1) + 3*(q0 - p0)), with p1 - q1 only where outer is set */ \
+static inline ATTR VEC filter_value_##S(VEC p1, VEC p0, VEC q0, VEC q1, VEC outer) { \
+    VEC d = MM##_subs_epi8(q0,p0); \
+    VEC a = MM##_and_##SI(MM##_subs_epi8(p1,q1),outer); \
+    return MM##_adds_epi8(MM##_adds_epi8(MM##_adds_epi8(a,d),d),d); \
+} \
+static inline ATTR void adjust_edge_##S(VEC a, VEC* p0, VEC* q0) { \
+    *q0 = MM##_subs_epi8(*q0,shift_right_##S(MM##_adds_epi8(a,MM##_set1_epi8(4)),3)); \
+    *p0 = MM##_adds_epi8(*p0,shift_right_##S(MM##_adds_epi8(a,MM##_set1_epi8(3)),3)); \
+} \
+static inline ATTR VEC wide_tap_##S(VEC lo, VEC hi, int weight) { \
+    VEC w = MM##_set1_epi16(weight), round = MM##_set1_epi16(63); \
+    lo = MM##_srai_epi16(MM##_add_epi16(MM##_mullo_epi16(lo,w),round),7); \
+    hi = MM##_srai_epi16(MM##_add_epi16(MM##_mullo_epi16(hi,w),round),7); \
+    return MM##_packs_epi16(lo,hi); \
+} \
+static inline ATTR void simple_filter_##S(VEC p1, VEC* p0, VEC* q0, VEC q1, int limit) { \
+    VEC mask = edge_mask_##S(p1,*p0,*q0,q1,limit); \
+    VEC sp0 = to_signed_##S(*p0), sq0 = to_signed_##S(*q0); \
+    VEC a = filter_value_##S(to_signed_##S(p1),sp0,sq0,to_signed_##S(q1),mask); \
+    adjust_edge_##S(MM##_and_##SI(a,mask),&sp0,&sq0); \
+    *p0 = to_signed_##S(sp0); \
+    *q0 = to_signed_##S(sq0); \
+} \
+static inline ATTR void mb_filter_##S(VEC x[8], int limit, int interior, int hev_thresh) { \
+    VEC mask = normal_mask_##S(x[0],x[1],x[2],x[3],x[4],x[5],x[6],x[7],limit,interior); \
+    VEC hev = hev_mask_##S(x[2],x[3],x[4],x[5],hev_thresh); \
+    VEC sp2 = to_signed_##S(x[1]), sp1 = to_signed_##S(x[2]), sp0 = to_signed_##S(x[3]); \
+    VEC sq0 = to_signed_##S(x[4]), sq1 = to_signed_##S(x[5]), sq2 = to_signed_##S(x[6]); \
+    VEC a = filter_value_##S(sp1,sp0,sq0,sq1,MM##_set1_epi8(-1)); \
+    adjust_edge_##S(MM##_and_##SI(a,MM##_and_##SI(mask,hev)),&sp0,&sq0); \
+    VEC w = MM##_and_##SI(a,MM##_andnot_##SI(hev,mask)); \
+    VEC lo = MM##_srai_epi16(MM##_unpacklo_epi8(MM##_setzero_##SI(),w),8); \
+    VEC hi = MM##_srai_epi16(MM##_unpackhi_epi8(MM##_setzero_##SI(),w),8); \
+    VEC a1 = wide_tap_##S(lo,hi,27), a2 = wide_tap_##S(lo,hi,18), a3 = wide_tap_##S(lo,hi,9); \
+    x[1] = to_signed_##S(MM##_adds_epi8(sp2,a3)); \
+    x[2] = to_signed_##S(MM##_adds_epi8(sp1,a2)); \
+    x[3] = to_signed_##S(MM##_adds_epi8(sp0,a1)); \
+    x[4] = to_signed_##S(MM##_subs_epi8(sq0,a1)); \
+    x[5] = to_signed_##S(MM##_subs_epi8(sq1,a2)); \
+    x[6] = to_signed_##S(MM##_subs_epi8(sq2,a3)); \
+} \
+static inline ATTR void inner_filter_##S(VEC x[8], int limit, int interior, int hev_thresh) { \
+    VEC mask = normal_mask_##S(x[0],x[1],x[2],x[3],x[4],x[5],x[6],x[7],limit,interior); \
+    VEC hev = hev_mask_##S(x[2],x[3],x[4],x[5],hev_thresh); \
+    VEC sp1 = to_signed_##S(x[2]), sp0 = to_signed_##S(x[3]); \
+    VEC sq0 = to_signed_##S(x[4]), sq1 = to_signed_##S(x[5]); \
+    VEC a = MM##_and_##SI(filter_value_##S(sp1,sp0,sq0,sq1,hev),mask); \
+    VEC a1 = shift_right_##S(MM##_adds_epi8(a,MM##_set1_epi8(4)),3); \
+    VEC a3 = MM##_andnot_##SI(hev,shift_right_##S(MM##_adds_epi8(a1,MM##_set1_epi8(1)),1)); \
+    adjust_edge_##S(a,&sp0,&sq0); \
+    x[2] = to_signed_##S(MM##_adds_epi8(sp1,a3)); \
+    x[3] = to_signed_##S(sp0); \
+    x[4] = to_signed_##S(sq0); \
+    x[5] = to_signed_##S(MM##_subs_epi8(sq1,a3)); \
+}
+
+VP8_KERNELS(, __m128i, _mm, si128, sse2)
+VP8_KERNELS(AVX2, __m256i, _mm256, si256, avx2)
+
+static void transform_sse2(const int16_t* coeffs, uint8_t* dst, int blocks) {
+    const __m128i zero = _mm_setzero_si128();
+    for(; blocks > 0; blocks -= 2, coeffs += 32, dst += 8) {
+        __m128i x[4];
+        for(int i = 0; i < 4; i++) {
+            __m128i second = blocks > 1 ? load_8(coeffs+16+4*i) : zero;
+            x[i] = _mm_unpacklo_epi64(load_8(coeffs+4*i),second);
+        }
+        idct_sse2(x);
+        for(int i = 0; i < 4; i++) {
+            __m128i pixels = _mm_unpacklo_epi8(load_8(dst+i*VP8_BPS),zero);
+            pixels = _mm_packus_epi16(_mm_add_epi16(pixels,x[i]),zero);
+            if(blocks > 1) {
+                store_8(dst+i*VP8_BPS,pixels);
+            } else {
+                uint32_t row = _mm_cvtsi128_si32(pixels);
+                memcpy(dst+i*VP8_BPS,&row,4);
+            }
+        }
+    }
+}
+static AVX2 void transform_avx2(const int16_t* coeffs, uint8_t* dst, int blocks) {
+    if(blocks != 4) {
+        transform_sse2(coeffs,dst,blocks);
+        return;
+    }
+    __m256i x[4];
+    for(int i = 0; i < 4; i++) {
+        __m128i lo = _mm_unpacklo_epi64(load_8(coeffs+4*i),load_8(coeffs+16+4*i));
+        __m128i hi = _mm_unpacklo_epi64(load_8(coeffs+32+4*i),load_8(coeffs+48+4*i));
+        x[i] = _mm256_inserti128_si256(_mm256_castsi128_si256(lo),hi,1);
+    }
+    idct_avx2(x);
+    for(int i = 0; i < 4; i++) {
+        __m256i pixels = _mm256_add_epi16(_mm256_cvtepu8_epi16(load_16(dst+i*VP8_BPS)),x[i]);
+        pixels = _mm256_permute4x64_epi64(_mm256_packus_epi16(pixels,pixels),0x08);
+        store_16(dst+i*VP8_BPS,_mm256_castsi256_si128(pixels));
+    }
+}
+
+// Chroma goes through the filters as one vector, u in the low half and v in the high half
+static inline __m128i load_uv(const uint8_t* u, const uint8_t* v) {
+    return _mm_unpacklo_epi64(load_8(u),load_8(v));
+}
+static inline void store_uv(uint8_t* u, uint8_t* v, __m128i x) {
+    store_8(u,x);
+    store_8(v,_mm_unpackhi_epi64(x,x));
+}
+
+// Gathers the 8 pixels either side of a vertical edge into one vector per column, for 16
+// rows: the first 8 from r0 onwards and the rest from r8
+static inline void load_columns(const uint8_t* r0, const uint8_t* r8, int stride, __m128i c[8]) {
+    __m128i t[8], u[8], v[8];
+    for(int i = 0; i < 4; i++) {
+        t[i] = _mm_unpacklo_epi8(load_8(r0+2*i*stride),load_8(r0+(2*i+1)*stride));
+        t[4+i] = _mm_unpacklo_epi8(load_8(r8+2*i*stride),load_8(r8+(2*i+1)*stride));
+    }
+    for(int i = 0; i < 4; i++) {
+        u[2*i] = _mm_unpacklo_epi16(t[2*i],t[2*i+1]);
+        u[2*i+1] = _mm_unpackhi_epi16(t[2*i],t[2*i+1]);
+    }
+    for(int i = 0; i < 2; i++) {
+        v[4*i] = _mm_unpacklo_epi32(u[4*i],u[4*i+2]);
+        v[4*i+1] = _mm_unpackhi_epi32(u[4*i],u[4*i+2]);
+        v[4*i+2] = _mm_unpacklo_epi32(u[4*i+1],u[4*i+3]);
+        v[4*i+3] = _mm_unpackhi_epi32(u[4*i+1],u[4*i+3]);
+    }
+    for(int i = 0; i < 4; i++) {
+        c[2*i] = _mm_unpacklo_epi64(v[i],v[4+i]);
+        c[2*i+1] = _mm_unpackhi_epi64(v[i],v[4+i]);
+    }
+}
+static inline void store_columns(uint8_t* r0, uint8_t* r8, int stride, const __m128i c[8]) {
+    __m128i t[8], u[8], w[8];
+    for(int i = 0; i < 4; i++) {
+        t[2*i] = _mm_unpacklo_epi8(c[2*i],c[2*i+1]);
+        t[2*i+1] = _mm_unpackhi_epi8(c[2*i],c[2*i+1]);
+    }
+    // u[0..3] hold rows 0-3, 4-7, 8-11 and 12-15 of columns 0-3, u[4..7] the same for 4-7
+    for(int half = 0; half < 2; half++) {
+        for(int i = 0; i < 2; i++) {
+            u[4*half+2*i] = _mm_unpacklo_epi16(t[4*half+i],t[4*half+2+i]);
+            u[4*half+2*i+1] = _mm_unpackhi_epi16(t[4*half+i],t[4*half+2+i]);
+        }
+    }
+    for(int i = 0; i < 4; i++) {
+        w[2*i] = _mm_unpacklo_epi32(u[i],u[4+i]);
+        w[2*i+1] = _mm_unpackhi_epi32(u[i],u[4+i]);
+    }
+    for(int i = 0; i < 8; i++) {
+        uint8_t* row = i < 4 ? r0 + 2*i*stride : r8 + 2*(i-4)*stride;
+        store_8(row,w[i]);
+        store_8(row+stride,_mm_unpackhi_epi64(w[i],w[i]));
+    }
+}
+
+static void simple_mb_left_sse2(uint8_t* y, int stride, int limit) {
+    __m128i c[8];
+    load_columns(y-4,y-4+8*stride,stride,c);
+    simple_filter_sse2(c[2],&c[3],&c[4],c[5],limit);
+    store_columns(y-4,y-4+8*stride,stride,c);
+}
+static void simple_mb_above_sse2(uint8_t* y, int stride, int limit) {
+    __m128i p0 = load_16(y-stride), q0 = load_16(y);
+    simple_filter_sse2(load_16(y-2*stride),&p0,&q0,load_16(y+stride),limit);
+    store_16(y-stride,p0);
+    store_16(y,q0);
+}
+static void simple_inner_left_sse2(uint8_t* y, int stride, int limit) {
+    for(int x = 4; x < 16; x += 4) simple_mb_left_sse2(y+x,stride,limit);
+}
+static void simple_inner_above_sse2(uint8_t* y, int stride, int limit) {
+    for(int row = 4; row < 16; row += 4) simple_mb_above_sse2(y+row*stride,stride,limit);
+}
+
+static inline void load_rows(const uint8_t* p, int stride, __m128i x[8]) {
+    for(int i = 0; i < 8; i++) x[i] = load_16(p+(i-4)*stride);
+}
+static inline void load_uv_rows(const uint8_t* u, const uint8_t* v, int stride, __m128i x[8]) {
+    for(int i = 0; i < 8; i++) x[i] = load_uv(u+(i-4)*stride,v+(i-4)*stride);
+}
+// Only p2 to q2 can have changed
+static inline void store_rows(uint8_t* p, int stride, const __m128i x[8]) {
+    for(int i = 1; i < 7; i++) store_16(p+(i-4)*stride,x[i]);
+}
+static inline void store_uv_rows(uint8_t* u, uint8_t* v, int stride, const __m128i x[8]) {
+    for(int i = 1; i < 7; i++) store_uv(u+(i-4)*stride,v+(i-4)*stride,x[i]);
+}
+
+static void mb_left_sse2(uint8_t* y, uint8_t* u, uint8_t* v, int y_stride, int uv_stride, int limit, int interior, int hev_thresh) {
+    __m128i x[8];
+    load_columns(y-4,y-4+8*y_stride,y_stride,x);
+    mb_filter_sse2(x,limit,interior,hev_thresh);
+    store_columns(y-4,y-4+8*y_stride,y_stride,x);
+    load_columns(u-4,v-4,uv_stride,x);
+    mb_filter_sse2(x,limit,interior,hev_thresh);
+    store_columns(u-4,v-4,uv_stride,x);
+}
+static void mb_above_sse2(uint8_t* y, uint8_t* u, uint8_t* v, int y_stride, int uv_stride, int limit, int interior, int hev_thresh) {
+    __m128i x[8];
+    load_rows(y,y_stride,x);
+    mb_filter_sse2(x,limit,interior,hev_thresh);
+    store_rows(y,y_stride,x);
+    load_uv_rows(u,v,uv_stride,x);
+    mb_filter_sse2(x,limit,interior,hev_thresh);
+    store_uv_rows(u,v,uv_stride,x);
+}
+static void inner_left_sse2(uint8_t* y, uint8_t* u, uint8_t* v, int y_stride, int uv_stride, int limit, int interior, int hev_thresh) {
+    __m128i x[8];
+    for(int i = 0; i < 16; i += 4) {
+        // The luma edges at 4, 8 and 12, then the chroma edge at 4
+        uint8_t* r0 = i < 12 ? y+i : u;
+        uint8_t* r8 = i < 12 ? y+i+8*y_stride : v;
+        int stride = i < 12 ? y_stride : uv_stride;
+        load_columns(r0,r8,stride,x);
+        inner_filter_sse2(x,limit,interior,hev_thresh);
+        store_columns(r0,r8,stride,x);
+    }
+}
+static void inner_above_sse2(uint8_t* y, uint8_t* u, uint8_t* v, int y_stride, int uv_stride, int limit, int interior, int hev_thresh) {
+    __m128i x[8];
+    for(int row = 4; row < 16; row += 4) {
+        load_rows(y+row*y_stride,y_stride,x);
+        inner_filter_sse2(x,limit,interior,hev_thresh);
+        store_rows(y+row*y_stride,y_stride,x);
+    }
+    load_uv_rows(u+4*uv_stride,v+4*uv_stride,uv_stride,x);
+    inner_filter_sse2(x,limit,interior,hev_thresh);
+    store_uv_rows(u+4*uv_stride,v+4*uv_stride,uv_stride,x);
+}
+
+// AVX2 filters luma in the low lane alongside both chroma planes in the high lane, wherever
+// they share an edge: the macroblock edges and the first inner edge
+static inline AVX2 void combine_lanes(const __m128i lo[8], const __m128i hi[8], __m256i x[8]) {
+    for(int i = 0; i < 8; i++) x[i] = _mm256_inserti128_si256(_mm256_castsi128_si256(lo[i]),hi[i],1);
+}
+static inline AVX2 void split_lanes(const __m256i x[8], __m128i lo[8], __m128i hi[8]) {
+    for(int i = 0; i < 8; i++) {
+        lo[i] = _mm256_castsi256_si128(x[i]);
+        hi[i] = _mm256_extracti128_si256(x[i],1);
+    }
+}
+static AVX2 void mb_left_avx2(uint8_t* y, uint8_t* u, uint8_t* v, int y_stride, int uv_stride, int limit, int interior, int hev_thresh) {
+    __m128i luma[8], chroma[8];
+    __m256i x[8];
+    load_columns(y-4,y-4+8*y_stride,y_stride,luma);
+    load_columns(u-4,v-4,uv_stride,chroma);
+    combine_lanes(luma,chroma,x);
+    mb_filter_avx2(x,limit,interior,hev_thresh);
+    split_lanes(x,luma,chroma);
+    store_columns(y-4,y-4+8*y_stride,y_stride,luma);
+    store_columns(u-4,v-4,uv_stride,chroma);
+}
+static AVX2 void mb_above_avx2(uint8_t* y, uint8_t* u, uint8_t* v, int y_stride, int uv_stride, int limit, int interior, int hev_thresh) {
+    __m128i luma[8], chroma[8];
+    __m256i x[8];
+    load_rows(y,y_stride,luma);
+    load_uv_rows(u,v,uv_stride,chroma);
+    combine_lanes(luma,chroma,x);
+    mb_filter_avx2(x,limit,interior,hev_thresh);
+    split_lanes(x,luma,chroma);
+    store_rows(y,y_stride,luma);
+    store_uv_rows(u,v,uv_stride,chroma);
+}
+static AVX2 void inner_left_avx2(uint8_t* y, uint8_t* u, uint8_t* v, int y_stride, int uv_stride, int limit, int interior, int hev_thresh) {
+    __m128i luma[8], chroma[8];
+    __m256i x[8];
+    load_columns(y,y+8*y_stride,y_stride,luma);
+    load_columns(u,v,uv_stride,chroma);
+    combine_lanes(luma,chroma,x);
+    inner_filter_avx2(x,limit,interior,hev_thresh);
+    split_lanes(x,luma,chroma);
+    store_columns(y,y+8*y_stride,y_stride,luma);
+    store_columns(u,v,uv_stride,chroma);
+    for(int i = 4; i < 12; i += 4) {
+        load_columns(y+i,y+i+8*y_stride,y_stride,luma);
+        inner_filter_sse2(luma,limit,interior,hev_thresh);
+        store_columns(y+i,y+i+8*y_stride,y_stride,luma);
+    }
+}
+static AVX2 void inner_above_avx2(uint8_t* y, uint8_t* u, uint8_t* v, int y_stride, int uv_stride, int limit, int interior, int hev_thresh) {
+    __m128i luma[8], chroma[8];
+    __m256i x[8];
+    load_rows(y+4*y_stride,y_stride,luma);
+    load_uv_rows(u+4*uv_stride,v+4*uv_stride,uv_stride,chroma);
+    combine_lanes(luma,chroma,x);
+    inner_filter_avx2(x,limit,interior,hev_thresh);
+    split_lanes(x,luma,chroma);
+    store_rows(y+4*y_stride,y_stride,luma);
+    store_uv_rows(u+4*uv_stride,v+4*uv_stride,uv_stride,chroma);
+    for(int row = 8; row < 16; row += 4) {
+        load_rows(y+row*y_stride,y_stride,luma);
+        inner_filter_sse2(luma,limit,interior,hev_thresh);
+        store_rows(y+row*y_stride,y_stride,luma);
+    }
+}
+#endif
+
+static struct vp8_kernels vp8_kernels;
+static pthread_once_t vp8_kernels_once = PTHREAD_ONCE_INIT;
+
+static void init_vp8_kernels(void) {
+    vp8_kernels = (struct vp8_kernels){
+        .transform = transform_c,
+        .simple_mb_left = simple_mb_left_c,
+        .simple_mb_above = simple_mb_above_c,
+        .simple_inner_left = simple_inner_left_c,
+        .simple_inner_above = simple_inner_above_c,
+        .mb_left = mb_left_c,
+        .mb_above = mb_above_c,
+        .inner_left = inner_left_c,
+        .inner_above = inner_above_c
+    };
+#if defined(__SSE2__)
+    vp8_kernels = (struct vp8_kernels){
+        .transform = transform_sse2,
+        .simple_mb_left = simple_mb_left_sse2,
+        .simple_mb_above = simple_mb_above_sse2,
+        .simple_inner_left = simple_inner_left_sse2,
+        .simple_inner_above = simple_inner_above_sse2,
+        .mb_left = mb_left_sse2,
+        .mb_above = mb_above_sse2,
+        .inner_left = inner_left_sse2,
+        .inner_above = inner_above_sse2
+    };
+    if(__builtin_cpu_supports("avx2")) {
+        vp8_kernels.transform = transform_avx2;
+        vp8_kernels.mb_left = mb_left_avx2;
+        vp8_kernels.mb_above = mb_above_avx2;
+        vp8_kernels.inner_left = inner_left_avx2;
+        vp8_kernels.inner_above = inner_above_avx2;
+    }
+#endif
+}
+
+const struct vp8_kernels* get_vp8_kernels(void) {
+    pthread_once(&vp8_kernels_once,init_vp8_kernels);
+    return &vp8_kernels;
+}
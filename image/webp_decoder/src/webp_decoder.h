@@ -0,0 +1,359 @@
+#ifndef WEBP_DECODER_H
+#define WEBP_DECODER_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <memory.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "image_output.h"
+#include "threads.h"
+
+enum webp_error {
+    WEBP_OK,
+    WEBP_ERROR_INVALID_DATA,
+    WEBP_ERROR_TRUNCATED,
+    WEBP_ERROR_UNSUPPORTED,
+    WEBP_ERROR_OUT_OF_MEMORY,
+    WEBP_ERROR_BUFFER_TOO_SMALL
+};
+
+// Errors unwind to the handler set on the current thread, or end the process if there is none
+_Noreturn void webp_raise(enum webp_error error, int line, const char* message);
+#define err(x) webp_raise(WEBP_ERROR_INVALID_DATA,__LINE__,x)
+#define assert(x,y) {if(!(x)) webp_raise(WEBP_ERROR_INVALID_DATA,__LINE__,y);}
+#define todo(x) webp_raise(WEBP_ERROR_UNSUPPORTED,__LINE__,x)
+#define check_alloc(x) {if((x)==NULL) webp_raise(WEBP_ERROR_OUT_OF_MEMORY,__LINE__,"Error allocating memory");}
+
+// Progress and header details are only printed by the command line tool
+extern bool webp_verbose;
+#define log_info(...) {if(webp_verbose) printf(__VA_ARGS__);}
+
+#define ceil_div(n,d) (((n)+(d)-1)/(d))
+
+typedef uint32_t pixel_t;
+typedef uint16_t symbol_t;
+
+struct image_data {
+    pixel_t* data;
+    uint16_t width;
+    uint16_t height;
+};
+
+struct bitstream {
+    uint8_t* data;
+    uint64_t current_read;
+    // Bits of data actually present. Reads are only checked against this once per symbol or
+    // pixel, or once per row where the data left covers it, so the buffer must carry
+    // BITSTREAM_PADDING zero bytes past the end.
+    uint64_t bit_length;
+    // Where to unwind to when the data runs out, or NULL when running out is an error
+    jmp_buf* underflow;
+};
+#define BITSTREAM_PADDING 64
+
+// Bump allocator for everything decoded from the headers, so it can all be dropped at once
+struct arena {
+    struct arena_block* first;
+    struct arena_block* current;
+};
+
+struct prefix_code_entry {
+    symbol_t symbol;
+    uint8_t bits;
+};
+struct prefix_code {
+    struct prefix_code_entry *table;
+    uint8_t total_bits;
+};
+struct prefix_group {
+    struct prefix_code codes[5];
+};
+
+// Everything needed to carry on entropy decoding an image from any pixel
+struct entropy_image {
+    uint8_t colour_cache_bits;
+    pixel_t* colour_cache;
+    uint8_t meta_prefix_bits;
+    struct image_data meta_prefix_image;
+    uint32_t prefix_group_count;
+    struct prefix_group* groups;
+};
+
+enum transform_type {
+    PREDICTOR_TRANSFORM,
+    COLOUR_TRANSFORM,
+    SUBTRACT_GREEN_TRANSFORM,
+    COLOUR_INDEXING_TRANSFORM
+};
+extern const char* transform_names[4];
+
+struct transform {
+    enum transform_type type;
+    // For colour indexing this is log2 of the number of pixels bundled into each coded pixel
+    uint8_t block_scale;
+    // Width of the image this transform produces
+    uint16_t width;
+    struct image_data subimage;
+    // Colour indexing only: the palette padded to 256 entries, or when pixels are bundled,
+    // the 1<<block_scale output pixels for every possible index byte
+    pixel_t* palette_lut;
+};
+
+struct thread_pool {
+    pthread_t* threads;
+    int thread_count;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    void (*job)(void* context, uint32_t index);
+    void* context;
+    uint32_t count;
+    uint32_t next;
+    uint32_t limit;
+    uint32_t window;
+    uint8_t* done;
+    bool shutdown;
+};
+
+// The inverse transforms run together over bands of rows, in the reverse of the order they were read
+struct transform_pipeline {
+    struct transform transforms[4];
+    uint8_t count;
+    uint16_t width;
+    uint16_t height;
+    // Width of the entropy coded image, smaller than width when colour indexing bundles pixels
+    uint16_t coded_width;
+    // The row above the current band as the predictor left it, before later transforms ran
+    pixel_t* predictor_top_row;
+    // Pool to split bands over, or NULL to run them on the calling thread. Rows then go through
+    // the predictor as a wavefront, each row tracking how far along it is for the one below.
+    struct thread_pool* pool;
+    _Atomic uint32_t* row_progress;
+};
+
+enum webp_status {
+    WEBP_STATUS_DONE,
+    WEBP_STATUS_NEED_MORE_DATA
+};
+
+// Called with each run of finished rows, y being the index of the first one
+typedef void (*webp_row_callback)(void* user, const pixel_t* rows, uint32_t stride, uint32_t y, uint32_t row_count);
+
+// Incremental decoder: the file is appended as it arrives, and rows are handed out as soon as
+// they have been entropy decoded and transformed. Rows go into output when it is set, which
+// may be done any time before the first row is finished, otherwise through an internal band.
+struct webp_decoder {
+    // Input received so far, followed by BITSTREAM_PADDING zero bytes
+    uint8_t* data;
+    size_t size;
+    size_t capacity;
+    // Size of a bare VP8L bitstream, or 0 when decoding a whole file
+    size_t bitstream_size;
+    // Size of the VP8 chunk when the file is lossy, which is only decoded once it has all arrived
+    uint32_t vp8_size;
+    struct bitstream bitstream;
+    jmp_buf underflow;
+    struct arena arena;
+    bool headers_done;
+    uint16_t width;
+    uint16_t height;
+    bool use_alpha;
+    struct transform_pipeline pipeline;
+    struct entropy_image entropy;
+    // The entropy coded image at coded width, kept whole as LZ77 copies can reach back to any row
+    struct image_data image;
+    uint32_t pixel;
+    // Position and colour cache at the last row boundary, restored when the data runs out
+    uint64_t checkpoint_bit;
+    uint32_t checkpoint_pixel;
+    pixel_t* checkpoint_colour_cache;
+    uint32_t rows_done;
+    webp_row_callback callback;
+    void* user;
+    pixel_t* output;
+    uint32_t output_stride;
+    pixel_t* band;
+    uint32_t band_rows;
+    // Set once the buffers above are ready for the main image. They are kept, along with
+    // the arena's blocks, when the decoder is reset for another image.
+    bool pixels_started;
+    size_t image_capacity;
+    size_t checkpoint_capacity;
+    size_t band_capacity;
+    // Threads to run the inverse transforms on, which large images spread over a pool
+    int thread_count;
+    struct thread_pool pool;
+    bool pool_started;
+};
+
+// One frame of an animation, or the single image of an extended file
+struct webp_frame {
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
+    uint32_t height;
+    uint32_t duration;
+    // Alpha blend onto the canvas rather than overwriting it
+    bool blend;
+    // Clear the frame's rectangle before the next frame is drawn
+    bool dispose;
+    bool has_alpha;
+    bool lossy;
+    // The frame's VP8 or VP8L bitstream, pointing into the file
+    const uint8_t* data;
+    uint32_t size;
+    // ALPH chunk contents for lossy frames with alpha, NULL otherwise
+    const uint8_t* alpha;
+    uint32_t alpha_size;
+};
+
+struct webp_animation {
+    uint32_t canvas_width;
+    uint32_t canvas_height;
+    // The file's alpha flag, set when any frame may have transparent pixels
+    bool has_alpha;
+    pixel_t background;
+    uint16_t loop_count;
+    uint32_t frame_count;
+    struct webp_frame* frames;
+};
+
+// Decodes still images and animations from memory, keeping every buffer it needs between calls.
+// Errors are returned rather than ending the process, with where they were found kept for
+// diagnostics. Each context is for one thread at a time.
+struct webp_context {
+    struct webp_decoder decoder;
+    struct webp_decoder alpha_decoder;
+    struct webp_animation container;
+    int error_line;
+    const char* error_message;
+};
+
+// Called with the whole canvas once each frame has been composited onto it
+typedef void (*webp_frame_callback)(void* user, const pixel_t* canvas, uint32_t frame);
+
+
+// Shrinks an image by area averaging as its rows arrive, handing out each output row once done
+struct image_scaler {
+    uint32_t src_width;
+    uint32_t src_height;
+    uint32_t width;
+    uint32_t height;
+    // The output column each source column starts in and its weight there, the rest going to the next
+    uint32_t* column_output;
+    uint32_t* column_weight;
+    // Alpha weighted colour and alpha sums of the current source row, then of the two output rows it
+    // can touch, each with a padding entry past the end
+    uint64_t* row;
+    uint64_t* sums;
+    pixel_t* output_row;
+    uint32_t src_y;
+    uint32_t y;
+    webp_row_callback callback;
+    void* user;
+};
+
+// Stride of the buffer VP8 macroblocks are reconstructed in
+#define VP8_BPS 32
+
+// VP8 inverse DCT and loop filter kernels, picked for the CPU on first use. The filters take
+// the first pixel past the edge, and limit is the edge limit for the edges they filter.
+struct vp8_kernels {
+    // Adds the inverse DCT of 1, 2 or 4 side by side 4x4 blocks to the prediction in dst
+    void (*transform)(const int16_t* coeffs, uint8_t* dst, int blocks);
+    // The simple filter only touches luma
+    void (*simple_mb_left)(uint8_t* y, int stride, int limit);
+    void (*simple_mb_above)(uint8_t* y, int stride, int limit);
+    void (*simple_inner_left)(uint8_t* y, int stride, int limit);
+    void (*simple_inner_above)(uint8_t* y, int stride, int limit);
+    void (*mb_left)(uint8_t* y, uint8_t* u, uint8_t* v, int y_stride, int uv_stride, int limit, int interior, int hev_thresh);
+    void (*mb_above)(uint8_t* y, uint8_t* u, uint8_t* v, int y_stride, int uv_stride, int limit, int interior, int hev_thresh);
+    void (*inner_left)(uint8_t* y, uint8_t* u, uint8_t* v, int y_stride, int uv_stride, int limit, int interior, int hev_thresh);
+    void (*inner_above)(uint8_t* y, uint8_t* u, uint8_t* v, int y_stride, int uv_stride, int limit, int interior, int hev_thresh);
+};
+
+// webp_decoder.c
+uint8_t read_bit(struct bitstream* state);
+uint64_t read_bits(struct bitstream* state, uint8_t bit_count);
+void check_bitstream(struct bitstream* state);
+struct image_data arena_new_image(struct arena* arena, uint16_t width, uint16_t height);
+void read_entropy_header(struct bitstream* bitstream, struct entropy_image* entropy, const struct image_data* image, bool is_main_image, struct arena* arena);
+uint32_t decode_pixels(struct bitstream* bitstream, struct entropy_image* entropy, struct image_data* image, uint32_t pixel, uint32_t pixel_end);
+void decode_image(struct bitstream* bitstream, struct image_data* image, struct arena* arena);
+
+// arena.c
+void init_arena(struct arena* arena);
+void* arena_alloc(struct arena* arena, size_t size);
+void arena_reset(struct arena* arena);
+void free_arena(struct arena* arena);
+
+// predictor_transform.c
+void apply_predictor_span(const struct transform* transform, pixel_t* row, pixel_t* top, uint32_t y, uint32_t x_start, uint32_t x_end);
+void apply_predictor_rows(const struct transform* transform, pixel_t* rows, uint32_t stride, uint32_t y_start, uint32_t y_end, pixel_t* top_row);
+
+// transforms.c
+void init_colour_indexing(struct transform* transform, struct arena* arena);
+void init_transform_pipeline(struct transform_pipeline* pipeline, uint16_t width, uint16_t height, struct arena* arena);
+uint32_t transform_band_rows(const struct transform_pipeline* pipeline);
+void init_transform_threads(struct transform_pipeline* pipeline, struct thread_pool* pool, uint32_t band_rows, struct arena* arena);
+void transform_band(struct transform_pipeline* pipeline, const pixel_t* src, pixel_t* dst, uint32_t stride, uint32_t y_start, uint32_t y_end);
+
+// thread_pool.c
+void init_thread_pool(struct thread_pool* pool, int thread_count);
+void free_thread_pool(struct thread_pool* pool);
+void thread_pool_start(struct thread_pool* pool, void (*job)(void* context, uint32_t index), void* context, uint32_t count, uint32_t window);
+void thread_pool_wait(struct thread_pool* pool, uint32_t index);
+void thread_pool_finish(struct thread_pool* pool);
+
+// animation.c
+void read_webp_container(struct webp_animation* animation, const uint8_t* data, size_t size);
+void decode_webp_animation(const struct webp_animation* animation, int thread_count, webp_frame_callback callback, void* user);
+void free_webp_animation(struct webp_animation* animation);
+void decode_webp_frame(const struct webp_frame* frame, pixel_t* output, uint32_t stride, struct webp_decoder* decoder, struct webp_decoder* alpha_decoder);
+
+// vp8_tables.c
+extern const uint8_t vp8_default_coefficient_probs[4][8][3][11];
+extern const uint8_t vp8_coefficient_update_probs[4][8][3][11];
+extern const uint8_t vp8_subblock_mode_probs[10][10][9];
+extern const uint8_t vp8_dc_quant[128];
+extern const uint16_t vp8_ac_quant[128];
+
+// vp8_dsp.c
+const struct vp8_kernels* get_vp8_kernels(void);
+
+// vp8_decoder.c
+void read_vp8_frame_size(const uint8_t* data, size_t size, uint16_t* width, uint16_t* height);
+void decode_vp8(const uint8_t* data, size_t size, pixel_t* output, uint32_t output_stride, webp_row_callback callback, void* user, struct arena* arena);
+void apply_alpha_chunk(const uint8_t* data, size_t size, pixel_t* pixels, uint32_t stride, uint32_t width, uint32_t height, struct arena* arena, struct webp_decoder* alpha_decoder);
+
+// scaler.c
+void fit_scaled_size(uint32_t width, uint32_t height, uint32_t max_size, uint32_t* scaled_width, uint32_t* scaled_height);
+void init_image_scaler(struct image_scaler* scaler, uint32_t src_width, uint32_t src_height, uint32_t width, uint32_t height, webp_row_callback callback, void* user);
+void scale_rows(struct image_scaler* scaler, const pixel_t* rows, uint32_t stride, uint32_t row_count);
+void free_image_scaler(struct image_scaler* scaler);
+
+// context.c
+void init_webp_context(struct webp_context* context);
+void free_webp_context(struct webp_context* context);
+// has_alpha is set from the file's header, so images marked as having alpha may still be opaque
+enum webp_error webp_get_info(struct webp_context* context, const uint8_t* data, size_t size, uint32_t* width, uint32_t* height, bool* has_alpha);
+// Rows go output_stride pixels apart, and the image must fit in output_stride by output_height
+enum webp_error webp_decode_argb(struct webp_context* context, const uint8_t* data, size_t size, pixel_t* output, uint32_t output_stride, uint32_t output_height);
+bool webp_is_animation(const uint8_t* data, size_t size);
+// Frames are decoded on thread_count threads and composited onto the canvas, webp_get_info's size,
+// which callback is handed after each one
+enum webp_error webp_decode_animation(struct webp_context* context, const uint8_t* data, size_t size, int thread_count, webp_frame_callback callback, void* user);
+enum webp_error webp_catch(void (*body)(void* context), void* context, int* line, const char** message);
+
+// incremental.c
+void init_webp_decoder(struct webp_decoder* decoder, webp_row_callback callback, void* user);
+void init_vp8l_decoder(struct webp_decoder* decoder, size_t size, webp_row_callback callback, void* user);
+void reset_webp_decoder(struct webp_decoder* decoder, size_t bitstream_size, webp_row_callback callback, void* user);
+enum webp_status webp_decoder_append(struct webp_decoder* decoder, const uint8_t* data, size_t size);
+void free_webp_decoder(struct webp_decoder* decoder);
+
+#endif
@@ -0,0 +1,15 @@
+# Profile guided build shared by the decoders. Each Makefile sets CC, SOURCES, FLAGS and TARGET,
+# and PGO_TRAINING to the commands that make its training inputs in target/pgo and run the
+# instrumented build on them, then includes this at its end.
+PROFDATA = llvm-profdata
+
+# Clang writes raw profiles that have to be merged before they can be used, GCC's .gcda files
+# being read straight from the directory
+.PHONY: pgo
+pgo:
+	rm -rf target/pgo
+	mkdir -p target/pgo
+	$(CC) $(SOURCES) -o $(TARGET) $(FLAGS) -flto -fprofile-generate=target/pgo
+	$(PGO_TRAINING)
+	if $(CC) --version | grep -q clang; then $(PROFDATA) merge -output=target/pgo/default.profdata target/pgo/*.profraw; fi
+	$(CC) $(SOURCES) -o $(TARGET) $(FLAGS) -flto -fprofile-use=target/pgo